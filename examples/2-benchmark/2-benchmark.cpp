@@ -0,0 +1,367 @@
+#include "Particle.h"
+
+#include "EthernetCellularRK.h"
+
+// Failover benchmark and soak test
+//
+// Repeatedly takes Ethernet down, measures how long it takes to get back to the cloud over
+// the backup interface and then back over Ethernet, and how publishes fare across each switch.
+// After each cycle the percentile summaries are logged, and after NUM_CYCLES the summary is
+// published as a benchSummary event. Run it on each Device OS release and compare the results
+// to catch failover latency regressions.
+
+// Optional logging
+SerialLogHandler LogHandler(LOG_LEVEL_INFO, {
+    { "app.ethcell", LOG_LEVEL_INFO },
+    { "app.bench", LOG_LEVEL_INFO }
+});
+
+// SYSTEM_THREAD(ENABLED) and SYSTEM_MODE(SEMI_AUTOMATIC) are required
+SYSTEM_THREAD(ENABLED);
+SYSTEM_MODE(SEMI_AUTOMATIC);
+
+static Logger _log("app.bench");
+
+// How Ethernet is taken down:
+// - FAULT_SOFTWARE calls Ethernet.disconnect(). The library notices the cloud connection is lost
+//   and fails over, then reconnects Ethernet itself at the next Ethernet retry.
+// - FAULT_PHY_RESET holds the W5500 reset line low (PHY_RESET_PIN) for ETHERNET_DOWN_TIME. This
+//   is closer to a cable pull because the library sees the link go down. Wire a spare GPIO to the
+//   W5500 RSTn pin; it's held high the rest of the time.
+enum FaultMode {
+    FAULT_SOFTWARE,
+    FAULT_PHY_RESET
+};
+const FaultMode FAULT_MODE = FAULT_SOFTWARE;
+const pin_t PHY_RESET_PIN = D6;
+
+const size_t NUM_CYCLES = 50;                           // Cycles before publishing the summary and stopping
+const std::chrono::milliseconds ETHERNET_SETTLE_TIME = 30s; // Time on Ethernet before injecting the fault
+const std::chrono::milliseconds ETHERNET_DOWN_TIME = 30s;   // FAULT_PHY_RESET only: how long to hold reset
+const std::chrono::milliseconds RETRY_ETHERNET_PERIOD = 2min; // Time on the backup before retrying Ethernet
+const std::chrono::milliseconds CYCLE_TIMEOUT = 15min;  // Give up on a cycle that never gets back to Ethernet
+const std::chrono::milliseconds PUBLISH_PERIOD = 10s;   // Probe publish period
+const char * const PROBE_EVENT_NAME = "benchProbe";
+const char * const SUMMARY_EVENT_NAME = "benchSummary";
+
+/**
+ * @brief Fixed-size set of measurements with percentile reporting
+ */
+class BenchmarkSamples {
+public:
+    BenchmarkSamples(const char *name) : name(name) {};
+
+    void add(uint32_t value) {
+        if (count < MAX_SAMPLES) {
+            samples[count++] = value;
+        }
+    }
+
+    /**
+     * @brief Returns the value at the given percentile (0 - 100) using the nearest rank method
+     */
+    uint32_t percentile(int pct) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint32_t sorted[MAX_SAMPLES];
+        memcpy(sorted, samples, count * sizeof(uint32_t));
+        std::sort(sorted, sorted + count);
+
+        size_t rank = (pct * count + 99) / 100;
+        return sorted[(rank > 0) ? (rank - 1) : 0];
+    }
+
+    void log() const {
+        _log.info("%-14s n=%2u p50=%6lu p90=%6lu p99=%6lu max=%6lu", name, (unsigned)count,
+            (unsigned long)percentile(50), (unsigned long)percentile(90), (unsigned long)percentile(99), (unsigned long)percentile(100));
+    }
+
+    void write(JSONBufferWriter &writer) const {
+        writer.name(name).beginArray()
+            .value((unsigned long)percentile(50))
+            .value((unsigned long)percentile(90))
+            .value((unsigned long)percentile(99))
+            .value((unsigned long)percentile(100))
+            .endArray();
+    }
+
+    static const size_t MAX_SAMPLES = NUM_CYCLES;
+
+protected:
+    const char *name;
+    uint32_t samples[MAX_SAMPLES];
+    size_t count = 0;
+};
+
+// All times are in milliseconds
+BenchmarkSamples failoverTime("failover");          // Fault injected to cloud connected on the backup
+BenchmarkSamples backupTimeToCloud("backupCloud");  // Library time to cloud on the backup, from trying it
+BenchmarkSamples returnTime("return");              // Leaving the backup to cloud connected on Ethernet
+BenchmarkSamples ethernetTimeToCloud("ethCloud");   // Library time to cloud on Ethernet, from trying it
+BenchmarkSamples backupFirstPublish("backupPub");   // Cloud connected on the backup to the first acknowledged publish
+BenchmarkSamples ethernetFirstPublish("ethPub");    // Cloud connected on Ethernet to the first acknowledged publish
+BenchmarkSamples publishRoundTrip("pubRtt");        // Round-trip time of the first acknowledged publish on each interface
+BenchmarkSamples droppedPublishes("dropped");       // Failed publishes per cycle
+
+enum class BenchState {
+    WAIT_ETHERNET,      // Waiting to be cloud connected on Ethernet
+    SETTLE,             // On Ethernet, waiting ETHERNET_SETTLE_TIME
+    WAIT_BACKUP,        // Fault injected, waiting for the backup
+    WAIT_RETURN,        // On the backup, waiting for Ethernet to come back
+    DONE                // Summary published, no more faults
+};
+BenchState benchState = BenchState::WAIT_ETHERNET;
+unsigned long benchStateTime = 0;
+size_t cycleCount = 0;
+
+// Set from the interface change callback
+EthernetCellular::ActiveInterface currentInterface = EthernetCellular::ActiveInterface::NONE;
+unsigned long interfaceChangeTime = 0;
+unsigned long leaveBackupTime = 0;
+
+unsigned long faultTime = 0;
+bool phyResetActive = false;
+
+bool publishInProgress = false;
+particle::Future<bool> publishFuture;
+unsigned long publishStart = 0;
+unsigned long lastPublish = 0;
+uint32_t publishSeq = 0;
+uint32_t cycleDropped = 0;
+bool firstPublishPending = false;
+
+void interfaceChangeCallback(EthernetCellular::ActiveInterface oldInterface, EthernetCellular::ActiveInterface newInterface);
+void benchmarkLoop();
+void publishLoop();
+void injectFault();
+void finishCycle(bool complete);
+void publishSummary();
+void setBenchState(BenchState newState);
+
+void setup() {
+    // Wait for a USB serial connection for up to 15 seconds
+    // Only used during testing so all of the log messages can be seen
+    waitFor(Serial.isConnected, 15000); delay(2000);
+
+    if (FAULT_MODE == FAULT_PHY_RESET) {
+        pinMode(PHY_RESET_PIN, OUTPUT);
+        digitalWrite(PHY_RESET_PIN, HIGH);
+    }
+
+    EthernetCellular::instance()
+        .withRetryEthernetPeriod(RETRY_ETHERNET_PERIOD)
+        .withInterfaceChangeCallback(interfaceChangeCallback)
+        .setup();
+
+    _log.info("failover benchmark starting, Device OS %s, %s fault", System.version().c_str(),
+        (FAULT_MODE == FAULT_PHY_RESET) ? "PHY reset" : "software");
+}
+
+void loop() {
+    EthernetCellular::instance().loop();
+
+    benchmarkLoop();
+    publishLoop();
+}
+
+void interfaceChangeCallback(EthernetCellular::ActiveInterface oldInterface, EthernetCellular::ActiveInterface newInterface) {
+    unsigned long now = millis();
+
+    if (newInterface == EthernetCellular::ActiveInterface::NONE && oldInterface != EthernetCellular::ActiveInterface::ETHERNET) {
+        // Leaving the backup to retry Ethernet
+        leaveBackupTime = now;
+    }
+
+    currentInterface = newInterface;
+    interfaceChangeTime = now;
+
+    if (newInterface != EthernetCellular::ActiveInterface::NONE) {
+        // Publish right away to measure the first publish on the new interface
+        firstPublishPending = true;
+        lastPublish = 0;
+    }
+}
+
+void benchmarkLoop() {
+    EthernetCellular &ethCell = EthernetCellular::instance();
+    unsigned long now = millis();
+
+    if (phyResetActive && now - faultTime >= (unsigned long) ETHERNET_DOWN_TIME.count()) {
+        _log.info("releasing PHY reset");
+        digitalWrite(PHY_RESET_PIN, HIGH);
+        phyResetActive = false;
+    }
+
+    switch(benchState) {
+        case BenchState::WAIT_ETHERNET:
+            if (currentInterface == EthernetCellular::ActiveInterface::ETHERNET && Particle.connected()) {
+                setBenchState(BenchState::SETTLE);
+            }
+            break;
+
+        case BenchState::SETTLE:
+            if (currentInterface != EthernetCellular::ActiveInterface::ETHERNET) {
+                setBenchState(BenchState::WAIT_ETHERNET);
+            }
+            else
+            if (now - benchStateTime >= (unsigned long) ETHERNET_SETTLE_TIME.count() && !publishInProgress) {
+                injectFault();
+                setBenchState(BenchState::WAIT_BACKUP);
+            }
+            break;
+
+        case BenchState::WAIT_BACKUP:
+            if (currentInterface != EthernetCellular::ActiveInterface::NONE && currentInterface != EthernetCellular::ActiveInterface::ETHERNET) {
+                uint32_t elapsed = (uint32_t)(interfaceChangeTime - faultTime);
+                EthernetCellular::Stats stats = ethCell.getStats();
+                uint32_t libraryTime = (currentInterface == EthernetCellular::ActiveInterface::WIFI) ? stats.wifi.lastTimeToCloud : stats.cellular.lastTimeToCloud;
+
+                _log.info("cycle %u: on backup after %lu ms (library time to cloud %lu ms)", (unsigned)(cycleCount + 1), (unsigned long)elapsed, (unsigned long)libraryTime);
+                failoverTime.add(elapsed);
+                backupTimeToCloud.add(libraryTime);
+                setBenchState(BenchState::WAIT_RETURN);
+            }
+            else
+            if (now - benchStateTime >= (unsigned long) CYCLE_TIMEOUT.count()) {
+                _log.error("cycle %u: timed out waiting for the backup", (unsigned)(cycleCount + 1));
+                finishCycle(false);
+            }
+            break;
+
+        case BenchState::WAIT_RETURN:
+            if (currentInterface == EthernetCellular::ActiveInterface::ETHERNET && Particle.connected()) {
+                uint32_t elapsed = (uint32_t)(interfaceChangeTime - leaveBackupTime);
+                uint32_t libraryTime = ethCell.getStats().ethernet.lastTimeToCloud;
+
+                _log.info("cycle %u: back on Ethernet after %lu ms (library time to cloud %lu ms)", (unsigned)(cycleCount + 1), (unsigned long)elapsed, (unsigned long)libraryTime);
+                returnTime.add(elapsed);
+                ethernetTimeToCloud.add(libraryTime);
+                finishCycle(true);
+            }
+            else
+            if (now - benchStateTime >= (unsigned long) CYCLE_TIMEOUT.count()) {
+                _log.error("cycle %u: timed out waiting for Ethernet", (unsigned)(cycleCount + 1));
+                finishCycle(false);
+            }
+            break;
+
+        case BenchState::DONE:
+            break;
+    }
+}
+
+void publishLoop() {
+    unsigned long now = millis();
+
+    if (publishInProgress) {
+        if (!publishFuture.isDone()) {
+            return;
+        }
+        publishInProgress = false;
+        EthernetCellular::instance().endCloudOperation();
+
+        if (publishFuture.isSucceeded()) {
+            if (firstPublishPending && publishStart >= interfaceChangeTime) {
+                // First acknowledged publish started since the interface changed
+                firstPublishPending = false;
+                uint32_t sinceChange = (uint32_t)(now - interfaceChangeTime);
+                bool onEthernet = (currentInterface == EthernetCellular::ActiveInterface::ETHERNET);
+
+                if ((onEthernet && benchState != BenchState::WAIT_ETHERNET) || (!onEthernet && benchState == BenchState::WAIT_RETURN)) {
+                    (onEthernet ? ethernetFirstPublish : backupFirstPublish).add(sinceChange);
+                    publishRoundTrip.add((uint32_t)(now - publishStart));
+                }
+            }
+        }
+        else {
+            cycleDropped++;
+            _log.info("publish %lu failed", (unsigned long)publishSeq);
+        }
+    }
+
+    if (benchState == BenchState::DONE || now - lastPublish < (unsigned long) PUBLISH_PERIOD.count()) {
+        return;
+    }
+    lastPublish = now;
+
+    // Publishes are attempted on schedule even while switching, so the ones lost during a
+    // switch are counted as dropped
+    char data[32];
+    snprintf(data, sizeof(data), "%lu", (unsigned long)++publishSeq);
+
+    EthernetCellular::instance().beginCloudOperation();
+    publishStart = now;
+    publishFuture = Particle.publish(PROBE_EVENT_NAME, data, PRIVATE | WITH_ACK);
+    publishInProgress = true;
+}
+
+void injectFault() {
+    faultTime = millis();
+    cycleDropped = 0;
+
+    if (FAULT_MODE == FAULT_PHY_RESET) {
+        _log.info("cycle %u: holding PHY reset", (unsigned)(cycleCount + 1));
+        digitalWrite(PHY_RESET_PIN, LOW);
+        phyResetActive = true;
+    }
+    else {
+        _log.info("cycle %u: disconnecting Ethernet", (unsigned)(cycleCount + 1));
+        Ethernet.disconnect();
+    }
+}
+
+void finishCycle(bool complete) {
+    cycleCount++;
+    if (complete) {
+        droppedPublishes.add(cycleDropped);
+    }
+
+    _log.info("after %u cycles (%lu publishes dropped this cycle):", (unsigned)cycleCount, (unsigned long)cycleDropped);
+    failoverTime.log();
+    backupTimeToCloud.log();
+    returnTime.log();
+    ethernetTimeToCloud.log();
+    backupFirstPublish.log();
+    ethernetFirstPublish.log();
+    publishRoundTrip.log();
+    droppedPublishes.log();
+
+    if (cycleCount >= NUM_CYCLES) {
+        publishSummary();
+        setBenchState(BenchState::DONE);
+    }
+    else {
+        setBenchState(BenchState::WAIT_ETHERNET);
+    }
+}
+
+void publishSummary() {
+    char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    memset(buf, 0, sizeof(buf));
+
+    JSONBufferWriter writer(buf, sizeof(buf) - 1);
+    writer.beginObject();
+    writer.name("dos").value(System.version().c_str());
+    writer.name("fault").value((FAULT_MODE == FAULT_PHY_RESET) ? "phy" : "sw");
+    writer.name("cycles").value((unsigned)cycleCount);
+    failoverTime.write(writer);
+    backupTimeToCloud.write(writer);
+    returnTime.write(writer);
+    ethernetTimeToCloud.write(writer);
+    backupFirstPublish.write(writer);
+    ethernetFirstPublish.write(writer);
+    publishRoundTrip.write(writer);
+    droppedPublishes.write(writer);
+    writer.endObject();
+
+    _log.info("summary %s", buf);
+
+    // The cloud is connected over Ethernet at the end of the last cycle, unless it timed out
+    Particle.publish(SUMMARY_EVENT_NAME, buf, PRIVATE | WITH_ACK);
+}
+
+void setBenchState(BenchState newState) {
+    benchState = newState;
+    benchStateTime = millis();
+}
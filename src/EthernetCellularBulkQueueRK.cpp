@@ -0,0 +1,292 @@
+#include "EthernetCellularBulkQueueRK.h"
+
+#if HAL_PLATFORM_FILESYSTEM
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static Logger _log("app.ethcell");
+
+EthernetCellularBulkQueue::EthernetCellularBulkQueue(const char *dirPath) : dirPath(dirPath) {
+}
+
+EthernetCellularBulkQueue::~EthernetCellularBulkQueue() {
+    abortCurrent();
+    delete[] chunkBuf;
+}
+
+void EthernetCellularBulkQueue::setup() {
+    if (!chunkBuf) {
+        chunkBuf = new uint8_t[chunkSize];
+    }
+
+    mkdir(dirPath, 0777);
+
+    DIR *dir = opendir(dirPath);
+    if (!dir) {
+        _log.error("bulk queue could not open %s", dirPath);
+        return;
+    }
+
+    mutex.lock();
+    items.clear();
+    totalBytes = 0;
+
+    while(true) {
+        struct dirent *ent = readdir(dir);
+        if (!ent) {
+            break;
+        }
+        if (ent->d_type != DT_REG) {
+            continue;
+        }
+
+        uint32_t id = 0;
+        if (sscanf(ent->d_name, "%lu", (unsigned long *)&id) != 1 || id == 0) {
+            continue;
+        }
+
+        char path[64];
+        getItemPath(id, path, sizeof(path));
+
+        ItemInfo info;
+        int fd = open(path, O_RDONLY);
+        bool valid = false;
+        if (fd >= 0) {
+            valid = (read(fd, &info, sizeof(info)) == (int)sizeof(info) && info.id == id);
+            close(fd);
+        }
+        if (!valid) {
+            _log.info("bulk queue removing invalid file %s", path);
+            unlink(path);
+            continue;
+        }
+
+        insertItem(info);
+        if (id >= nextId) {
+            nextId = id + 1;
+        }
+    }
+    closedir(dir);
+
+    _log.info("bulk queue %s has %u items, %u bytes", dirPath, (unsigned)items.size(), (unsigned)totalBytes);
+    mutex.unlock();
+}
+
+void EthernetCellularBulkQueue::loop() {
+    if (!sendCallback || !chunkBuf) {
+        return;
+    }
+    if (retryWait) {
+        if (millis() - retryStart < (unsigned long) retryDelay.count()) {
+            return;
+        }
+        retryWait = false;
+    }
+
+    size_t bytesThisLoop = 0;
+
+    mutex.lock();
+    while(!items.empty() && bytesThisLoop < maxBytesPerLoop) {
+        ItemInfo info = items.front();
+
+        if (currentFd >= 0 && currentId != info.id) {
+            // A higher priority item was queued; finish it first and restart this one later
+            abortCurrent();
+        }
+
+        if (isExpired(info)) {
+            _log.info("bulk queue discarding expired item %lu", (unsigned long)info.id);
+            abortCurrent();
+            removeItem(0);
+            continue;
+        }
+
+        if (!canSend(info)) {
+            // The first item is the highest priority, so nothing else can be sent either
+            abortCurrent();
+            break;
+        }
+
+        if (currentFd < 0) {
+            char path[64];
+            getItemPath(info.id, path, sizeof(path));
+            currentFd = open(path, O_RDONLY);
+            if (currentFd < 0 || lseek(currentFd, sizeof(ItemInfo), SEEK_SET) < 0) {
+                _log.error("bulk queue could not open %s, removing", path);
+                abortCurrent();
+                removeItem(0);
+                continue;
+            }
+            currentId = info.id;
+            currentOffset = 0;
+        }
+
+        size_t count = info.size - currentOffset;
+        if (count > chunkSize) {
+            count = chunkSize;
+        }
+        if (count > 0 && read(currentFd, chunkBuf, count) != (int)count) {
+            _log.error("bulk queue read failed item %lu, removing", (unsigned long)info.id);
+            abortCurrent();
+            removeItem(0);
+            continue;
+        }
+
+        // Release the lock while calling the callback so enqueue isn't blocked by a slow send
+        mutex.unlock();
+        bool success = sendCallback(info, chunkBuf, count, currentOffset);
+        mutex.lock();
+
+        if (!success) {
+            _log.info("bulk queue send failed item %lu, will retry", (unsigned long)info.id);
+            abortCurrent();
+            retryWait = true;
+            retryStart = millis();
+            break;
+        }
+
+        if (currentId != info.id) {
+            // Item was discarded by enqueue while the lock was released
+            continue;
+        }
+
+        currentOffset += count;
+        bytesThisLoop += count;
+
+        if (currentOffset >= info.size) {
+            abortCurrent();
+            for(size_t ii = 0; ii < items.size(); ii++) {
+                if (items[ii].id == info.id) {
+                    removeItem(ii);
+                    break;
+                }
+            }
+        }
+    }
+    mutex.unlock();
+}
+
+bool EthernetCellularBulkQueue::enqueue(const uint8_t *data, size_t size, uint8_t priority, std::chrono::seconds maxAge) {
+    bool result = false;
+
+    mutex.lock();
+    if (makeRoom(size, priority)) {
+        ItemInfo info = {};
+        info.id = nextId++;
+        info.size = (uint32_t) size;
+        info.enqueueTime = Time.isValid() ? (uint32_t) Time.now() : 0;
+        info.maxAge = (uint32_t) maxAge.count();
+        info.priority = priority;
+
+        char path[64];
+        getItemPath(info.id, path, sizeof(path));
+
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC);
+        if (fd >= 0) {
+            result = (write(fd, &info, sizeof(info)) == (int)sizeof(info) && write(fd, data, size) == (int)size);
+            close(fd);
+        }
+        if (result) {
+            insertItem(info);
+        }
+        else {
+            _log.error("bulk queue could not write %s", path);
+            unlink(path);
+        }
+    }
+    else {
+        _log.info("bulk queue full, item not queued");
+    }
+    mutex.unlock();
+
+    return result;
+}
+
+void EthernetCellularBulkQueue::clear() {
+    mutex.lock();
+    abortCurrent();
+    while(!items.empty()) {
+        removeItem(items.size() - 1);
+    }
+    mutex.unlock();
+}
+
+bool EthernetCellularBulkQueue::canSend(const ItemInfo &info) const {
+    switch(EthernetCellular::instance().getActiveInterface()) {
+        case EthernetCellular::ActiveInterface::ETHERNET:
+        case EthernetCellular::ActiveInterface::WIFI:
+            return true;
+
+        case EthernetCellular::ActiveInterface::CELLULAR:
+            return (int)info.priority >= cellularMinPriority;
+
+        default:
+            return false;
+    }
+}
+
+bool EthernetCellularBulkQueue::isExpired(const ItemInfo &info) const {
+    if (info.maxAge == 0 || info.enqueueTime == 0 || !Time.isValid()) {
+        return false;
+    }
+    return (uint32_t)Time.now() - info.enqueueTime > info.maxAge;
+}
+
+void EthernetCellularBulkQueue::insertItem(const ItemInfo &info) {
+    auto it = items.begin();
+    while(it != items.end() && (it->priority > info.priority || (it->priority == info.priority && it->id < info.id))) {
+        it++;
+    }
+    items.insert(it, info);
+    totalBytes += info.size;
+}
+
+void EthernetCellularBulkQueue::removeItem(size_t index) {
+    char path[64];
+    getItemPath(items[index].id, path, sizeof(path));
+    unlink(path);
+
+    totalBytes -= items[index].size;
+    items.erase(items.begin() + index);
+}
+
+bool EthernetCellularBulkQueue::makeRoom(size_t size, uint8_t priority) {
+    if (size > maxBytes) {
+        return false;
+    }
+
+    while(!items.empty() && (items.size() >= maxItems || totalBytes + size > maxBytes)) {
+        // The lowest priority items are at the end; find the oldest of them
+        uint8_t lowestPriority = items.back().priority;
+        if (lowestPriority > priority) {
+            return false;
+        }
+        size_t index = items.size() - 1;
+        while(index > 0 && items[index - 1].priority == lowestPriority) {
+            index--;
+        }
+        if (items[index].id == currentId) {
+            abortCurrent();
+        }
+        _log.info("bulk queue full, discarding item %lu", (unsigned long)items[index].id);
+        removeItem(index);
+    }
+    return true;
+}
+
+void EthernetCellularBulkQueue::abortCurrent() {
+    if (currentFd >= 0) {
+        close(currentFd);
+        currentFd = -1;
+    }
+    currentId = 0;
+    currentOffset = 0;
+}
+
+void EthernetCellularBulkQueue::getItemPath(uint32_t id, char *buf, size_t bufSize) const {
+    snprintf(buf, bufSize, "%s/%lu", dirPath, (unsigned long)id);
+}
+
+#endif /* HAL_PLATFORM_FILESYSTEM */
@@ -0,0 +1,295 @@
+#ifndef __ETHERNETCELLULARBULKQUEUERK_H
+#define __ETHERNETCELLULARBULKQUEUERK_H
+
+#include "EthernetCellularRK.h"
+
+#if HAL_PLATFORM_FILESYSTEM
+
+/**
+ * @brief Flash file system backed queue of bulk data that is only sent over Ethernet
+ *
+ * Non-cloud TCP and UDP data is metered on cellular but not on Ethernet. If you have large
+ * amounts of data to send to your own server, you can add it to this queue instead of sending
+ * it directly. Items are stored in the flash file system so they survive a reboot, and are only
+ * sent while the active interface is Ethernet (or Wi-Fi, which is also not metered). While on 
+ * cellular backup, only items whose priority is at least the cellular minimum priority are sent.
+ *
+ * The library does not know how to talk to your server, so you provide a send callback. The
+ * callback is called with the item data in chunks, in order, starting at offset 0. When the
+ * callback has accepted the last chunk, the item is removed from the queue. If the callback
+ * returns false, the item is kept and sent again from offset 0 after the retry delay. An item
+ * is also restarted from offset 0 if it's interrupted by a switch to cellular or by a higher 
+ * priority item being queued. Several items may be sent back-to-back in one call to loop(), 
+ * up to the maximum bytes per loop, so your callback can pipeline them over a single connection.
+ *
+ * Create one of these as a global variable, and call setup() and loop() from the global
+ * application setup() and loop(), after EthernetCellular::instance().setup() and .loop().
+ *
+ * ```
+ * EthernetCellularBulkQueue bulkQueue;
+ *
+ * void setup() {
+ *     EthernetCellular::instance().setup();
+ *     bulkQueue
+ *         .withSendCallback(sendToServer)
+ *         .setup();
+ * }
+ * ```
+ *
+ * This requires Device OS 2.0.0 or later (flash file system).
+ */
+class EthernetCellularBulkQueue {
+public:
+    /**
+     * @brief Information about a queued item
+     *
+     * This is also the header at the start of each item file.
+     */
+    struct ItemInfo {
+        uint32_t id;            //!< Sequence number, also used as the file name
+        uint32_t size;          //!< Size of the payload in bytes, not including this header
+        uint32_t enqueueTime;   //!< Time.now() when queued, or 0 if the time was not valid
+        uint32_t maxAge;        //!< Discard if not sent within this many seconds, 0 = never
+        uint8_t priority;       //!< 0 - 255, larger values are sent first
+        uint8_t reserved[3];    //!< Padding
+    };
+
+    /**
+     * @brief Callback to send a chunk of a queued item
+     *
+     * @param info Information about the item being sent
+     *
+     * @param data Pointer to the chunk of data
+     *
+     * @param size Number of bytes in this chunk
+     *
+     * @param offset Offset of this chunk in the item. The last chunk is the one where offset + size == info.size.
+     *
+     * Return true if the chunk was sent or false to stop and try the item again later.
+     */
+    typedef std::function<bool(const ItemInfo &info, const uint8_t *data, size_t size, size_t offset)> SendCallback;
+
+    /**
+     * @brief Construct a queue
+     *
+     * @param dirPath Directory in the flash file system to store items in. Each queue must
+     * use a different directory. The string must remain valid (typically a string constant).
+     */
+    EthernetCellularBulkQueue(const char *dirPath = "/usr/ethcellbulk");
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~EthernetCellularBulkQueue();
+
+    /**
+     * @brief Sets the callback used to send item data (required)
+     */
+    EthernetCellularBulkQueue &withSendCallback(SendCallback value) { sendCallback = value; return *this; };
+
+    /**
+     * @brief Sets the maximum number of items in the queue (default: 100)
+     *
+     * When full, the oldest item with the lowest priority is discarded to make room.
+     */
+    EthernetCellularBulkQueue &withMaxItems(size_t value) { maxItems = value; return *this; };
+
+    /**
+     * @brief Sets the maximum number of payload bytes in the queue (default: 256 Kbytes)
+     *
+     * When full, the oldest items with the lowest priority are discarded to make room.
+     */
+    EthernetCellularBulkQueue &withMaxBytes(size_t value) { maxBytes = value; return *this; };
+
+    /**
+     * @brief Sets the minimum priority of items that are sent while on cellular (default: 256, never)
+     *
+     * @param value Priority 0 - 255 to send items with that priority or higher over cellular, or 256
+     * to only send over Ethernet.
+     */
+    EthernetCellularBulkQueue &withCellularMinPriority(int value) { cellularMinPriority = value; return *this; };
+
+    /**
+     * @brief Sets the size of the chunks passed to the send callback (default: 1024 bytes)
+     *
+     * The chunk buffer is allocated on the heap in setup().
+     */
+    EthernetCellularBulkQueue &withChunkSize(size_t value) { chunkSize = value; return *this; };
+
+    /**
+     * @brief Sets the maximum number of bytes sent per call to loop() (default: 16 Kbytes)
+     *
+     * Larger values send faster, but loop() takes longer to return.
+     */
+    EthernetCellularBulkQueue &withMaxBytesPerLoop(size_t value) { maxBytesPerLoop = value; return *this; };
+
+    /**
+     * @brief Sets how long to wait after the send callback returns false (default: 10 seconds)
+     */
+    EthernetCellularBulkQueue &withRetryDelay(std::chrono::milliseconds value) { retryDelay = value; return *this; };
+
+    /**
+     * @brief Perform setup operations; call this from global application setup()
+     *
+     * Creates the directory if necessary and loads the items that were queued before reboot.
+     */
+    void setup();
+
+    /**
+     * @brief Perform application loop operations; call this from global application loop()
+     */
+    void loop();
+
+    /**
+     * @brief Adds an item to the queue
+     *
+     * @param data Pointer to the data. It's copied to the file system before returning.
+     *
+     * @param size Number of bytes of data
+     *
+     * @param priority 0 - 255, higher priority items are sent first (default: 0)
+     *
+     * @param maxAge Discard the item if it has not been sent within this time, 0 = never (default).
+     * This requires the time to be valid when queued.
+     *
+     * @return true if queued, false if the item could not be stored or the queue is full of higher
+     * priority items.
+     *
+     * This can be called from any thread.
+     */
+    bool enqueue(const uint8_t *data, size_t size, uint8_t priority = 0, std::chrono::seconds maxAge = 0s);
+
+    /**
+     * @brief Returns the number of items in the queue
+     */
+    size_t getNumItems() const { return items.size(); };
+
+    /**
+     * @brief Returns the total number of payload bytes in the queue
+     */
+    size_t getTotalBytes() const { return totalBytes; };
+
+    /**
+     * @brief Removes all items from the queue
+     */
+    void clear();
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    EthernetCellularBulkQueue(const EthernetCellularBulkQueue&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    EthernetCellularBulkQueue& operator=(const EthernetCellularBulkQueue&) = delete;
+
+    /**
+     * @brief Returns true if the item can be sent on the current active interface
+     */
+    bool canSend(const ItemInfo &info) const;
+
+    /**
+     * @brief Returns true if the item is older than its maxAge
+     */
+    bool isExpired(const ItemInfo &info) const;
+
+    /**
+     * @brief Adds an item to items, keeping it sorted by priority (high to low) then id (old to new)
+     */
+    void insertItem(const ItemInfo &info);
+
+    /**
+     * @brief Removes items[index] from the queue and deletes its file
+     */
+    void removeItem(size_t index);
+
+    /**
+     * @brief Makes room for an item of the given size and priority
+     *
+     * @return true if there is room, false if the queue is full of higher priority items
+     */
+    bool makeRoom(size_t size, uint8_t priority);
+
+    /**
+     * @brief Stops sending the current item, keeping it in the queue
+     */
+    void abortCurrent();
+
+    /**
+     * @brief Gets the pathname of the file for an item
+     */
+    void getItemPath(uint32_t id, char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Directory to store items in
+     */
+    const char *dirPath;
+
+    /**
+     * @brief Queued items, sorted by priority (high to low) then id (old to new)
+     */
+    std::vector<ItemInfo> items;
+
+    /**
+     * @brief Total payload bytes in items
+     */
+    size_t totalBytes = 0;
+
+    /**
+     * @brief Next item id to assign
+     */
+    uint32_t nextId = 1;
+
+    /**
+     * @brief Callback to send item data
+     */
+    SendCallback sendCallback = nullptr;
+
+    size_t maxItems = 100;                              //!< Maximum number of items
+    size_t maxBytes = 256 * 1024;                       //!< Maximum total payload bytes
+    int cellularMinPriority = 256;                      //!< Minimum priority to send on cellular
+    size_t chunkSize = 1024;                            //!< Size of chunks passed to sendCallback
+    size_t maxBytesPerLoop = 16 * 1024;                 //!< Maximum bytes to send per loop()
+    std::chrono::milliseconds retryDelay = 10s;         //!< Delay after sendCallback returns false
+
+    /**
+     * @brief Chunk buffer, allocated in setup()
+     */
+    uint8_t *chunkBuf = nullptr;
+
+    /**
+     * @brief File descriptor for the item being sent, or -1 if none
+     */
+    int currentFd = -1;
+
+    /**
+     * @brief Id of the item being sent
+     */
+    uint32_t currentId = 0;
+
+    /**
+     * @brief Offset of the next chunk of the item being sent
+     */
+    size_t currentOffset = 0;
+
+    /**
+     * @brief millis() value when the send callback last returned false
+     */
+    unsigned long retryStart = 0;
+
+    /**
+     * @brief true if waiting for retryDelay before sending again
+     */
+    bool retryWait = false;
+
+    /**
+     * @brief Mutex for items, as enqueue can be called from any thread
+     */
+    mutable RecursiveMutex mutex;
+};
+
+#endif /* HAL_PLATFORM_FILESYSTEM */
+
+#endif /* __ETHERNETCELLULARBULKQUEUERK_H */
@@ -0,0 +1,190 @@
+#include "EthernetCellularPublishQueueRK.h"
+
+static Logger _log("app.ethcell");
+
+EthernetCellularPublishQueue::EthernetCellularPublishQueue(size_t bufferSize) : bufferSize(bufferSize) {
+}
+
+EthernetCellularPublishQueue::~EthernetCellularPublishQueue() {
+    delete[] buffer;
+    delete[] nameBuf;
+    delete[] dataBuf;
+}
+
+void EthernetCellularPublishQueue::setup() {
+    if (!buffer) {
+        buffer = new uint8_t[bufferSize];
+        nameBuf = new char[particle::protocol::MAX_EVENT_NAME_LENGTH + 1];
+        dataBuf = new char[maxEventDataSize + 1];
+    }
+}
+
+void EthernetCellularPublishQueue::loop() {
+    if (!buffer) {
+        return;
+    }
+
+    mutex.lock();
+
+    if (publishInProgress) {
+        if (!publishFuture.isDone()) {
+            mutex.unlock();
+            return;
+        }
+        publishInProgress = false;
+        EthernetCellular::instance().endCloudOperation();
+
+        if (publishFuture.isSucceeded()) {
+            // inFlightCount is reduced if any of the in-flight events were discarded during the publish
+            while(inFlightCount > 0) {
+                removeOldest();
+                inFlightCount--;
+            }
+        }
+        else {
+            _log.info("publish queue publish failed, will retry");
+            inFlightCount = 0;
+        }
+    }
+
+    if (numEvents > 0 && canPublish() && millis() - lastPublish >= (unsigned long) publishPeriod.count()) {
+        PublishFlags flags;
+        inFlightCount = buildPublish(flags);
+        lastPublish = millis();
+
+        _log.trace("publish queue publishing %s (%u events)", nameBuf, (unsigned)inFlightCount);
+        EthernetCellular::instance().beginCloudOperation();
+        publishFuture = Particle.publish(nameBuf, dataBuf, flags);
+        publishInProgress = true;
+    }
+
+    mutex.unlock();
+}
+
+bool EthernetCellularPublishQueue::publish(const char *eventName, const char *data, PublishFlags flags) {
+    if (!data) {
+        data = "";
+    }
+
+    EventHeader header = {};
+    header.nameLen = (uint16_t) strlen(eventName);
+    header.dataLen = (uint16_t) strlen(data);
+    header.flags = (uint8_t) flags.value();
+
+    size_t eventSize = sizeof(EventHeader) + header.nameLen + 1 + header.dataLen + 1;
+    if (!buffer || header.nameLen > particle::protocol::MAX_EVENT_NAME_LENGTH || header.dataLen > maxEventDataSize || eventSize > bufferSize) {
+        return false;
+    }
+
+    mutex.lock();
+    while(usedBytes + eventSize > bufferSize) {
+        removeOldest();
+        discardCount++;
+        if (inFlightCount > 0) {
+            // The oldest event was part of the publish in progress
+            inFlightCount--;
+        }
+    }
+
+    size_t offset = (readOffset + usedBytes) % bufferSize;
+    writeBytes(offset, &header, sizeof(EventHeader));
+    offset = (offset + sizeof(EventHeader)) % bufferSize;
+    writeBytes(offset, eventName, header.nameLen + 1);
+    offset = (offset + header.nameLen + 1) % bufferSize;
+    writeBytes(offset, data, header.dataLen + 1);
+
+    usedBytes += eventSize;
+    numEvents++;
+    mutex.unlock();
+
+    return true;
+}
+
+void EthernetCellularPublishQueue::clear() {
+    mutex.lock();
+    readOffset = 0;
+    usedBytes = 0;
+    numEvents = 0;
+    inFlightCount = 0;
+    mutex.unlock();
+}
+
+bool EthernetCellularPublishQueue::canPublish() const {
+    EthernetCellular &ethCell = EthernetCellular::instance();
+    return ethCell.getActiveInterface() != EthernetCellular::ActiveInterface::NONE && !ethCell.isDraining() && Particle.connected();
+}
+
+void EthernetCellularPublishQueue::writeBytes(size_t offset, const void *src, size_t len) {
+    size_t first = std::min(len, bufferSize - offset);
+    memcpy(&buffer[offset], src, first);
+    if (first < len) {
+        memcpy(buffer, (const uint8_t *)src + first, len - first);
+    }
+}
+
+void EthernetCellularPublishQueue::readBytes(size_t offset, void *dst, size_t len) const {
+    size_t first = std::min(len, bufferSize - offset);
+    memcpy(dst, &buffer[offset], first);
+    if (first < len) {
+        memcpy((uint8_t *)dst + first, buffer, len - first);
+    }
+}
+
+void EthernetCellularPublishQueue::removeOldest() {
+    if (numEvents == 0) {
+        return;
+    }
+    EventHeader header;
+    readBytes(readOffset, &header, sizeof(EventHeader));
+
+    size_t eventSize = sizeof(EventHeader) + header.nameLen + 1 + header.dataLen + 1;
+    readOffset = (readOffset + eventSize) % bufferSize;
+    usedBytes -= eventSize;
+    numEvents--;
+}
+
+size_t EthernetCellularPublishQueue::buildPublish(PublishFlags &flags) {
+    size_t offset = readOffset;
+    size_t count = 0;
+    size_t dataLen = 0;
+    size_t separatorLen = strlen(coalesceSeparator);
+
+    while(count < numEvents) {
+        EventHeader header;
+        readBytes(offset, &header, sizeof(EventHeader));
+        size_t nameOffset = (offset + sizeof(EventHeader)) % bufferSize;
+        size_t dataOffset = (nameOffset + header.nameLen + 1) % bufferSize;
+
+        if (count == 0) {
+            readBytes(nameOffset, nameBuf, header.nameLen + 1);
+            readBytes(dataOffset, dataBuf, header.dataLen + 1);
+            dataLen = header.dataLen;
+            flags = PublishFlags::fromValue(header.flags);
+        }
+        else {
+            if (!coalesce || header.flags != flags.value() || header.nameLen != strlen(nameBuf)) {
+                break;
+            }
+            if (dataLen + separatorLen + header.dataLen > maxEventDataSize) {
+                break;
+            }
+
+            // Only coalesce events with the same name
+            char name[particle::protocol::MAX_EVENT_NAME_LENGTH + 1];
+            readBytes(nameOffset, name, header.nameLen + 1);
+            if (strcmp(name, nameBuf) != 0) {
+                break;
+            }
+
+            memcpy(&dataBuf[dataLen], coalesceSeparator, separatorLen);
+            dataLen += separatorLen;
+            readBytes(dataOffset, &dataBuf[dataLen], header.dataLen + 1);
+            dataLen += header.dataLen;
+        }
+
+        count++;
+        offset = (dataOffset + header.dataLen + 1) % bufferSize;
+    }
+
+    return count;
+}
@@ -0,0 +1,194 @@
+#ifndef __ETHERNETCELLULARPUBLISHQUEUERK_H
+#define __ETHERNETCELLULARPUBLISHQUEUERK_H
+
+#include "EthernetCellularRK.h"
+
+/**
+ * @brief RAM ring buffer of events to publish, to avoid losing events while switching interfaces
+ *
+ * While EthernetCellular is switching between Ethernet and cellular, there is no active interface
+ * and Particle.publish will fail. If you publish using this class instead, events are kept in a
+ * fixed-size ring buffer and published once there is an active interface and the cloud is
+ * connected. Events are published in order, no faster than the publish period, to stay within
+ * the cloud publish rate limit. If the buffer fills, the oldest events are discarded.
+ *
+ * Optionally, consecutive queued events with the same name and flags can be coalesced into a
+ * single publish, with the data separated by the coalesce separator, to save data operations.
+ * Your event handler in the cloud needs to split the data back into separate events.
+ *
+ * Create one of these as a global variable, and call setup() and loop() from the global
+ * application setup() and loop(), after EthernetCellular::instance().setup() and .loop().
+ *
+ * ```
+ * EthernetCellularPublishQueue publishQueue(4096);
+ *
+ * void setup() {
+ *     EthernetCellular::instance().setup();
+ *     publishQueue.setup();
+ * }
+ *
+ * void loop() {
+ *     EthernetCellular::instance().loop();
+ *     publishQueue.loop();
+ *
+ *     publishQueue.publish("testEvent", "123");
+ * }
+ * ```
+ */
+class EthernetCellularPublishQueue {
+public:
+    /**
+     * @brief Construct a publish queue
+     *
+     * @param bufferSize Size of the ring buffer in bytes. It's allocated on the heap in setup().
+     * Each event uses the length of the event name and data, plus 8 bytes.
+     */
+    EthernetCellularPublishQueue(size_t bufferSize = 2048);
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~EthernetCellularPublishQueue();
+
+    /**
+     * @brief Sets the minimum time between publishes (default: 1 second)
+     *
+     * The default matches the cloud publish rate limit of 1 event per second, averaged.
+     */
+    EthernetCellularPublishQueue &withPublishPeriod(std::chrono::milliseconds value) { publishPeriod = value; return *this; };
+
+    /**
+     * @brief Coalesce consecutive events with the same name and flags into one publish (default: false)
+     *
+     * @param value true to enable or false to disable.
+     *
+     * @param separator String to put between the data of each event. The string must remain valid
+     * (typically a string constant). Default is a newline.
+     */
+    EthernetCellularPublishQueue &withCoalesce(bool value = true, const char *separator = "\n") { coalesce = value; coalesceSeparator = separator; return *this; };
+
+    /**
+     * @brief Sets the maximum size of event data (default: 622 bytes)
+     *
+     * This limits the size of coalesced events. It should match the limit for your device and
+     * Device OS version (622 or 1024 bytes).
+     */
+    EthernetCellularPublishQueue &withMaxEventDataSize(size_t value) { maxEventDataSize = value; return *this; };
+
+    /**
+     * @brief Perform setup operations; call this from global application setup()
+     */
+    void setup();
+
+    /**
+     * @brief Perform application loop operations; call this from global application loop()
+     */
+    void loop();
+
+    /**
+     * @brief Queues an event to publish
+     *
+     * @param eventName Event name, 1 - 64 characters
+     *
+     * @param data Event data (optional, can be NULL)
+     *
+     * @param flags Publish flags like PRIVATE or WITH_ACK (default: PRIVATE)
+     *
+     * @return true if the event was queued, false if it is too large for the buffer.
+     *
+     * This can be called from any thread.
+     */
+    bool publish(const char *eventName, const char *data = NULL, PublishFlags flags = PRIVATE);
+
+    /**
+     * @brief Returns the number of events in the queue, including any being published
+     */
+    size_t getNumEvents() const { return numEvents; };
+
+    /**
+     * @brief Returns the number of events discarded because the buffer was full
+     */
+    uint32_t getDiscardCount() const { return discardCount; };
+
+    /**
+     * @brief Removes all events from the queue
+     */
+    void clear();
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    EthernetCellularPublishQueue(const EthernetCellularPublishQueue&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    EthernetCellularPublishQueue& operator=(const EthernetCellularPublishQueue&) = delete;
+
+    /**
+     * @brief Header before each event in the ring buffer
+     *
+     * It's followed by the null-terminated event name and the null-terminated data.
+     */
+    struct EventHeader {
+        uint16_t nameLen;   //!< Length of the event name, not including the null
+        uint16_t dataLen;   //!< Length of the event data, not including the null
+        uint8_t flags;      //!< PublishFlags value
+        uint8_t reserved;   //!< Padding
+    };
+
+    /**
+     * @brief Returns true if there's an active interface, it's not draining for a switch, and the cloud is connected
+     */
+    bool canPublish() const;
+
+    /**
+     * @brief Copies bytes into the ring buffer at offset, wrapping around if necessary
+     */
+    void writeBytes(size_t offset, const void *src, size_t len);
+
+    /**
+     * @brief Copies bytes from the ring buffer at offset, wrapping around if necessary
+     */
+    void readBytes(size_t offset, void *dst, size_t len) const;
+
+    /**
+     * @brief Removes the oldest event from the ring buffer
+     */
+    void removeOldest();
+
+    /**
+     * @brief Reads the next event, and consecutive events it can be coalesced with, into nameBuf and dataBuf
+     *
+     * @return The number of events that were combined
+     */
+    size_t buildPublish(PublishFlags &flags);
+
+    uint8_t *buffer = nullptr;                          //!< Ring buffer, allocated in setup()
+    size_t bufferSize;                                  //!< Size of buffer in bytes
+    size_t readOffset = 0;                              //!< Offset of the oldest event in buffer
+    size_t usedBytes = 0;                               //!< Bytes used in buffer
+    size_t numEvents = 0;                               //!< Number of events in buffer
+
+    std::chrono::milliseconds publishPeriod = 1s;       //!< Minimum time between publishes
+    bool coalesce = false;                              //!< Combine consecutive events with the same name
+    const char *coalesceSeparator = "\n";               //!< Separator between coalesced event data
+    size_t maxEventDataSize = 622;                      //!< Maximum event data size
+
+    char *nameBuf = nullptr;                            //!< Event name being published, allocated in setup()
+    char *dataBuf = nullptr;                            //!< Event data being published, allocated in setup()
+
+    bool publishInProgress = false;                     //!< true if waiting for publishFuture
+    particle::Future<bool> publishFuture;               //!< Result of the publish in progress
+    size_t inFlightCount = 0;                           //!< Number of events in the publish in progress
+    unsigned long lastPublish = 0;                      //!< millis() value at the last publish attempt
+    uint32_t discardCount = 0;                          //!< Number of events discarded because the buffer was full
+
+    /**
+     * @brief Mutex for the ring buffer, as publish can be called from any thread
+     */
+    mutable RecursiveMutex mutex;
+};
+
+#endif /* __ETHERNETCELLULARPUBLISHQUEUERK_H */
@@ -1,56 +1,1813 @@
 #include "EthernetCellularRK.h"
 
+#include "ifapi.h"
+#include "socket_hal.h"
+
+#include <errno.h>
+
 EthernetCellular *EthernetCellular::_instance;
 
-static Logger _log("app.ethcell");
+retained EthernetCellular::PersistentData EthernetCellular::retainedPersistentData;
+
+retained EthernetCellular::TransitionLog EthernetCellular::transitionLog;
+
+// Must be in the same order as the State enum
+const EthernetCellular::StateTableEntry EthernetCellular::stateTable[] = {
+    { &EthernetCellular::stateStart, "Start", nullptr },
+    { &EthernetCellular::stateTryEthernet, "TryEthernet", nullptr },
+    { &EthernetCellular::stateWaitEthernetReady, "WaitEthernetReady", &EthernetCellular::ethernetConnectTimeout },
+    { &EthernetCellular::stateWaitEthernetCloud, "WaitEthernetCloud", &EthernetCellular::ethernetCloudConnectTimeout },
+    { &EthernetCellular::stateEthernetCloudConnected, "EthernetCloudConnected", nullptr },
+    { &EthernetCellular::stateTryCellular, "TryCellular", nullptr },
+    { &EthernetCellular::stateWaitCellularReady, "WaitCellularReady", &EthernetCellular::backupConnectTimeout },
+    { &EthernetCellular::stateWaitCellularCloud, "WaitCellularCloud", &EthernetCellular::backupCloudConnectTimeout },
+    { &EthernetCellular::stateCellularCloudConnected, "CellularCloudConnected", nullptr },
+    { &EthernetCellular::stateCellularWaitDisconnectedThenTryEthernet, "CellularWaitDisconnectedThenTryEthernet", nullptr },
+    { &EthernetCellular::stateCellularTryEthernetInBackground, "CellularTryEthernetInBackground", nullptr },
+    { &EthernetCellular::stateCellularWaitEthernetReadyInBackground, "CellularWaitEthernetReadyInBackground", &EthernetCellular::ethernetConnectTimeout },
+    { &EthernetCellular::stateCellularCheckEthernetReachability, "CellularCheckEthernetReachability", nullptr },
+    { &EthernetCellular::stateCellularDrainThenTryEthernet, "CellularDrainThenTryEthernet", nullptr },
+    { &EthernetCellular::stateEthernetDrainThenTryCellular, "EthernetDrainThenTryCellular", nullptr },
+};
+
+static Logger _log("app.ethcell");
+
+
+void EthernetCellularResolver::start(const char *host, network_interface_t nif, IPAddress dnsServer, std::chrono::milliseconds timeout, uint16_t port) {
+    stop();
+
+    this->host = host;
+    this->timeout = (unsigned long) timeout.count();
+    address = IPAddress();
+    startTime = millis();
+
+    if (parseAddress(host, address)) {
+        status = Status::SUCCEEDED;
+        return;
+    }
+
+    queryId = (uint16_t) random(1, 65536);
+    size_t len = buildQuery();
+
+    if (len == 0 || !dnsServer || !udp.begin(0, nif) || udp.sendPacket(buf, len, dnsServer, port) < 0) {
+        _log.trace("resolver could not send query for %s", host);
+        udp.stop();
+        status = Status::FAILED;
+        return;
+    }
+    status = Status::BUSY;
+}
+
+void EthernetCellularResolver::stop() {
+    if (status == Status::BUSY) {
+        udp.stop();
+    }
+    status = Status::IDLE;
+}
+
+EthernetCellularResolver::Status EthernetCellularResolver::loop() {
+    if (status != Status::BUSY) {
+        return status;
+    }
+
+    int count = udp.receivePacket(buf, sizeof(buf), 0);
+    if (count > 0) {
+        Status result = parseResponse((size_t) count);
+        if (result != Status::BUSY) {
+            udp.stop();
+            status = result;
+            return status;
+        }
+    }
+
+    if (millis() - startTime >= timeout) {
+        _log.trace("resolver timed out looking up %s", host.c_str());
+        udp.stop();
+        status = Status::FAILED;
+    }
+    return status;
+}
+
+unsigned long EthernetCellularResolver::getNextDeadline(unsigned long pollPeriod) const {
+    if (status != Status::BUSY) {
+        return ULONG_MAX;
+    }
+    unsigned long elapsed = millis() - startTime;
+    return (elapsed >= timeout) ? 0 : std::min(timeout - elapsed, pollPeriod);
+}
+
+// [static]
+bool EthernetCellularResolver::parseAddress(const char *str, IPAddress &addr) {
+    uint8_t octets[4];
+
+    for(size_t ii = 0; ii < sizeof(octets); ii++) {
+        int value = 0;
+        int digits = 0;
+        while(*str >= '0' && *str <= '9') {
+            value = value * 10 + (*str++ - '0');
+            if (++digits > 3) {
+                return false;
+            }
+        }
+        if (digits == 0 || value > 255) {
+            return false;
+        }
+        octets[ii] = (uint8_t) value;
+
+        if (ii < sizeof(octets) - 1 && *str++ != '.') {
+            return false;
+        }
+    }
+    if (*str) {
+        return false;
+    }
+
+    addr = IPAddress(octets[0], octets[1], octets[2], octets[3]);
+    return true;
+}
+
+size_t EthernetCellularResolver::buildQuery() {
+    const uint8_t header[12] = {
+        (uint8_t)(queryId >> 8), (uint8_t)queryId, 
+        0x01, 0x00, // flags: standard query, recursion desired
+        0x00, 0x01, // QDCOUNT
+        0x00, 0x00, // ANCOUNT
+        0x00, 0x00, // NSCOUNT
+        0x00, 0x00  // ARCOUNT
+    };
+    const char *name = host.c_str();
+    size_t nameLen = strlen(name);
+
+    // header + (length-prefixed labels + terminating 0) + QTYPE + QCLASS
+    if (sizeof(header) + nameLen + 2 + 4 > sizeof(buf)) {
+        return 0;
+    }
+    memcpy(buf, header, sizeof(header));
+    size_t offset = sizeof(header);
+
+    while(*name) {
+        const char *dot = strchr(name, '.');
+        size_t labelLen = dot ? (size_t)(dot - name) : strlen(name);
+        if (labelLen == 0 || labelLen > 63) {
+            return 0;
+        }
+        buf[offset++] = (uint8_t) labelLen;
+        memcpy(&buf[offset], name, labelLen);
+        offset += labelLen;
+        name += labelLen;
+        if (*name == '.') {
+            name++;
+        }
+    }
+    buf[offset++] = 0;
+
+    // QTYPE A, QCLASS IN
+    buf[offset++] = 0x00;
+    buf[offset++] = 0x01;
+    buf[offset++] = 0x00;
+    buf[offset++] = 0x01;
+
+    return offset;
+}
+
+EthernetCellularResolver::Status EthernetCellularResolver::parseResponse(size_t count) {
+    if (count < 12) {
+        return Status::BUSY;
+    }
+
+    // Response must have the same ID and the QR (response) bit set
+    uint16_t id = (buf[0] << 8) | buf[1];
+    if (id != queryId || (buf[2] & 0x80) == 0) {
+        return Status::BUSY;
+    }
+    if ((buf[3] & 0x0f) != 0) {
+        // RCODE is an error, such as NXDOMAIN
+        return Status::NO_ADDRESS;
+    }
+
+    uint16_t questionCount = (buf[4] << 8) | buf[5];
+    uint16_t answerCount = (buf[6] << 8) | buf[7];
+    size_t offset = 12;
+
+    for(uint16_t ii = 0; ii < questionCount; ii++) {
+        // Name, QTYPE, QCLASS
+        offset = skipName(offset, count);
+        if (offset == 0 || offset + 4 > count) {
+            return Status::NO_ADDRESS;
+        }
+        offset += 4;
+    }
+
+    for(uint16_t ii = 0; ii < answerCount; ii++) {
+        // Name, TYPE, CLASS, TTL, RDLENGTH, RDATA. CNAME records come before the A record they point to.
+        offset = skipName(offset, count);
+        if (offset == 0 || offset + 10 > count) {
+            return Status::NO_ADDRESS;
+        }
+        uint16_t type = (buf[offset] << 8) | buf[offset + 1];
+        uint16_t cls = (buf[offset + 2] << 8) | buf[offset + 3];
+        uint16_t dataLen = (buf[offset + 8] << 8) | buf[offset + 9];
+        offset += 10;
+        if (offset + dataLen > count) {
+            return Status::NO_ADDRESS;
+        }
+        if (type == 1 && cls == 1 && dataLen == 4) {
+            address = IPAddress(buf[offset], buf[offset + 1], buf[offset + 2], buf[offset + 3]);
+            return Status::SUCCEEDED;
+        }
+        offset += dataLen;
+    }
+    return Status::NO_ADDRESS;
+}
+
+size_t EthernetCellularResolver::skipName(size_t offset, size_t count) const {
+    while(offset < count) {
+        uint8_t len = buf[offset];
+        if ((len & 0xc0) == 0xc0) {
+            // Compression pointer ends the name
+            return (offset + 2 <= count) ? (offset + 2) : 0;
+        }
+        if (len == 0) {
+            return offset + 1;
+        }
+        offset += len + 1;
+    }
+    return 0;
+}
+
+
+void EthernetCellularTcpCheck::start(const char *host, uint16_t port, network_interface_t nif, IPAddress dnsServer, std::chrono::milliseconds timeout) {
+    stop();
+
+    this->port = port;
+    this->nif = nif;
+    this->timeout = (unsigned long) timeout.count();
+    startTime = millis();
+    connectTime = 0;
+
+    status = Status::BUSY;
+    resolver.start(host, nif, dnsServer, timeout);
+    loop();
+}
+
+void EthernetCellularTcpCheck::stop() {
+    complete(Status::IDLE);
+}
+
+unsigned long EthernetCellularTcpCheck::getNextDeadline(unsigned long pollPeriod) const {
+    if (status != Status::BUSY) {
+        return ULONG_MAX;
+    }
+    unsigned long elapsed = millis() - startTime;
+    return (elapsed >= timeout) ? 0 : std::min(timeout - elapsed, pollPeriod);
+}
+
+EthernetCellularTcpCheck::Status EthernetCellularTcpCheck::loop() {
+    if (status != Status::BUSY) {
+        return status;
+    }
+
+    if (sock < 0) {
+        // Still resolving the host
+        EthernetCellularResolver::Status resolverStatus = resolver.loop();
+        if (resolverStatus == EthernetCellularResolver::Status::BUSY) {
+            return status;
+        }
+        if (resolverStatus != EthernetCellularResolver::Status::SUCCEEDED || !startConnect(resolver.getAddress())) {
+            complete(Status::FAILED);
+            return status;
+        }
+        if (status != Status::BUSY) {
+            // Connected right away
+            return status;
+        }
+    }
+
+    struct pollfd pfd = {};
+    pfd.fd = sock;
+    pfd.events = POLLOUT;
+    if (sock_poll(&pfd, 1, 0) > 0) {
+        // Writable means the connection completed, SO_ERROR says whether it succeeded
+        int err = 0;
+        socklen_t errLen = sizeof(err);
+        if (sock_getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errLen) == 0 && err == 0) {
+            connectTime = millis() - startTime;
+            complete(Status::SUCCEEDED);
+        }
+        else {
+            complete(Status::FAILED);
+        }
+        return status;
+    }
+
+    if (millis() - startTime >= timeout) {
+        complete(Status::FAILED);
+    }
+    return status;
+}
+
+bool EthernetCellularTcpCheck::startConnect(IPAddress addr) {
+    sock = sock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        return false;
+    }
+
+    if (nif != 0) {
+        // Bind to the interface so the connection can't go out over the default route instead
+        struct ifreq ifr = {};
+        if (if_index_to_name((uint8_t) nif, ifr.ifr_name) != 0 || sock_setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr)) != 0) {
+            return false;
+        }
+    }
+
+    int flags = sock_fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || sock_fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return false;
+    }
+
+    // Port and address are in network byte order
+    struct sockaddr_in saddr = {};
+    saddr.sin_len = sizeof(saddr);
+    saddr.sin_family = AF_INET;
+    uint8_t *portBytes = (uint8_t *) &saddr.sin_port;
+    portBytes[0] = (uint8_t)(port >> 8);
+    portBytes[1] = (uint8_t) port;
+    uint8_t *addrBytes = (uint8_t *) &saddr.sin_addr.s_addr;
+    for(int ii = 0; ii < 4; ii++) {
+        addrBytes[ii] = addr[ii];
+    }
+
+    if (sock_connect(sock, (const struct sockaddr *) &saddr, sizeof(saddr)) == 0) {
+        connectTime = millis() - startTime;
+        complete(Status::SUCCEEDED);
+        return true;
+    }
+    return errno == EINPROGRESS;
+}
+
+void EthernetCellularTcpCheck::complete(Status result) {
+    resolver.stop();
+    if (sock >= 0) {
+        sock_close(sock);
+        sock = -1;
+    }
+    status = result;
+}
+
+
+EthernetCellularProbe &EthernetCellularProbe::withHost(const char *host, uint16_t port, ProbeType type) {
+    ProbeHost probeHost;
+    probeHost.host = host;
+    probeHost.port = port;
+    probeHost.type = type;
+    hosts.push_back(probeHost);
+    return *this;
+}
+
+void EthernetCellularProbe::start(network_interface_t nif, IPAddress dnsServer) {
+    stop();
+
+    this->nif = nif;
+    this->dnsServer = dnsServer;
+    started = true;
+    consecutiveFailures = 0;
+    rttEstimate = 0;
+    lossEstimate = 0;
+    sampleCount = 0;
+    probeTime = millis();
+}
+
+void EthernetCellularProbe::stop() {
+    waitingForResponse = false;
+    resolver.stop();
+    tcpCheck.stop();
+    started = false;
+}
+
+void EthernetCellularProbe::loop() {
+    if (!started || hosts.empty()) {
+        return;
+    }
+
+    if (waitingForResponse) {
+        checkProbe();
+        return;
+    }
+
+    if (millis() - probeTime >= (unsigned long) interval.count()) {
+        sendProbe();
+    }
+}
+
+unsigned long EthernetCellularProbe::getNextDeadline(unsigned long pollPeriod) const {
+    if (!started || hosts.empty()) {
+        return ULONG_MAX;
+    }
+    if (waitingForResponse) {
+        return std::min(resolver.getNextDeadline(pollPeriod), tcpCheck.getNextDeadline(pollPeriod));
+    }
+
+    unsigned long elapsed = millis() - probeTime;
+    if (elapsed >= (unsigned long) interval.count()) {
+        return 0;
+    }
+    return (unsigned long) interval.count() - elapsed;
+}
+
+void EthernetCellularProbe::sendProbe() {
+    const ProbeHost &probeHost = hosts[hostIndex];
+
+    probeTime = millis();
+    waitingForResponse = true;
+
+    if (probeHost.type == ProbeType::TCP) {
+        tcpCheck.start(probeHost.host.c_str(), probeHost.port, nif, dnsServer, timeout);
+    }
+    else {
+        // DNS. A server given by hostname is first resolved over the probe interface, too.
+        IPAddress addr;
+        resolvingServer = !EthernetCellularResolver::parseAddress(probeHost.host.c_str(), addr);
+        if (resolvingServer) {
+            resolver.start(probeHost.host.c_str(), nif, dnsServer, timeout);
+        }
+        else {
+            resolver.start(dnsQueryName.c_str(), nif, addr, timeout, probeHost.port);
+        }
+    }
+    checkProbe();
+}
+
+void EthernetCellularProbe::checkProbe() {
+    const ProbeHost &probeHost = hosts[hostIndex];
+
+    if (probeHost.type == ProbeType::TCP) {
+        EthernetCellularTcpCheck::Status status = tcpCheck.loop();
+        if (status != EthernetCellularTcpCheck::Status::BUSY) {
+            probeComplete(status == EthernetCellularTcpCheck::Status::SUCCEEDED);
+        }
+        return;
+    }
+
+    EthernetCellularResolver::Status status = resolver.loop();
+    if (status == EthernetCellularResolver::Status::BUSY) {
+        return;
+    }
+
+    if (resolvingServer) {
+        if (status != EthernetCellularResolver::Status::SUCCEEDED) {
+            _log.trace("probe could not resolve %s", probeHost.host.c_str());
+            probeComplete(false);
+            return;
+        }
+
+        // The probe query gets what's left of the timeout
+        unsigned long elapsed = millis() - probeTime;
+        std::chrono::milliseconds remaining((elapsed < (unsigned long) timeout.count()) ? ((unsigned long) timeout.count() - elapsed) : 0);
+        resolvingServer = false;
+        resolver.start(dnsQueryName.c_str(), nif, resolver.getAddress(), remaining, probeHost.port);
+        return;
+    }
+
+    // The answer content doesn't matter; any response means the server is reachable
+    probeComplete(status == EthernetCellularResolver::Status::SUCCEEDED || status == EthernetCellularResolver::Status::NO_ADDRESS);
+}
+
+void EthernetCellularProbe::probeComplete(bool success) {
+    const ProbeHost &probeHost = hosts[hostIndex];
+
+    waitingForResponse = false;
+    resolvingServer = false;
+    resolver.stop();
+    tcpCheck.stop();
+
+    if (success) {
+        lastRtt = millis() - probeTime;
+        consecutiveFailures = 0;
+        if (rttEstimate == 0) {
+            rttEstimate = (float) lastRtt;
+        }
+        else {
+            rttEstimate += ewmaWeight * ((float) lastRtt - rttEstimate);
+        }
+        lossEstimate -= ewmaWeight * lossEstimate;
+        _log.trace("probe %s:%d succeeded rtt=%lu avg=%lu", probeHost.host.c_str(), (int)probeHost.port, lastRtt, (unsigned long)rttEstimate);
+    }
+    else {
+        consecutiveFailures++;
+        lossEstimate += ewmaWeight * (1.0f - lossEstimate);
+        _log.info("probe %s:%d failed (%d in a row)", probeHost.host.c_str(), (int)probeHost.port, consecutiveFailures);
+    }
+    sampleCount++;
+
+    if (++hostIndex >= hosts.size()) {
+        hostIndex = 0;
+    }
+    
+    // Interval is measured from the end of the previous probe
+    probeTime = millis();
+}
+
+
+std::chrono::milliseconds EthernetCellularRetryPolicy::getPeriod(std::chrono::milliseconds basePeriod) const {
+    double period = (double) basePeriod.count();
+
+    for(int ii = 0; ii < retryCount && backoffMultiplier > 1.0; ii++) {
+        period *= backoffMultiplier;
+        if (period >= (double) maxPeriod.count()) {
+            return std::max(basePeriod, maxPeriod);
+        }
+    }
+    return std::chrono::milliseconds((long long) period);
+}
+
+std::chrono::seconds EthernetCellularKeepAliveLearner::getKeepAlive(std::chrono::seconds base) const {
+    if (!isEnabled(base)) {
+        return base;
+    }
+    if (safe < (int)base.count()) {
+        // Nothing confirmed yet, start with the configured value
+        return base;
+    }
+    if (isConverged(base)) {
+        return std::chrono::seconds(safe);
+    }
+    return std::min(std::chrono::seconds(safe) + step, maxKeepAlive);
+}
+
+bool EthernetCellularKeepAliveLearner::isConverged(std::chrono::seconds base) const {
+    if (safe < (int)base.count()) {
+        return false;
+    }
+    int next = (int)std::min(std::chrono::seconds(safe) + step, maxKeepAlive).count();
+    return next <= safe || (ceiling != 0 && next >= ceiling);
+}
+
+bool EthernetCellularKeepAliveLearner::loop(std::chrono::seconds base) {
+    if (!isEnabled(base)) {
+        return false;
+    }
+
+    int current = (int)getKeepAlive(base).count();
+    if (millis() - connectedTime < (unsigned long)current * 1000 * confirmCount) {
+        return false;
+    }
+
+    // Stayed connected for confirmCount periods, so earlier losses at this value were something else
+    lossCount = 0;
+    if (isConverged(base)) {
+        return false;
+    }
+
+    // This value is safe
+    safe = current;
+    connectedTime = millis();
+    return true;
+}
+
+void EthernetCellularKeepAliveLearner::cloudDisconnected(std::chrono::seconds base, bool interfaceUp) {
+    if (!isEnabled(base) || !interfaceUp) {
+        return;
+    }
+
+    int current = (int)getKeepAlive(base).count();
+    if (current <= (int)base.count()) {
+        // Don't go below the configured value
+        return;
+    }
+    if (++lossCount < ceilingLossCount) {
+        // Could be a handover or router restart rather than the NAT, try the same value again
+        return;
+    }
+    lossCount = 0;
+    ceiling = current;
+    if (current <= safe) {
+        // A value that was previously safe failed, so back off one step
+        safe = std::max((int)base.count(), safe - (int)step.count());
+    }
+}
+
+EthernetCellularDnsCache &EthernetCellularDnsCache::withHost(const char *host) {
+    Entry entry = {};
+    entry.host = host;
+    entries.push_back(entry);
+    return *this;
+}
+
+IPAddress EthernetCellularDnsCache::lookup(const char *host, size_t slot) const {
+    IPAddress result;
+    if (slot >= NUM_INTERFACES) {
+        return result;
+    }
+
+    mutex.lock();
+    unsigned long now = millis();
+    for(const Entry &entry : entries) {
+        if (strcmp(entry.host.c_str(), host) == 0) {
+            if (entry.tried[slot] && now - entry.resolvedTime[slot] < (unsigned long) std::chrono::milliseconds(ttl).count()) {
+                result = entry.address[slot];
+            }
+            break;
+        }
+    }
+    mutex.unlock();
+
+    return result;
+}
+
+void EthernetCellularDnsCache::loop(size_t slot, network_interface_t nif, IPAddress dnsServer) {
+    if (slot >= NUM_INTERFACES) {
+        return;
+    }
+
+    if (resolver.getStatus() != EthernetCellularResolver::Status::IDLE && resolvingSlot != slot) {
+        // The active interface changed while a lookup was in progress
+        resolver.stop();
+    }
+
+    if (resolver.getStatus() == EthernetCellularResolver::Status::IDLE) {
+        unsigned long now = millis();
+        for(size_t ii = 0; ii < entries.size(); ii++) {
+            if (getEntryDeadline(entries[ii], slot, now) == 0) {
+                resolvingIndex = ii;
+                resolvingSlot = slot;
+                resolver.start(entries[ii].host.c_str(), nif, dnsServer, lookupTimeout);
+                break;
+            }
+        }
+        if (resolver.getStatus() == EthernetCellularResolver::Status::IDLE) {
+            // Nothing to resolve
+            return;
+        }
+    }
+
+    EthernetCellularResolver::Status status = resolver.loop();
+    if (status == EthernetCellularResolver::Status::BUSY) {
+        return;
+    }
+
+    Entry &entry = entries[resolvingIndex];
+    IPAddress address = (status == EthernetCellularResolver::Status::SUCCEEDED) ? resolver.getAddress() : IPAddress();
+    resolver.stop();
+    if (address) {
+        _log.trace("dns cache %s resolved on interface %u", entry.host.c_str(), (unsigned)slot);
+    }
+    else {
+        _log.info("dns cache could not resolve %s", entry.host.c_str());
+    }
+
+    mutex.lock();
+    entry.address[slot] = address;
+    entry.resolvedTime[slot] = millis();
+    entry.tried[slot] = true;
+    mutex.unlock();
+}
+
+unsigned long EthernetCellularDnsCache::getNextDeadline(size_t slot, unsigned long pollPeriod) const {
+    unsigned long result = ULONG_MAX;
+    if (slot >= NUM_INTERFACES) {
+        return result;
+    }
+
+    if (resolver.getStatus() == EthernetCellularResolver::Status::BUSY) {
+        return resolver.getNextDeadline(pollPeriod);
+    }
+
+    unsigned long now = millis();
+    for(const Entry &entry : entries) {
+        result = std::min(result, getEntryDeadline(entry, slot, now));
+    }
+    return result;
+}
+
+void EthernetCellularDnsCache::clear() {
+    mutex.lock();
+    for(Entry &entry : entries) {
+        for(size_t slot = 0; slot < NUM_INTERFACES; slot++) {
+            entry.address[slot] = IPAddress();
+            entry.tried[slot] = false;
+        }
+    }
+    mutex.unlock();
+}
+
+unsigned long EthernetCellularDnsCache::getEntryDeadline(const Entry &entry, size_t slot, unsigned long now) const {
+    if (!entry.tried[slot]) {
+        return 0;
+    }
+    unsigned long period = (unsigned long) std::chrono::milliseconds(entry.address[slot] ? ttl : retryDelay).count();
+    unsigned long elapsed = now - entry.resolvedTime[slot];
+    return (elapsed >= period) ? 0 : (period - elapsed);
+}
+
+
+// [static]
+EthernetCellular &EthernetCellular::instance() {
+    if (!_instance) {
+        _instance = new EthernetCellular();
+    }
+    return *_instance;
+}
+
+EthernetCellular::EthernetCellular() {
+    static_assert(sizeof(stateTable) / sizeof(stateTable[0]) == (size_t)State::COUNT, "stateTable does not match State");
+
+#if Wiring_Cellular
+    backupInterfaces.push_back(ActiveInterface::CELLULAR);
+#elif Wiring_WiFi
+    backupInterfaces.push_back(ActiveInterface::WIFI);
+#endif
+
+    resetStatsInternal();
+}
+
+EthernetCellular::~EthernetCellular() {
+}
+
+void EthernetCellular::setup() {
+    if (transitionLogEnabled && (transitionLog.magic != TRANSITION_LOG_MAGIC || transitionLog.size != sizeof(TransitionLog))) {
+        memset(&transitionLog, 0, sizeof(TransitionLog));
+        transitionLog.magic = TRANSITION_LOG_MAGIC;
+        transitionLog.size = sizeof(TransitionLog);
+    }
+    bool hasDefaultProfile = false;
+    for(const NamedTimeoutProfile &namedProfile : timeoutProfiles) {
+        if (strcmp(namedProfile.name, "default") == 0) {
+            hasDefaultProfile = true;
+        }
+    }
+    if (!hasDefaultProfile) {
+        withTimeoutProfile("default", getTimeoutProfile());
+    }
+    if (timeoutProfileFunctionName) {
+        Particle.function(timeoutProfileFunctionName, &EthernetCellular::timeoutProfileFunction, this);
+    }
+
+    if (eventDriven || wakeCallback) {
+        System.on(network_status | cloud_status, systemEventHandler);
+    }
+    if (asyncCallbacks && !callbackQueue && callbackQueueSize > 0) {
+        callbackQueue = new CallbackEvent[callbackQueueSize];
+    }
+    if ((threadMode || (wakeCallback && wakePollPeriod.count() > 0)) && !thread) {
+        thread = new Thread("ethcell", threadFunction, this, OS_THREAD_PRIORITY_DEFAULT, threadStackSize);
+    }
+}
+
+void EthernetCellular::loop() {
+    if (!threadMode) {
+        runStateMachine();
+    }
+    if (callbackQueue) {
+        deliverCallbacks();
+    }
+}
+
+void EthernetCellular::runStateMachine() {
+    if (eventDriven) {
+        if (!eventPending && millis() - lastRunTime < runDelay) {
+            // Nothing has happened and no timeout has been reached
+            return;
+        }
+        eventPending = false;
+    }
+
+    lock();
+    updateCloudDown();
+    checkSleepResumeTimeout();
+
+    State oldState = state;
+    (this->*stateTable[(size_t)state].handler)();
+
+    if (dnsCache.hasHosts() && activeInterface != ActiveInterface::NONE && state == oldState) {
+        // Warm up the cache on the interface that's connected. This does not block, so it's safe under the lock.
+        dnsCache.loop((size_t) activeInterface - 1, getNetwork(activeInterface), getDnsServer(activeInterface));
+    }
+
+    if (eventDriven) {
+        lastRunTime = millis();
+        runDelay = (state != oldState) ? 0 : getStateDeadline();
+    }
+    unlock();
+}
+
+// [static]
+os_thread_return_t EthernetCellular::threadFunction(void *param) {
+    EthernetCellular *self = (EthernetCellular *)param;
+
+    while(true) {
+        if (self->threadMode) {
+            self->runStateMachine();
+            delay(self->threadPeriod.count());
+        }
+        else {
+            // Only here for the wake callback, loop() runs the state machine
+            self->checkStatusChange();
+            delay(self->wakePollPeriod.count());
+        }
+    }
+}
+
+void EthernetCellular::checkStatusChange() {
+    uint8_t status = (Ethernet.ready() ? 0x01 : 0) | (getNetwork(getBackupInterface()).ready() ? 0x02 : 0) | (Particle.connected() ? 0x04 : 0);
+    if (status != lastStatus) {
+        lastStatus = status;
+        wake();
+    }
+}
+
+// [static]
+void EthernetCellular::systemEventHandler(system_event_t event, int param) {
+    _log.trace("%s event %d", (event == network_status) ? "network_status" : "cloud_status", param);
+    instance().wake();
+}
+
+IPAddress EthernetCellular::getCachedAddress(const char *host) const {
+    ActiveInterface iface = activeInterface;
+    if (iface == ActiveInterface::NONE) {
+        return IPAddress();
+    }
+    return dnsCache.lookup(host, (size_t) iface - 1);
+}
+
+void EthernetCellular::wake() {
+    eventPending = true;
+    if (wakeCallback) {
+        wakeCallback();
+    }
+}
+
+unsigned long EthernetCellular::getNextDeadline() const {
+    if (eventPending || callbackQueueRead != callbackQueueWrite || callbackOverflow != 0) {
+        return 0;
+    }
+
+    lock();
+    unsigned long result;
+    if (eventDriven) {
+        // Same test as runStateMachine() uses to decide whether to run the state handler
+        unsigned long elapsed = millis() - lastRunTime;
+        result = (elapsed >= runDelay) ? 0 : (runDelay - elapsed);
+    }
+    else {
+        result = getStateDeadline();
+    }
+    unlock();
+
+    return result;
+}
+
+
+EthernetCellular::Stats EthernetCellular::getStats() const {
+    lock();
+    Stats result = stats;
+
+    // Include the time in the current state and current cloud down period
+    unsigned long now = millis();
+
+    StateStats &stateStats = result.states[(size_t)state];
+    uint32_t elapsed = (uint32_t)(now - stateEnterTime);
+    stateStats.totalTime += elapsed;
+    if (elapsed > stateStats.maxTime) {
+        stateStats.maxTime = elapsed;
+    }
+
+    if (!cloudUp) {
+        result.cloudDownTime += (uint32_t)(now - cloudDownStartTime);
+    }
+    result.elapsedTime = (uint32_t)(now - statsStartTime);
+    unlock();
+
+    return result;
+}
+
+void EthernetCellular::resetStats() {
+    lock();
+    resetStatsInternal();
+    unlock();
+}
+
+void EthernetCellular::countTraffic(ActiveInterface iface, uint32_t txBytes, uint32_t txPackets, uint32_t rxBytes, uint32_t rxPackets) {
+    if (iface == ActiveInterface::NONE) {
+        return;
+    }
+
+    lock();
+    TrafficStats &traffic = (iface == ActiveInterface::ETHERNET) ? stats.ethernetTraffic : 
+        ((iface == ActiveInterface::WIFI) ? stats.wifiTraffic : stats.cellularTraffic);
+    traffic.txBytes += txBytes;
+    traffic.txPackets += txPackets;
+    traffic.rxBytes += rxBytes;
+    traffic.rxPackets += rxPackets;
+    unlock();
+}
+
+void EthernetCellular::resetTrafficStats() {
+    lock();
+    memset(&stats.ethernetTraffic, 0, sizeof(stats.ethernetTraffic));
+    memset(&stats.cellularTraffic, 0, sizeof(stats.cellularTraffic));
+    memset(&stats.wifiTraffic, 0, sizeof(stats.wifiTraffic));
+    unlock();
+}
+
+EthernetCellular::ActiveInterface EthernetCellular::interfaceForNif(network_interface_t nif) const {
+    if (nif != 0) {
+        if (nif == (network_interface_t) Ethernet) {
+            return ActiveInterface::ETHERNET;
+        }
+        for(ActiveInterface backup : backupInterfaces) {
+            if (nif == (network_interface_t) getNetwork(backup)) {
+                return backup;
+            }
+        }
+    }
+    return activeInterface;
+}
+
+EthernetCellular &EthernetCellular::withBackupInterfaces(std::initializer_list<ActiveInterface> list) {
+    backupInterfaces.clear();
+    for(ActiveInterface iface : list) {
+        switch(iface) {
+#if Wiring_Cellular
+            case ActiveInterface::CELLULAR:
+#endif
+#if Wiring_WiFi
+            case ActiveInterface::WIFI:
+#endif
+                if (std::find(backupInterfaces.begin(), backupInterfaces.end(), iface) == backupInterfaces.end()) {
+                    backupInterfaces.push_back(iface);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+    backupIndex = 0;
+    return *this;
+}
+
+EthernetCellular::ActiveInterface EthernetCellular::getBackupInterface() const {
+    return (backupIndex < backupInterfaces.size()) ? backupInterfaces[backupIndex] : ActiveInterface::NONE;
+}
+
+EthernetCellularKeepAliveLearner *EthernetCellular::getKeepAliveLearner(ActiveInterface iface) {
+    switch(iface) {
+        case ActiveInterface::ETHERNET:
+            return &ethernetKeepAliveLearner;
+
+        case ActiveInterface::CELLULAR:
+            return &cellularKeepAliveLearner;
+
+        default:
+            return nullptr;
+    }
+}
+
+// [static]
+NetworkClass &EthernetCellular::getNetwork(ActiveInterface iface) {
+    switch(iface) {
+        case ActiveInterface::ETHERNET:
+            return Ethernet;
+
+#if Wiring_Cellular
+        case ActiveInterface::CELLULAR:
+            return Cellular;
+#endif
 
 #if Wiring_WiFi
-#define CellularOrWiFi WiFi
+        case ActiveInterface::WIFI:
+            return WiFi;
+#endif
+
+        default:
+            return Network;
+    }
+}
+
+EthernetCellular::State EthernetCellular::nextBackupState() {
+    if (backupIndex + 1 < backupInterfaces.size()) {
+        backupIndex++;
+        return State::TRY_CELLULAR;
+    }
+    if (ethernetPresent) {
+        return State::TRY_ETHERNET;
+    }
+    if (backupInterfaces.size() > 1) {
+        // No Ethernet, start again at the top of the list
+        backupIndex = 0;
+        return State::TRY_CELLULAR;
+    }
+    return state;
+}
+
+void EthernetCellular::endCriticalSection() {
+    if (criticalSectionCount > 0 && --criticalSectionCount == 0) {
+        // Run the state machine soon in event-driven mode in case a retry was postponed
+        wake();
+    }
+}
+
+void EthernetCellular::resetStatsInternal() {
+    memset(&stats, 0, sizeof(stats));
+
+    // Count the current state and cloud down period as started now
+    unsigned long now = millis();
+    statsStartTime = now;
+    stats.states[(size_t)state].entryCount = 1;
+    stateEnterTime = now;
+    if (!cloudUp) {
+        stats.cloudDownCount = 1;
+        cloudDownStartTime = now;
+    }
+}
+
+void EthernetCellular::setState(State newState, TransitionReason reason) {
+    unsigned long now = millis();
+
+    StateStats &oldStateStats = stats.states[(size_t)state];
+    uint32_t elapsed = (uint32_t)(now - stateEnterTime);
+    oldStateStats.totalTime += elapsed;
+    if (elapsed > oldStateStats.maxTime) {
+        oldStateStats.maxTime = elapsed;
+    }
+
+    if (transitionLogEnabled) {
+        logTransition(newState, reason, elapsed);
+    }
+    if (timeoutProfilePending) {
+        applyPendingTimeoutProfile();
+    }
+
+    stats.states[(size_t)newState].entryCount++;
+
+    Transition &transition = stats.transitions[stats.transitionCount % Stats::TRANSITION_HISTORY_SIZE];
+    transition.timestamp = (uint32_t) now;
+    transition.fromState = state;
+    transition.toState = newState;
+    stats.transitionCount++;
+
+    if (newState == State::TRY_ETHERNET || newState == State::TRY_CELLULAR) {
+        tryInterfaceTime = now;
+    }
+    if (newState == State::CELLULAR_CLOUD_CONNECTED) {
+        // Start of a new retry period
+        switchPendingNotified = false;
+        criticalSectionDeferring = false;
+    }
+
+    _log.trace("state %s -> %s", getStateName(state), getStateName(newState));
+
+    state = newState;
+    stateEnterTime = now;
+}
+
+void EthernetCellular::logTransition(State newState, TransitionReason reason, uint32_t timeInState) {
+    TransitionRecord &record = transitionLog.records[transitionLog.writeCount % ETHERNETCELLULAR_TRANSITION_LOG_SIZE];
+
+    record.timestamp = Time.isValid() ? (uint32_t) Time.now() : 0;
+    record.timeInState = timeInState;
+    record.fromState = (uint8_t) state;
+    record.toState = (uint8_t) newState;
+    record.reason = (uint8_t) reason;
+    record.signal = -1;
+#if Wiring_Cellular
+    // Reading the signal is slow, so only do it when entering or leaving cellular
+    if ((state == State::CELLULAR_CLOUD_CONNECTED || newState == State::CELLULAR_CLOUD_CONNECTED) && Cellular.ready()) {
+        record.signal = (int8_t) Cellular.RSSI().getStrength();
+    }
+#endif
+    record.rtt = (probe.getSampleCount() > 0) ? (uint16_t) std::min(probe.getRttEstimate(), (unsigned long) UINT16_MAX) : 0;
+    record.reserved = 0;
+
+    transitionLog.writeCount++;
+    if (transitionLog.writeCount - transitionLog.uploadedCount > ETHERNETCELLULAR_TRANSITION_LOG_SIZE) {
+        // The oldest record that was not uploaded has been overwritten
+        transitionLog.uploadedCount = transitionLog.writeCount - ETHERNETCELLULAR_TRANSITION_LOG_SIZE;
+    }
+}
+
+bool EthernetCellular::getTransitionLogRecord(uint32_t seq, TransitionRecord &record) const {
+    bool result = false;
+
+    lock();
+    if (seq < transitionLog.writeCount && transitionLog.writeCount - seq <= ETHERNETCELLULAR_TRANSITION_LOG_SIZE) {
+        record = transitionLog.records[seq % ETHERNETCELLULAR_TRANSITION_LOG_SIZE];
+        result = true;
+    }
+    unlock();
+
+    return result;
+}
+
+void EthernetCellular::setTransitionLogUploaded(uint32_t seq) {
+    lock();
+    if (seq > transitionLog.uploadedCount && seq <= transitionLog.writeCount) {
+        transitionLog.uploadedCount = seq;
+    }
+    unlock();
+}
+
+EthernetCellular &EthernetCellular::withTimeoutProfile(const char *name, const TimeoutProfile &profile) {
+    NamedTimeoutProfile namedProfile;
+    namedProfile.name = name;
+    namedProfile.profile = profile;
+    timeoutProfiles.push_back(namedProfile);
+    return *this;
+}
+
+EthernetCellular::TimeoutProfile EthernetCellular::getTimeoutProfile() const {
+    TimeoutProfile profile;
+
+    lock();
+    profile.ethernetConnectTimeout = ethernetConnectTimeout;
+    profile.ethernetCloudConnectTimeout = ethernetCloudConnectTimeout;
+    profile.cellularConnectTimeout = cellularConnectTimeout;
+    profile.cellularCloudConnectTimeout = cellularCloudConnectTimeout;
+    profile.wifiConnectTimeout = wifiConnectTimeout;
+    profile.wifiCloudConnectTimeout = wifiCloudConnectTimeout;
+    profile.retryEthernetPeriod = retryEthernetPeriod;
+    profile.drainTimeout = drainTimeout;
+    unlock();
+
+    return profile;
+}
+
+void EthernetCellular::applyTimeoutProfile(const TimeoutProfile &profile, const char *name) {
+    lock();
+    pendingTimeoutProfile = profile;
+    pendingTimeoutProfileName = name;
+    timeoutProfilePending = true;
+    unlock();
+}
+
+bool EthernetCellular::applyTimeoutProfile(const char *name) {
+    for(const NamedTimeoutProfile &namedProfile : timeoutProfiles) {
+        if (strcmp(namedProfile.name, name) == 0) {
+            applyTimeoutProfile(namedProfile.profile, namedProfile.name);
+            return true;
+        }
+    }
+    _log.info("No timeout profile named %s", name);
+    return false;
+}
+
+void EthernetCellular::applyPendingTimeoutProfile() {
+    const TimeoutProfile &profile = pendingTimeoutProfile;
+
+    ethernetConnectTimeout = profile.ethernetConnectTimeout;
+    ethernetCloudConnectTimeout = profile.ethernetCloudConnectTimeout;
+    cellularConnectTimeout = profile.cellularConnectTimeout;
+    cellularCloudConnectTimeout = profile.cellularCloudConnectTimeout;
+    wifiConnectTimeout = profile.wifiConnectTimeout;
+    wifiCloudConnectTimeout = profile.wifiCloudConnectTimeout;
+    retryEthernetPeriod = profile.retryEthernetPeriod;
+    drainTimeout = profile.drainTimeout;
+    updateBackupTimeouts();
+
+    timeoutProfileName = pendingTimeoutProfileName;
+    timeoutProfilePending = false;
+    _log.info("Applied timeout profile %s", timeoutProfileName);
+}
+
+void EthernetCellular::updateBackupTimeouts() {
+    if (getBackupInterface() == ActiveInterface::WIFI) {
+        backupConnectTimeout = wifiConnectTimeout;
+        backupCloudConnectTimeout = wifiCloudConnectTimeout;
+    }
+    else {
+        backupConnectTimeout = cellularModemReset ? cellularConnectTimeout : getAdaptiveCellularTimeout();
+        backupCloudConnectTimeout = cellularCloudConnectTimeout;
+    }
+}
+
+std::chrono::milliseconds EthernetCellular::getAdaptiveCellularTimeout() const {
+    if (adaptiveCellularMultiplier <= 0.0) {
+        return cellularConnectTimeout;
+    }
+
+    uint32_t longest = 0;
+    for(size_t ii = 0; ii < CELLULAR_READY_HISTORY_SIZE; ii++) {
+        longest = std::max(longest, (uint32_t) persistentData.cellularReadyHistory[ii]);
+    }
+    if (longest == 0) {
+        // No history yet
+        return cellularConnectTimeout;
+    }
+
+    std::chrono::milliseconds result((long long)(longest * 1000 * adaptiveCellularMultiplier));
+    return std::min(cellularConnectTimeout, std::max(adaptiveCellularMinTimeout, result));
+}
+
+void EthernetCellular::recordCellularReady(uint32_t readyTime) {
+    CellularTimingStats &timing = stats.cellularTiming;
+    timing.lastReadyTime = readyTime;
+
+#if Wiring_Cellular
+    CellularGlobalIdentity cgi = {};
+    cgi.size = sizeof(CellularGlobalIdentity);
+    cgi.version = CGI_VERSION_LATEST;
+    if (cellular_global_identity(&cgi, NULL) == 0) {
+        timing.mcc = cgi.mobile_country_code;
+        timing.mnc = cgi.mobile_network_code;
+    }
+    timing.accessTechnology = Cellular.RSSI().getAccessTechnology();
+    _log.info("Cellular ready in %lu ms, mcc=%u mnc=%u rat=%d", (unsigned long)readyTime, timing.mcc, timing.mnc, timing.accessTechnology);
+
+    if (timing.mcc != persistentData.cellularMcc || timing.mnc != persistentData.cellularMnc) {
+        // Different operator, the old times don't apply
+        memset(persistentData.cellularReadyHistory, 0, sizeof(persistentData.cellularReadyHistory));
+        persistentData.cellularMcc = timing.mcc;
+        persistentData.cellularMnc = timing.mnc;
+    }
 #endif
+
+    if (cellularModemReset) {
+        // Not a normal registration, don't count it in the history
+        savePersistentData();
+        return;
+    }
+
+    uint16_t *history = persistentData.cellularReadyHistory;
+    memmove(&history[1], &history[0], (CELLULAR_READY_HISTORY_SIZE - 1) * sizeof(uint16_t));
+    history[0] = (uint16_t) std::min((readyTime + 999) / 1000, (uint32_t) UINT16_MAX);
+    savePersistentData();
+}
+
+int EthernetCellular::timeoutProfileFunction(String param) {
+    return applyTimeoutProfile(param.c_str()) ? 0 : -1;
+}
+
+bool EthernetCellular::isStateTimedOut() const {
+    std::chrono::milliseconds EthernetCellular::*timeout = stateTable[(size_t)state].timeout;
+    if (!timeout) {
+        return false;
+    }
+    return millis() - stateTime >= (unsigned long)(this->*timeout).count();
+}
+
+unsigned long EthernetCellular::getStateDeadline() const {
+    unsigned long now = millis();
+    unsigned long result = (unsigned long) eventDrivenMaxIdle.count();
+
+    // Milliseconds remaining from start until period has elapsed
+    auto remaining = [now](unsigned long start, unsigned long period) {
+        unsigned long elapsed = now - start;
+        return (elapsed >= period) ? 0 : (period - elapsed);
+    };
+
+    switch(state) {
+        case State::START:
+        case State::TRY_ETHERNET:
+        case State::TRY_CELLULAR:
+        case State::CELLULAR_TRY_ETHERNET_IN_BACKGROUND:
+            // These always transition to another state immediately
+            return 0;
+
+        case State::CELLULAR_CHECK_ETHERNET_REACHABILITY:
+            // The reachability check is polled until it completes or reachabilityTimeout elapses
+            return std::min(result, reachabilityCheck.getNextDeadline((unsigned long) socketPollPeriod.count()));
+
+        case State::WAIT_CELLULAR_READY:
 #if Wiring_Cellular
-#define CellularOrWiFi Cellular
+            if (cellularModemOffTime != 0) {
+                // Turning the modem off generates a network_status event, this is only the off timeout
+                return std::min(result, remaining(cellularModemOffTime, (unsigned long) cellularModemOffTimeout.count()));
+            }
+#endif
+            // Fall through
+        case State::WAIT_CELLULAR_CLOUD:
+            // Without Ethernet or another backup, the timeout doesn't cause a transition
+            if (!ethernetPresent && backupInterfaces.size() <= 1) {
+                return result;
+            }
+            break;
+
+        case State::CELLULAR_CLOUD_CONNECTED:
+            if (ethernetPresent || backupIndex != 0) {
+                unsigned long retryPeriod = (unsigned long) retryPolicy.getPeriod(retryEthernetPeriod).count();
+                if (criticalSectionDeferring) {
+                    // endCriticalSection() wakes the state machine, so only the maximum deferral needs a deadline
+                    result = std::min(result, remaining(criticalSectionDeferStart, (unsigned long) maxCriticalSectionDeferral.count()));
+                }
+                else {
+                    result = std::min(result, remaining(stateTime, retryPeriod));
+                }
+                if (!switchPendingNotified && switchPendingCallback && retryPeriod > (unsigned long) switchPendingNotice.count()) {
+                    result = std::min(result, remaining(stateTime, retryPeriod - (unsigned long) switchPendingNotice.count()));
+                }
+                if (ethernetLinkMonitor) {
+                    result = std::min(result, remaining(ethernetLinkCheckTime, (unsigned long) ethernetLinkCheckPeriod.count()));
+                }
+                if (ethernetLinkCameUp) {
+                    result = std::min(result, remaining(ethernetLinkCameUpTime, (unsigned long) retryPolicy.getPeriod(ethernetLinkStableTime).count()));
+                }
+            }
+            break;
+
+        case State::WAIT_ETHERNET_READY:
+            if (ethernetLinkUpMillis == 0) {
+                // Poll the link so the link up time in the timing stats is accurate
+                result = std::min(result, (unsigned long) ethernetLinkCheckPeriod.count());
+            }
+            if (ethernetLinkMonitor) {
+                result = std::min(result, remaining(ethernetLinkCheckTime, (unsigned long) ethernetLinkCheckPeriod.count()));
+            }
+            break;
+
+        case State::WAIT_ETHERNET_CLOUD:
+            if (ethernetLinkMonitor) {
+                result = std::min(result, remaining(ethernetLinkCheckTime, (unsigned long) ethernetLinkCheckPeriod.count()));
+            }
+            break;
+
+        case State::CELLULAR_DRAIN_THEN_TRY_ETHERNET:
+        case State::ETHERNET_DRAIN_THEN_TRY_CELLULAR:
+            // endCloudOperation() and interfaceChangeReady() wake the state machine, so only the timeouts need a deadline
+            if (cloudOperationCount > 0) {
+                result = std::min(result, remaining(stateTime, (unsigned long) drainTimeout.count()));
+            }
+            if (interfaceChangeReadyPending) {
+                result = std::min(result, remaining(stateTime, (unsigned long) beforeInterfaceChangeTimeout.count()));
+            }
+            break;
+
+        case State::ETHERNET_CLOUD_CONNECTED:
+            if (ethernetLinkMonitor) {
+                result = std::min(result, remaining(ethernetLinkCheckTime, (unsigned long) ethernetLinkCheckPeriod.count()));
+            }
+            if (probe.hasHosts()) {
+                result = std::min(result, probe.getNextDeadline((unsigned long) socketPollPeriod.count()));
+            }
+            if (retryPolicy.getRetryCount() != 0) {
+                result = std::min(result, remaining(stateTime, (unsigned long) retryPolicy.getStableTime()));
+            }
+            break;
+        
+        default:
+            break;
+    }
+
+    std::chrono::milliseconds EthernetCellular::*timeout = stateTable[(size_t)state].timeout;
+    if (timeout) {
+        result = std::min(result, remaining(stateTime, (unsigned long)(this->*timeout).count()));
+    }
+
+    if (dnsCache.hasHosts() && activeInterface != ActiveInterface::NONE) {
+        result = std::min(result, dnsCache.getNextDeadline((size_t) activeInterface - 1, (unsigned long) socketPollPeriod.count()));
+    }
+
+    if (sleepPrepared) {
+        // Run at least twice per sleep resume timeout, so a gap longer than that means the device slept
+        result = std::min(result, (unsigned long) sleepResumeTimeout.count() / 2);
+    }
+
+    return result;
+}
+
+// [static]
+const char *EthernetCellular::getStateName(State state) {
+    if ((size_t)state >= (size_t)State::COUNT) {
+        return "unknown";
+    }
+    return stateTable[(size_t)state].name;
+}
+
+void EthernetCellular::setActiveInterface(ActiveInterface newActiveInterface) {
+    ActiveInterface oldActiveInterface = activeInterface;
+    activeInterface = newActiveInterface;
+
+    if (oldActiveInterface != newActiveInterface) {
+        unsigned long now = millis();
+
+        if (newActiveInterface != ActiveInterface::NONE) {
+            if (lastConnectedInterface != ActiveInterface::NONE && lastConnectedInterface != newActiveInterface) {
+                stats.switchoverCount++;
+            }
+            lastConnectedInterface = newActiveInterface;
+
+            InterfaceStats &interfaceStats = (newActiveInterface == ActiveInterface::ETHERNET) ? stats.ethernet : 
+                ((newActiveInterface == ActiveInterface::WIFI) ? stats.wifi : stats.cellular);
+            uint32_t timeToCloud = (uint32_t)(now - tryInterfaceTime);
+            interfaceStats.connectCount++;
+            interfaceStats.lastTimeToCloud = timeToCloud;
+            interfaceStats.totalTimeToCloud += timeToCloud;
+            if (timeToCloud > interfaceStats.maxTimeToCloud) {
+                interfaceStats.maxTimeToCloud = timeToCloud;
+            }
+
+            // Only boot-relevant state is persisted, the times to cloud are in the stats. When 
+            // lastInterface and the Ethernet history don't change, savePersistentData() doesn't write.
+            persistentData.lastInterface = (uint8_t) newActiveInterface;
+            if (newActiveInterface == ActiveInterface::ETHERNET) {
+                recordEthernetAttempt(true);
+            }
+            else {
+                savePersistentData();
+            }
+        }
+
+        CallbackEvent event = { CallbackEventType::INTERFACE_CHANGE, oldActiveInterface, newActiveInterface, 0 };
+        dispatchCallback(event);
+    }
+}
+
+void EthernetCellular::updateCloudDown() {
+    bool connected = Particle.connected();
+    if (connected == cloudUp) {
+        return;
+    }
+    cloudUp = connected;
+
+    unsigned long now = millis();
+    if (connected) {
+        stats.cloudDownTime += (uint32_t)(now - cloudDownStartTime);
+    }
+    else {
+        stats.cloudDownCount++;
+        cloudDownStartTime = now;
+    }
+}
+
+void EthernetCellular::dispatchCallback(const CallbackEvent &event) {
+    if (!callbackQueue) {
+        callCallback(event);
+        return;
+    }
+
+    uint32_t overflow = callbackOverflow;
+    uint32_t writeIndex = callbackQueueWrite;
+    if (overflow == 0 && writeIndex - callbackQueueRead < callbackQueueSize) {
+        callbackQueue[writeIndex % callbackQueueSize] = event;
+        callbackQueueWrite = writeIndex + 1;
+    }
+    else {
+        // Queue is full, or a coalesced change is already pending and must stay after the queued events
+        callbackOverflowCount++;
+        if (event.type == CallbackEventType::INTERFACE_CHANGE) {
+            uint32_t newValue;
+            do {
+                ActiveInterface oldInterface = (overflow & CALLBACK_OVERFLOW_PENDING) ? (ActiveInterface)((overflow >> 8) & 0xff) : event.oldInterface;
+                newValue = CALLBACK_OVERFLOW_PENDING | ((uint32_t)oldInterface << 8) | (uint32_t)event.newInterface;
+            } while(!callbackOverflow.compare_exchange_weak(overflow, newValue));
+        }
+    }
+    wake();
+}
+
+void EthernetCellular::callCallback(const CallbackEvent &event) {
+    switch(event.type) {
+        case CallbackEventType::INTERFACE_CHANGE:
+            if (interfaceChangeCallback && event.oldInterface != event.newInterface) {
+                interfaceChangeCallback(event.oldInterface, event.newInterface);
+            }
+            break;
+
+        case CallbackEventType::SWITCH_PENDING:
+            if (switchPendingCallback) {
+                switchPendingCallback(std::chrono::milliseconds(event.value));
+            }
+            break;
+
+        case CallbackEventType::BEFORE_INTERFACE_CHANGE:
+            if (beforeInterfaceChangeCallback) {
+                beforeInterfaceChangeCallback(event.oldInterface, event.newInterface, std::chrono::milliseconds(event.value));
+            }
+            break;
+    }
+}
+
+void EthernetCellular::deliverCallbacks() {
+    uint32_t readIndex = callbackQueueRead;
+    while(readIndex != callbackQueueWrite) {
+        CallbackEvent event = callbackQueue[readIndex % callbackQueueSize];
+        callbackQueueRead = ++readIndex;
+        callCallback(event);
+    }
+
+    uint32_t overflow = callbackOverflow.exchange(0);
+    if (overflow & CALLBACK_OVERFLOW_PENDING) {
+        CallbackEvent event = { CallbackEventType::INTERFACE_CHANGE, (ActiveInterface)((overflow >> 8) & 0xff), (ActiveInterface)(overflow & 0xff), 0 };
+        callCallback(event);
+    }
+}
+
+
+void EthernetCellular::loadPersistentData() {
+    switch(persistentStorage) {
+        case PersistentStorage::RETAINED:
+            persistentData = retainedPersistentData;
+            break;
+
+        case PersistentStorage::EEPROM:
+            EEPROM.get(eepromOffset, persistentData);
+            break;
+
+        default:
+            break;
+    }
+
+    if (persistentData.magic != PERSISTENT_DATA_MAGIC || persistentData.size != sizeof(PersistentData)) {
+        memset(&persistentData, 0, sizeof(PersistentData));
+        persistentData.magic = PERSISTENT_DATA_MAGIC;
+        persistentData.size = sizeof(PersistentData);
+    }
+    else {
+        _log.info("Restored lastInterface=%d ethernetHistory=0x%02x", (int)persistentData.lastInterface, (int)persistentData.ethernetHistory);
+    }
+}
+
+void EthernetCellular::savePersistentData() {
+    switch(persistentStorage) {
+        case PersistentStorage::RETAINED:
+            retainedPersistentData = persistentData;
+            break;
+
+        case PersistentStorage::EEPROM: {
+            // Avoid unnecessary flash writes
+            PersistentData saved;
+            EEPROM.get(eepromOffset, saved);
+            if (memcmp(&saved, &persistentData, sizeof(PersistentData)) != 0) {
+                EEPROM.put(eepromOffset, persistentData);
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+void EthernetCellular::recordEthernetAttempt(bool success) {
+    persistentData.ethernetHistory = (uint8_t)((persistentData.ethernetHistory << 1) | (success ? 0 : 1));
+    if (!success && ethernetUsingSavedLease && activeInterface != ActiveInterface::ETHERNET) {
+        // Never got to the cloud with the saved address; it may have changed, so use DHCP next time
+        _log.info("Saved Ethernet address did not work, using DHCP next time");
+        memset(persistentData.ethernetLeaseAddress, 0, sizeof(persistentData.ethernetLeaseAddress));
+        ethernetUsingSavedLease = false;
+    }
+    savePersistentData();
+}
+
+EthernetCellular &EthernetCellular::withEthernetStaticAddress(IPAddress address, IPAddress subnetMask, IPAddress gateway, IPAddress dns) {
+    ethernetStatic = true;
+    ethernetStaticAddress = address;
+    ethernetStaticSubnetMask = subnetMask;
+    ethernetStaticGateway = gateway;
+    ethernetStaticDns = dns;
+    return *this;
+}
+
+void EthernetCellular::applyEthernetConfig() {
+    ethernetUsingSavedLease = false;
+
+#if SYSTEM_VERSION >= SYSTEM_VERSION_DEFAULT(5, 3, 0)
+    if (!ethernetStatic && !ethernetLeaseReuse) {
+        if (persistentData.ethernetStaticConfig) {
+            // Device OS keeps the static address from when one of these was enabled
+            _log.info("Static Ethernet address is no longer used, restoring DHCP");
+            setEthernetConfig(IPAddress(), IPAddress(), IPAddress(), IPAddress());
+        }
+        // Otherwise leave whatever configuration Device OS has
+        return;
+    }
+
+    if (ethernetStatic) {
+        setEthernetConfig(ethernetStaticAddress, ethernetStaticSubnetMask, ethernetStaticGateway, ethernetStaticDns);
+        return;
+    }
+
+    const uint8_t *addr = persistentData.ethernetLeaseAddress;
+    if (addr[0] != 0 && !isEthernetLeaseFresh()) {
+        _log.info("Saved Ethernet address is too old or its age is unknown, using DHCP");
+        memset(persistentData.ethernetLeaseAddress, 0, sizeof(persistentData.ethernetLeaseAddress));
+        savePersistentData();
+    }
+
+    if (addr[0] != 0) {
+        const uint8_t *mask = persistentData.ethernetLeaseSubnetMask;
+        const uint8_t *gw = persistentData.ethernetLeaseGateway;
+        const uint8_t *dns = persistentData.ethernetLeaseDns;
+
+        _log.info("Using saved Ethernet address %u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
+        setEthernetConfig(IPAddress(addr[0], addr[1], addr[2], addr[3]), IPAddress(mask[0], mask[1], mask[2], mask[3]),
+            IPAddress(gw[0], gw[1], gw[2], gw[3]), IPAddress(dns[0], dns[1], dns[2], dns[3]));
+        ethernetUsingSavedLease = true;
+    }
+    else {
+        setEthernetConfig(IPAddress(), IPAddress(), IPAddress(), IPAddress());
+    }
+#else
+    if (ethernetStatic || ethernetLeaseReuse) {
+        _log.error("Ethernet static address requires Device OS 5.3.0 or later");
+    }
+#endif
+}
+
+void EthernetCellular::setEthernetConfig(IPAddress address, IPAddress subnetMask, IPAddress gateway, IPAddress dns) {
+#if SYSTEM_VERSION >= SYSTEM_VERSION_DEFAULT(5, 3, 0)
+    if (ethernetConfigSet && address == ethernetConfigAddress && subnetMask == ethernetConfigSubnetMask &&
+        gateway == ethernetConfigGateway && dns == ethernetConfigDns) {
+        // Ethernet.setConfig() writes the configuration to flash, so don't set the same one again
+        return;
+    }
+
+    if (address) {
+        Ethernet.setConfig(NetworkInterfaceConfig()
+            .source(NetworkInterfaceConfigSource::STATIC)
+            .address(address, subnetMask)
+            .gateway(gateway)
+            .dns(dns));
+    }
+    else {
+        Ethernet.setConfig(NetworkInterfaceConfig()
+            .source(NetworkInterfaceConfigSource::DHCP));
+    }
+
+    uint8_t staticConfig = address ? 1 : 0;
+    if (persistentData.ethernetStaticConfig != staticConfig) {
+        persistentData.ethernetStaticConfig = staticConfig;
+        savePersistentData();
+    }
+
+    ethernetConfigSet = true;
+    ethernetConfigAddress = address;
+    ethernetConfigSubnetMask = subnetMask;
+    ethernetConfigGateway = gateway;
+    ethernetConfigDns = dns;
 #endif
+}
+
+bool EthernetCellular::isEthernetLeaseFresh() const {
+    if (ethernetLeaseMaxAge.count() == 0) {
+        return true;
+    }
+    if (persistentData.ethernetLeaseTime == 0 || !Time.isValid()) {
+        // Can't tell how old it is
+        return false;
+    }
+    uint32_t age = (uint32_t) Time.now() - persistentData.ethernetLeaseTime;
+    return age < (uint32_t) ethernetLeaseMaxAge.count();
+}
+
+void EthernetCellular::saveEthernetLease() {
+    IPAddress address = Ethernet.localIP();
+    IPAddress subnetMask = Ethernet.subnetMask();
+    IPAddress gateway = Ethernet.gatewayIP();
+    IPAddress dns = Ethernet.dnsServerIP();
 
+    bool same = true;
+    for(int ii = 0; ii < 4; ii++) {
+        if (persistentData.ethernetLeaseAddress[ii] != address[ii] || persistentData.ethernetLeaseSubnetMask[ii] != subnetMask[ii] ||
+            persistentData.ethernetLeaseGateway[ii] != gateway[ii] || persistentData.ethernetLeaseDns[ii] != dns[ii]) {
+            same = false;
+        }
+    }
+    if (same && persistentData.ethernetLeaseTime != 0) {
+        // The lease time is when DHCP last gave this address, refresh it before it gets too old to reuse
+        if (ethernetLeaseMaxAge.count() == 0 || !Time.isValid()) {
+            return;
+        }
+        uint32_t age = (uint32_t) Time.now() - persistentData.ethernetLeaseTime;
+        if (age < (uint32_t) ethernetLeaseMaxAge.count() / 2) {
+            return;
+        }
+    }
 
-// [static]
-EthernetCellular &EthernetCellular::instance() {
-    if (!_instance) {
-        _instance = new EthernetCellular();
+    for(int ii = 0; ii < 4; ii++) {
+        persistentData.ethernetLeaseAddress[ii] = address[ii];
+        persistentData.ethernetLeaseSubnetMask[ii] = subnetMask[ii];
+        persistentData.ethernetLeaseGateway[ii] = gateway[ii];
+        persistentData.ethernetLeaseDns[ii] = dns[ii];
     }
-    return *_instance;
+    persistentData.ethernetLeaseTime = Time.isValid() ? (uint32_t) Time.now() : 0;
+    savePersistentData();
 }
 
-EthernetCellular::EthernetCellular() {
+void EthernetCellular::checkEthernetLinkUpTime() {
+    if (ethernetLinkUpMillis != 0) {
+        return;
+    }
+    int linkStatus = ethernetLinkStatusFunction ? ethernetLinkStatusFunction() : readEthernetLinkStatus();
+    if (linkStatus == 1) {
+        ethernetLinkUpMillis = millis();
+    }
 }
 
-EthernetCellular::~EthernetCellular() {
+void EthernetCellular::prepareForSleep() {
+    lock();
+    ActiveInterface iface = (activeInterface != ActiveInterface::NONE) ? activeInterface : lastConnectedInterface;
+
+    persistentData.sleepInterface = (uint8_t) iface;
+    persistentData.sleepBackupIndex = (uint8_t) backupIndex;
+    persistentData.sleepRetryElapsed = (state == State::CELLULAR_CLOUD_CONNECTED) ? (uint32_t)(millis() - stateTime) : 0;
+    savePersistentData();
+
+    sleepPrepared = true;
+    sleepPrepareMillis = sleepCheckMillis = millis();
+
+    _log.info("Preparing for sleep on interface %d", (int) iface);
+    unlock();
 }
 
-void EthernetCellular::setup() {
+void EthernetCellular::resumeFromSleep(SystemSleepWakeupReason wakeReason) {
+    lock();
+    if (wakeReason == SystemSleepWakeupReason::BY_NETWORK) {
+        // Network standby, the connection is still up
+        persistentData.sleepInterface = (uint8_t) ActiveInterface::NONE;
+        savePersistentData();
+        sleepPrepared = false;
+        wake();
+    }
+    else if (state != State::START) {
+        // If still in START, stateStart() will do this after loading the persistent data
+        if (!resumeSavedInterface()) {
+            setState(ethernetPresent ? State::TRY_ETHERNET : State::TRY_CELLULAR, TransitionReason::RESUME);
+        }
+        wake();
+    }
+    unlock();
 }
 
-void EthernetCellular::loop() {
-    stateHandler(*this);
+bool EthernetCellular::resumeSavedInterface() {
+    ActiveInterface iface = (ActiveInterface) persistentData.sleepInterface;
+    if (iface == ActiveInterface::NONE) {
+        return false;
+    }
+    persistentData.sleepInterface = (uint8_t) ActiveInterface::NONE;
+    savePersistentData();
+    sleepPrepared = false;
+
+    if (iface == ActiveInterface::ETHERNET) {
+        if (!ethernetPresent) {
+            return false;
+        }
+        _log.info("Resuming from sleep on Ethernet");
+        setState(State::TRY_ETHERNET, TransitionReason::RESUME);
+        return true;
+    }
+
+    if (persistentData.sleepBackupIndex >= backupInterfaces.size() || backupInterfaces[persistentData.sleepBackupIndex] != iface) {
+        // Backup interfaces changed
+        return false;
+    }
+    _log.info("Resuming from sleep on backup interface %d", (int) iface);
+    backupIndex = persistentData.sleepBackupIndex;
+    resumeRetryElapsed = persistentData.sleepRetryElapsed;
+    setState(State::TRY_CELLULAR, TransitionReason::RESUME);
+    return true;
 }
 
+void EthernetCellular::discardSavedInterface(const char *reason) {
+    _log.info("Discarding the interface saved by prepareForSleep(), %s", reason);
+    persistentData.sleepInterface = (uint8_t) ActiveInterface::NONE;
+    savePersistentData();
+    sleepPrepared = false;
+}
 
-void EthernetCellular::setActiveInterface(ActiveInterface newActiveInterface) {
-    ActiveInterface oldActiveInterface = activeInterface;
-    activeInterface = newActiveInterface;
+void EthernetCellular::checkSleepResumeTimeout() {
+    if (!sleepPrepared) {
+        return;
+    }
 
-    if (oldActiveInterface != newActiveInterface) {
-        if (interfaceChangeCallback) {
-            interfaceChangeCallback(oldActiveInterface, newActiveInterface);
-        }
+    unsigned long now = millis();
+    unsigned long timeout = (unsigned long) sleepResumeTimeout.count();
+    if (now - sleepCheckMillis >= timeout) {
+        // The state machine didn't run for a while, so the device was probably asleep
+        sleepPrepareMillis = now;
+    }
+    else if (now - sleepPrepareMillis >= timeout) {
+        discardSavedInterface("resumeFromSleep() was not called");
     }
+    sleepCheckMillis = now;
 }
 
+void EthernetCellular::saveKeepAliveLearners() {
+    persistentData.ethernetKeepAliveSafe = (uint16_t) ethernetKeepAliveLearner.getSafeKeepAlive();
+    persistentData.ethernetKeepAliveCeiling = (uint16_t) ethernetKeepAliveLearner.getCeiling();
+    persistentData.cellularKeepAliveSafe = (uint16_t) cellularKeepAliveLearner.getSafeKeepAlive();
+    persistentData.cellularKeepAliveCeiling = (uint16_t) cellularKeepAliveLearner.getCeiling();
+    savePersistentData();
+}
 
-void EthernetCellular::stateStart() {
+EthernetCellular &EthernetCellular::withKeepAliveNetworkId(const char *id) {
+    // FNV-1a
+    uint32_t hash = 2166136261UL;
+    for(const char *cp = id; *cp; cp++) {
+        hash = (hash ^ (uint8_t)*cp) * 16777619UL;
+    }
+    keepAliveNetworkId = (hash != 0) ? hash : 1;
+    return *this;
+}
+
+void EthernetCellular::enableEthernetDetectionFeature() {
     if (!System.featureEnabled(FEATURE_ETHERNET_DETECTION)) {
         _log.info("FEATURE_ETHERNET_DETECTION enabled (was disabled before)");
         System.enableFeature(FEATURE_ETHERNET_DETECTION);
     }
+}
+
+void EthernetCellular::detectEthernet() {
+    enableEthernetDetectionFeature();
 
     uint8_t mac[6];
     if (Ethernet.macAddress(mac) != 0) {
@@ -61,13 +1818,75 @@ void EthernetCellular::stateStart() {
     else {
         // the macAddress function returns 0 if there is no Ethernet adapter present
         _log.info("No Ethernet adapter");
+        ethernetPresent = false;
+    }
+
+    if (ethernetDetectionCache) {
+        persistentData.ethernetDetected = ethernetPresent ? ETHERNET_DETECTED_PRESENT : ETHERNET_DETECTED_ABSENT;
+        if (ethernetPresent) {
+            memcpy(persistentData.ethernetMac, mac, sizeof(persistentData.ethernetMac));
+        }
+        else {
+            memset(persistentData.ethernetMac, 0, sizeof(persistentData.ethernetMac));
+        }
+        savePersistentData();
+    }
+}
+
+void EthernetCellular::redetectEthernet() {
+    lock();
+    detectEthernet();
+    unlock();
+}
+
+void EthernetCellular::stateStart() {
+    loadPersistentData();
+
+    ethernetKeepAliveLearner.restore(persistentData.ethernetKeepAliveSafe, persistentData.ethernetKeepAliveCeiling);
+    cellularKeepAliveLearner.restore(persistentData.cellularKeepAliveSafe, persistentData.cellularKeepAliveCeiling);
+
+    if (ethernetPresentDeclared >= 0) {
+        ethernetPresent = (ethernetPresentDeclared != 0);
+        _log.info("Ethernet adapter declared %s, skipping detection", ethernetPresent ? "present" : "not present");
+        if (ethernetPresent) {
+            enableEthernetDetectionFeature();
+        }
+    }
+    else if (ethernetDetectionCache && persistentData.ethernetDetected != ETHERNET_DETECTED_UNKNOWN) {
+        ethernetPresent = (persistentData.ethernetDetected == ETHERNET_DETECTED_PRESENT);
+        _log.info("Ethernet adapter %s (cached), skipping detection", ethernetPresent ? "present" : "not present");
+        if (ethernetPresent) {
+            enableEthernetDetectionFeature();
+        }
+    }
+    else {
+        detectEthernet();
+    }
+
+    if (persistentData.sleepInterface != (uint8_t) ActiveInterface::NONE && !sleepPrepared && System.resetReason() != RESET_REASON_POWER_MANAGEMENT) {
+        // Saved before a reset that wasn't a wake from HIBERNATE, so the device didn't sleep
+        discardSavedInterface("the device did not wake from sleep");
+    }
+    if (resumeSavedInterface()) {
+        return;
     }
 
     if (ethernetPresent) {
-        stateHandler = &EthernetCellular::stateTryEthernet;
+        if (persistentData.lastInterface != (uint8_t)ActiveInterface::NONE && persistentData.lastInterface != (uint8_t)ActiveInterface::ETHERNET && (persistentData.ethernetHistory & 1) != 0) {
+            _log.info("Last known good interface was a backup and Ethernet failed last time, trying the backup first");
+            for(size_t ii = 0; ii < backupInterfaces.size(); ii++) {
+                if ((uint8_t)backupInterfaces[ii] == persistentData.lastInterface) {
+                    backupIndex = ii;
+                }
+            }
+            setState(State::TRY_CELLULAR);
+        }
+        else {
+            setState(State::TRY_ETHERNET);
+        }
     }
     else {        
-        stateHandler = &EthernetCellular::stateTryCellular;
+        setState(State::TRY_CELLULAR);
     }
 }
 void EthernetCellular::stateTryEthernet() {
@@ -75,23 +1894,94 @@ void EthernetCellular::stateTryEthernet() {
     LEDSystemTheme::restoreDefault();
     setActiveInterface(ActiveInterface::NONE);
 
+    // Read the link status again rather than using the result from the previous attempt
+    ethernetLinkStatus = -1;
+
+    // On failure, walk down the backup list from the top
+    backupIndex = 0;
+
     stateTime = millis();
-    CellularOrWiFi.disconnect();
+    for(size_t ii = 0; ii < backupInterfaces.size(); ii++) {
+        NetworkClass &backup = getNetwork(backupInterfaces[ii]);
+        switch(cellularStandby) {
+            case CellularStandby::NONE:
+                backup.disconnect();
+                break;
+
+            case CellularStandby::POWERED:
+                // Don't disconnect, so a modem that is registered stays registered and failover doesn't 
+                // have to power it up or register again. If it was not in use, just power it on.
+                if (!backup.ready() && !backup.connecting()) {
+                    backup.on();
+                }
+                break;
+
+            case CellularStandby::CONNECTED:
+                // Leave the first backup up in the background so failover only needs to move the cloud connection
+                if (ii == 0) {
+                    if (!backup.ready() && !backup.connecting()) {
+                        backup.connect();
+                    }
+                }
+                else {
+                    backup.disconnect();
+                }
+                break;
+        }
+    }
+    applyEthernetConfig();
+    ethernetLinkUpMillis = 0;
+    ethernetReadyMillis = 0;
     Ethernet.connect();
-    stateHandler = &EthernetCellular::stateWaitEthernetReady;
+    setState(State::WAIT_ETHERNET_READY);
 }
 
 void EthernetCellular::stateWaitEthernetReady() {
+    checkEthernetLinkUpTime();
+
     if (Ethernet.ready()) {
         // Have Ethernet link, try connecting to the Particle cloud
+        ethernetReadyMillis = millis();
         Particle.connect();
-        stateHandler = &EthernetCellular::stateWaitEthernetCloud;
+
+        if (ethernetDetectionCache) {
+            uint8_t mac[6];
+            if (Ethernet.macAddress(mac) != 0 && memcmp(mac, persistentData.ethernetMac, sizeof(mac)) != 0) {
+                _log.info("Ethernet MAC address changed, updating cache");
+                memcpy(persistentData.ethernetMac, mac, sizeof(persistentData.ethernetMac));
+                persistentData.ethernetDetected = ETHERNET_DETECTED_PRESENT;
+                savePersistentData();
+            }
+        }
+
+        setState(State::WAIT_ETHERNET_CLOUD);
+        return;
+    }
+
+    checkEthernetLink();
+    if (ethernetLinkStatus == 0 && ethernetLinkUpMillis != 0) {
+        // The link came up in this attempt and went down again (cable pulled during DHCP). A link 
+        // that has not come up yet may still be negotiating, so that case is left to the timeout.
+        _log.info("Ethernet link down while waiting for an address, switching to cellular");
+        recordEthernetAttempt(false);
+        Ethernet.disconnect();
+        setState(State::TRY_CELLULAR, TransitionReason::LINK_DOWN);
         return;
     }
-    if (millis() - stateTime >= ethernetConnectTimeout.count()) {
+
+    if (isStateTimedOut()) {
         // Timed out connecting to Ethernet (no DHCP, for example)
         _log.info("Timed out connecting to Ethernet, reverting to Cellular");
-        stateHandler = &EthernetCellular::stateTryCellular;
+        if (ethernetDetectionCache) {
+            // Make sure the cached result is still correct; the adapter may have been removed
+            uint8_t mac[6];
+            if (Ethernet.macAddress(mac) == 0) {
+                _log.info("Ethernet adapter no longer present, updating cache");
+                detectEthernet();
+            }
+        }
+        recordEthernetAttempt(false);
+        setState(State::TRY_CELLULAR, TransitionReason::TIMEOUT);
         return;
     }
     // Wait some more
@@ -99,19 +1989,56 @@ void EthernetCellular::stateWaitEthernetReady() {
 
 void EthernetCellular::stateWaitEthernetCloud() {
     if (Particle.connected()) {
-        _log.info("Cloud connected over Ethernet keepAlive=%d", (int) ethernetKeepAlive.count());
+        std::chrono::seconds keepAlive = ethernetKeepAliveLearner.getKeepAlive(ethernetKeepAlive);
+        _log.info("Cloud connected over Ethernet keepAlive=%d", (int) keepAlive.count());
         setActiveInterface(ActiveInterface::ETHERNET);
-        Particle.keepAlive(ethernetKeepAlive.count());
+        Particle.keepAlive(keepAlive.count());
+        ethernetKeepAliveLearner.cloudConnected();
+
+        if (ethernetReadyMillis != 0) {
+            // Only for the first cloud connection of this attempt, not a reconnect after CLOUD_LOST
+            EthernetTimingStats &timing = stats.ethernetTiming;
+            unsigned long linkUpMillis = ethernetLinkUpMillis ? ethernetLinkUpMillis : tryInterfaceTime;
+            timing.count++;
+            timing.lastLinkUpTime = (uint32_t)(linkUpMillis - tryInterfaceTime);
+            timing.lastAddressTime = (uint32_t)(ethernetReadyMillis - linkUpMillis);
+            timing.lastCloudTime = (uint32_t)(millis() - ethernetReadyMillis);
+            timing.totalLinkUpTime += timing.lastLinkUpTime;
+            timing.totalAddressTime += timing.lastAddressTime;
+            timing.totalCloudTime += timing.lastCloudTime;
+            _log.info("Ethernet link up %lu ms, address %lu ms, cloud %lu ms", (unsigned long)timing.lastLinkUpTime, (unsigned long)timing.lastAddressTime, (unsigned long)timing.lastCloudTime);
+
+            ethernetLinkUpMillis = 0;
+            ethernetReadyMillis = 0;
+        }
+
+        if (ethernetLeaseReuse && !ethernetStatic && !ethernetUsingSavedLease) {
+            saveEthernetLease();
+        }
+        if (probe.hasHosts()) {
+            probe.start(Ethernet, getDnsServer(ActiveInterface::ETHERNET));
+        }
         stateTime = millis();
-        stateHandler = &EthernetCellular::stateEthernetCloudConnected;
+        setState(State::ETHERNET_CLOUD_CONNECTED, TransitionReason::CONNECTED);
         return;  
     }
 
-    if (millis() - stateTime >= ethernetCloudConnectTimeout.count()) {
+    checkEthernetLink();
+    if (ethernetLinkStatus == 0) {
+        _log.info("Ethernet link down, switching to cellular");
+        recordEthernetAttempt(false);
+        Particle.disconnect();
+        Ethernet.disconnect();
+        setState(State::TRY_CELLULAR, TransitionReason::LINK_DOWN);
+        return;
+    }
+
+    if (isStateTimedOut()) {
         _log.info("Took too long to connect to the cloud by Ethernet, switching to cellular");
+        recordEthernetAttempt(false);
         Particle.disconnect();
         Ethernet.disconnect();
-        stateHandler = &EthernetCellular::stateTryCellular;
+        setState(State::TRY_CELLULAR, TransitionReason::TIMEOUT);
         return;
     }
 
@@ -121,18 +2048,76 @@ void EthernetCellular::stateWaitEthernetCloud() {
 void EthernetCellular::stateEthernetCloudConnected() {
     if (!Particle.connected()) {
         _log.info("Disconnected from the cloud while on Ethernet, waiting for reconnect");
-        stateHandler = &EthernetCellular::stateWaitEthernetCloud;
+        probe.stop();
+        if (ethernetKeepAliveLearner.isEnabled(ethernetKeepAlive)) {
+            ethernetKeepAliveLearner.cloudDisconnected(ethernetKeepAlive, Ethernet.ready());
+            saveKeepAliveLearners();
+        }
+        setState(State::WAIT_ETHERNET_CLOUD, TransitionReason::CLOUD_LOST);
         stateTime = millis();
         return;
     }       
 
+    checkEthernetLink();
+    if (ethernetLinkStatus == 0) {
+        _log.info("Ethernet link down while cloud connected, switching to cellular");
+        recordEthernetAttempt(false);
+        probe.stop();
+        notifyBeforeInterfaceChange(getBackupInterface(), false);
+        Particle.disconnect();
+        Ethernet.disconnect();
+        setState(State::TRY_CELLULAR, TransitionReason::LINK_DOWN);
+        return;
+    }
+
+    if (probe.hasHosts()) {
+        probe.loop();
+        if (probe.getConsecutiveFailures() >= probeFailureThreshold) {
+            _log.info("%d reachability probes failed in a row on Ethernet, switching to cellular", probe.getConsecutiveFailures());
+            recordEthernetAttempt(false);
+            probe.stop();
+            notifyBeforeInterfaceChange(getBackupInterface(), false);
+            Particle.disconnect();
+            Ethernet.disconnect();
+            setState(State::TRY_CELLULAR, TransitionReason::PROBE_FAILED);
+            return;
+        }
+    }
+
+    if (ethernetKeepAliveLearner.loop(ethernetKeepAlive)) {
+        std::chrono::seconds keepAlive = ethernetKeepAliveLearner.getKeepAlive(ethernetKeepAlive);
+        _log.info("Ethernet keepAlive=%d confirmed, trying keepAlive=%d", ethernetKeepAliveLearner.getSafeKeepAlive(), (int) keepAlive.count());
+        Particle.keepAlive(keepAlive.count());
+        saveKeepAliveLearners();
+    }
+
+    if (probe.hasHosts() && isLinkQualityEnabled() && checkLinkQualityDegraded()) {
+        _log.info("Ethernet degraded (rtt=%lu loss=%d%%), switching to cellular", probe.getRttEstimate(), (int)(probe.getLossEstimate() * 100));
+        ethernetDegraded = true;
+        recordEthernetAttempt(false);
+        probe.stop();
+        notifyBeforeInterfaceChange(getBackupInterface(), true);
+        stateTime = millis();
+        setState(State::ETHERNET_DRAIN_THEN_TRY_CELLULAR, TransitionReason::DEGRADED);
+        return;
+    }
+
+    if (retryPolicy.getRetryCount() != 0 && millis() - stateTime >= (unsigned long) retryPolicy.getStableTime()) {
+        _log.info("Ethernet stable, resetting retry backoff");
+        retryPolicy.reset();
+    }
 }
 
 
 void EthernetCellular::stateTryCellular() {
-    _log.info("Trying to connect by cellular");
+    ActiveInterface backupInterface = getBackupInterface();
+    _log.info("Trying to connect by %s", (backupInterface == ActiveInterface::WIFI) ? "Wi-Fi" : "cellular");
     setActiveInterface(ActiveInterface::NONE);
 
+    cellularModemReset = false;
+    cellularModemOffTime = 0;
+    updateBackupTimeouts();
+
     // When in cellular backup mode, show breathing yellow instead of breathing cyan when cloud connected
     if (cellularBackupColor != RGB_COLOR_CYAN) {
         LEDSystemTheme theme;
@@ -147,25 +2132,73 @@ void EthernetCellular::stateTryCellular() {
 
     stateTime = millis();
     Ethernet.disconnect();
-    CellularOrWiFi.connect();
-    stateHandler = &EthernetCellular::stateWaitCellularReady;
+    for(ActiveInterface iface : backupInterfaces) {
+        if (iface != backupInterface) {
+            getNetwork(iface).disconnect();
+        }
+    }
+
+    NetworkClass &backup = getNetwork(backupInterface);
+    backupWasReady = backup.ready();
+    backupReadyMillis = 0;
+    if (backupWasReady) {
+        _log.info("Backup interface is already connected (standby)");
+    }
+    backup.connect();
+    setState(State::WAIT_CELLULAR_READY);
 }
 
 void EthernetCellular::stateWaitCellularReady() {
-    if (CellularOrWiFi.ready()) {
-        // Have Ethernet link, try connecting to the Particle cloud
+    if (getNetwork(getBackupInterface()).ready()) {
+        // Have a network connection, try connecting to the Particle cloud
+        if (getBackupInterface() == ActiveInterface::CELLULAR && !backupWasReady) {
+            backupReadyMillis = millis();
+            recordCellularReady((uint32_t)(backupReadyMillis - tryInterfaceTime));
+        }
         Particle.connect();
-        stateHandler = &EthernetCellular::stateWaitCellularCloud;
+        setState(State::WAIT_CELLULAR_CLOUD);
         return;
     }
-    if (millis() - stateTime >= cellularConnectTimeout.count()) {
-        // Timed out connecting to Cellular (no tower, for example)
-        if (ethernetPresent) {
-            // Try going back to Ethernet
-            stateHandler = &EthernetCellular::stateTryEthernet;
+#if Wiring_Cellular
+    if (cellularModemOffTime != 0) {
+        // Cellular.off() is asynchronous, wait for the modem to turn off before turning it on again
+        if (Cellular.isOff()) {
+            _log.info("Modem is off, turning it on again");
+            stats.cellularTiming.modemResetCount++;
+        }
+        else if (millis() - cellularModemOffTime < (unsigned long) cellularModemOffTimeout.count()) {
+            return;
+        }
+        else {
+            _log.warn("Modem did not turn off after %d ms, connecting anyway", (int) cellularModemOffTimeout.count());
+        }
+        cellularModemOffTime = 0;
+        Cellular.on();
+        Cellular.connect();
+
+        // Give the modem the full cellular connect timeout from when it was turned on
+        stateTime = millis();
+        return;
+    }
+    if (isStateTimedOut() && getBackupInterface() == ActiveInterface::CELLULAR && !cellularModemReset && backupConnectTimeout < cellularConnectTimeout) {
+        // Taking much longer than usual for this site, so the modem may be stuck
+        _log.info("Cellular not ready after %d ms (adaptive timeout), resetting the modem", (int) backupConnectTimeout.count());
+        cellularModemReset = true;
+        backupConnectTimeout = cellularConnectTimeout;
+        Cellular.off();
+        cellularModemOffTime = millis();
+        return;
+    }
+#endif
+    if (isStateTimedOut()) {
+        // Timed out connecting to the backup interface (no tower, for example)
+        State nextState = nextBackupState();
+        if (nextState != state) {
+            // Try the next backup interface or go back to Ethernet
+            setState(nextState, TransitionReason::TIMEOUT);
             return;
         }
-        // No Ethernet to go back to, just keep waiting
+        // Nothing else to try, just keep waiting
     }
 
     // Wait some more    
@@ -173,21 +2206,48 @@ void EthernetCellular::stateWaitCellularReady() {
 
 void EthernetCellular::stateWaitCellularCloud() {
     if (Particle.connected()) {
-        _log.info("Cloud connected over cellular keepAlive=%d", (int) cellularKeepAlive.count());
-        Particle.keepAlive(cellularKeepAlive.count());
-        setActiveInterface(ActiveInterface::CELLULAR);
+        if (keepAliveNetworkId != 0 && keepAliveNetworkId != persistentData.cellularNetworkId) {
+            _log.info("Cellular network changed, learning the cellular keepAlive again");
+            cellularKeepAliveLearner.restore(0, 0);
+            persistentData.cellularNetworkId = keepAliveNetworkId;
+            saveKeepAliveLearners();
+        }
+        ActiveInterface backupInterface = getBackupInterface();
+        EthernetCellularKeepAliveLearner *learner = getKeepAliveLearner(backupInterface);
+        std::chrono::seconds keepAlive = learner ? learner->getKeepAlive(cellularKeepAlive) : wifiKeepAlive;
+        _log.info("Cloud connected over %s keepAlive=%d", (backupInterface == ActiveInterface::WIFI) ? "Wi-Fi" : "cellular", (int) keepAlive.count());
+        Particle.keepAlive(keepAlive.count());
+        if (learner) {
+            learner->cloudConnected();
+        }
+        setActiveInterface(backupInterface);
 
-        stateTime = millis();
-        stateHandler = &EthernetCellular::stateCellularCloudConnected;
+        if (backupInterface == ActiveInterface::CELLULAR && backupReadyMillis != 0) {
+            // Only for the first cloud connection of this attempt, not a reconnect after CLOUD_LOST
+            CellularTimingStats &timing = stats.cellularTiming;
+            timing.lastCloudTime = (uint32_t)(millis() - backupReadyMillis);
+            timing.totalReadyTime += timing.lastReadyTime;
+            timing.totalCloudTime += timing.lastCloudTime;
+            timing.count++;
+            _log.info("Cellular ready %lu ms, cloud %lu ms", (unsigned long)timing.lastReadyTime, (unsigned long)timing.lastCloudTime);
+
+            backupReadyMillis = 0;
+        }
+
+        // After sleep, continue the retry Ethernet schedule where it left off
+        stateTime = millis() - resumeRetryElapsed;
+        resumeRetryElapsed = 0;
+        setState(State::CELLULAR_CLOUD_CONNECTED, TransitionReason::CONNECTED);
         return;  
     }
 
-    if (millis() - stateTime >= cellularCloudConnectTimeout.count()) {
-        if (ethernetPresent) {
-            _log.info("Took too long to connect to the cloud by Cellular, trying Ethernet again");
+    if (isStateTimedOut()) {
+        State nextState = nextBackupState();
+        if (nextState != state) {
+            _log.info("Took too long to connect to the cloud by the backup interface, trying %s", (nextState == State::TRY_ETHERNET) ? "Ethernet again" : "the next backup");
             Particle.disconnect();
 
-            stateHandler = &EthernetCellular::stateTryEthernet;
+            setState(nextState, TransitionReason::TIMEOUT);
             return;
         }
     }
@@ -198,34 +2258,312 @@ void EthernetCellular::stateWaitCellularCloud() {
 void EthernetCellular::stateCellularCloudConnected() {
     if (!Particle.connected()) {
         _log.info("Disconnected from the cloud while on Cellular");
-        stateHandler = &EthernetCellular::stateWaitCellularCloud;
+        EthernetCellularKeepAliveLearner *learner = getKeepAliveLearner(getBackupInterface());
+        if (learner && learner->isEnabled(cellularKeepAlive)) {
+            learner->cloudDisconnected(cellularKeepAlive, getNetwork(getBackupInterface()).ready());
+            saveKeepAliveLearners();
+        }
+        setState(State::WAIT_CELLULAR_CLOUD, TransitionReason::CLOUD_LOST);
         stateTime = millis();
         return;
     }
 
-    if (millis() - stateTime >= retryEthernetPeriod.count()) {
-        if (ethernetPresent) {
-            _log.info("Trying Ethernet again");
-            Particle.disconnect();
-            setActiveInterface(ActiveInterface::NONE);
+    EthernetCellularKeepAliveLearner *learner = getKeepAliveLearner(getBackupInterface());
+    if (learner && learner->loop(cellularKeepAlive)) {
+        std::chrono::seconds keepAlive = learner->getKeepAlive(cellularKeepAlive);
+        _log.info("Cellular keepAlive=%d confirmed, trying keepAlive=%d", learner->getSafeKeepAlive(), (int) keepAlive.count());
+        Particle.keepAlive(keepAlive.count());
+        saveKeepAliveLearners();
+    }
+
+    if (!ethernetPresent && backupIndex == 0) {
+        // Already on the highest priority interface
+        return;
+    }
+
+    unsigned long elapsed = millis() - stateTime;
+    unsigned long retryPeriod = (unsigned long) retryPolicy.getPeriod(retryEthernetPeriod).count();
+
+    checkEthernetLink();
+    // The link must stay up for the stable time, backed off like the retry period so a flapping link waits longer each time
+    unsigned long linkStableTime = (unsigned long) retryPolicy.getPeriod(ethernetLinkStableTime).count();
+    if (ethernetLinkCameUp && elapsed < retryPeriod && millis() - ethernetLinkCameUpTime >= linkStableTime) {
+        _log.info("Ethernet link has been up for %lu ms, retrying Ethernet now", millis() - ethernetLinkCameUpTime);
+        elapsed = retryPeriod;
+    }
+
+    if (!switchPendingNotified && switchPendingCallback && elapsed < retryPeriod && retryPeriod - elapsed <= (unsigned long) switchPendingNotice.count()) {
+        switchPendingNotified = true;
+        CallbackEvent event = { CallbackEventType::SWITCH_PENDING, activeInterface, activeInterface, (uint32_t)(retryPeriod - elapsed) };
+        dispatchCallback(event);
+    }
+
+    if (elapsed >= retryPeriod) {
+        if (isCriticalSection()) {
+            if (!criticalSectionDeferring) {
+                _log.info("Postponing Ethernet retry until the critical section ends");
+                criticalSectionDeferring = true;
+                criticalSectionDeferStart = millis();
+                return;
+            }
+            if (millis() - criticalSectionDeferStart < (unsigned long) maxCriticalSectionDeferral.count()) {
+                return;
+            }
+            _log.info("Critical section has exceeded the maximum deferral, retrying Ethernet anyway");
+        }
+        criticalSectionDeferring = false;
+        ethernetLinkCameUp = false;
+
+        // Counts as failed until Ethernet has been stable, which backs off the next retry
+        retryPolicy.retryStarted();
 
-            // We were really cloud connected before, so disconnecting will take
-            // a non-zero amount of time. This does not happen when going
-            // from Ethernet to cellular for a failed connection, as the
-            // connection hasn't been made yet so there's nothing to tear down.
-            stateHandler = &EthernetCellular::stateCellularWaitDisconnectedThenTryEthernet;
+        if (makeBeforeBreak && ethernetPresent) {
+            // Leave the cloud connection up on cellular while checking Ethernet
+            setState(State::CELLULAR_TRY_ETHERNET_IN_BACKGROUND, TransitionReason::RETRY);
             return;
         }
+
+        _log.info("Trying %s again (retry %d)", ethernetPresent ? "Ethernet" : "the first backup", retryPolicy.getRetryCount());
+        drainThenTryEthernet();
+    }
+}
+
+void EthernetCellular::drainThenTryEthernet() {
+    notifyBeforeInterfaceChange(ethernetPresent ? ActiveInterface::ETHERNET : backupInterfaces[0], true);
+    stateTime = millis();
+    setState(State::CELLULAR_DRAIN_THEN_TRY_ETHERNET, TransitionReason::RETRY);
+}
+
+void EthernetCellular::stateCellularDrainThenTryEthernet() {
+    if (!isDrainComplete()) {
+        // Wait some more
+        return;
+    }
+
+    Particle.disconnect();
+    setActiveInterface(ActiveInterface::NONE);
+
+    // We were really cloud connected before, so disconnecting will take
+    // a non-zero amount of time. This does not happen when going
+    // from Ethernet to cellular for a failed connection, as the
+    // connection hasn't been made yet so there's nothing to tear down.
+    setState(State::CELLULAR_WAIT_DISCONNECTED_THEN_TRY_ETHERNET);
+}
+
+void EthernetCellular::stateEthernetDrainThenTryCellular() {
+    if (!isDrainComplete()) {
+        // Wait some more
+        return;
+    }
+
+    Particle.disconnect();
+    Ethernet.disconnect();
+    setState(State::TRY_CELLULAR);
+}
+
+bool EthernetCellular::isDrainComplete() {
+    if (!Particle.connected()) {
+        interfaceChangeReadyPending = false;
+        return true;
+    }
+
+    unsigned long elapsed = millis() - stateTime;
+    bool waitOperations = (cloudOperationCount > 0 && elapsed < (unsigned long) drainTimeout.count());
+    bool waitReady = (interfaceChangeReadyPending && elapsed < (unsigned long) beforeInterfaceChangeTimeout.count());
+    if (waitOperations || waitReady) {
+        return false;
+    }
+
+    if (cloudOperationCount > 0) {
+        _log.info("%d cloud operations did not end within the drain timeout, disconnecting anyway", (int)cloudOperationCount);
+    }
+    if (interfaceChangeReadyPending) {
+        _log.info("interfaceChangeReady() was not called within the timeout, disconnecting anyway");
+        interfaceChangeReadyPending = false;
+    }
+    return true;
+}
+
+void EthernetCellular::notifyBeforeInterfaceChange(ActiveInterface plannedInterface, bool wait) {
+    if (!beforeInterfaceChangeCallback) {
+        return;
     }
+    std::chrono::milliseconds deadline = wait ? beforeInterfaceChangeTimeout : 0ms;
 
+    // Set before calling, as the callback can call interfaceChangeReady() right away
+    interfaceChangeReadyPending = wait;
+    CallbackEvent event = { CallbackEventType::BEFORE_INTERFACE_CHANGE, activeInterface, plannedInterface, (uint32_t) deadline.count() };
+    dispatchCallback(event);
+}
+
+void EthernetCellular::interfaceChangeReady() {
+    if (interfaceChangeReadyPending) {
+        interfaceChangeReadyPending = false;
+        wake();
+    }
+}
+
+void EthernetCellular::endCloudOperation() {
+    if (cloudOperationCount > 0 && --cloudOperationCount == 0) {
+        // Run the state machine soon in event-driven mode in case it's draining
+        wake();
+    }
 }
 
 void EthernetCellular::stateCellularWaitDisconnectedThenTryEthernet() {
     if (Particle.disconnected()) {
-        stateHandler = &EthernetCellular::stateTryEthernet;
+        if (!ethernetPresent) {
+            // No Ethernet, go back to the first backup interface
+            backupIndex = 0;
+            setState(State::TRY_CELLULAR);
+            return;
+        }
+        setState(State::TRY_ETHERNET);
         return;
     }
 }
 
+void EthernetCellular::stateCellularTryEthernetInBackground() {
+    _log.info("Trying Ethernet in the background while on cellular");
 
+    stateTime = millis();
+    Ethernet.connect();
+    setState(State::CELLULAR_WAIT_ETHERNET_READY_IN_BACKGROUND);
+}
+
+void EthernetCellular::stateCellularWaitEthernetReadyInBackground() {
+    if (!Particle.connected()) {
+        _log.info("Disconnected from the cloud while on Cellular, abandoning Ethernet check");
+        Ethernet.disconnect();
+        setState(State::WAIT_CELLULAR_CLOUD, TransitionReason::CLOUD_LOST);
+        stateTime = millis();
+        return;
+    }
+
+    if (Ethernet.ready()) {
+        startEthernetReachabilityCheck();
+        setState(State::CELLULAR_CHECK_ETHERNET_REACHABILITY);
+        return;
+    }
+
+    if (isStateTimedOut()) {
+        _log.info("Timed out connecting to Ethernet, staying on cellular");
+        recordEthernetAttempt(false);
+        Ethernet.disconnect();
+        setState(State::CELLULAR_CLOUD_CONNECTED, TransitionReason::TIMEOUT);
+        stateTime = millis();
+        return;
+    }
+
+    // Wait some more
+}
+
+void EthernetCellular::stateCellularCheckEthernetReachability() {
+    EthernetCellularTcpCheck::Status checkStatus = reachabilityCheck.loop();
+    if (checkStatus == EthernetCellularTcpCheck::Status::BUSY) {
+        // Wait some more, the cloud connection is still on cellular
+        return;
+    }
+    reachabilityConnectTime = reachabilityCheck.getConnectTime();
+    reachabilityCheck.stop();
+
+    if (checkStatus != EthernetCellularTcpCheck::Status::SUCCEEDED) {
+        _log.info("Ethernet is up but %s:%d is not reachable, staying on cellular", reachabilityHost.c_str(), (int)reachabilityPort);
+        recordEthernetAttempt(false);
+        Ethernet.disconnect();
+        setState(State::CELLULAR_CLOUD_CONNECTED, TransitionReason::UNREACHABLE);
+        stateTime = millis();
+        return;
+    }
+
+    if (ethernetDegraded) {
+        unsigned long recoveryRtt = (unsigned long)(linkQualityRecoveryRtt.count() ? linkQualityRecoveryRtt.count() : linkQualityMaxRtt.count() / 2);
+        if (recoveryRtt != 0 && reachabilityConnectTime > recoveryRtt) {
+            _log.info("Ethernet is reachable but still slow (connect=%lu), staying on cellular", reachabilityConnectTime);
+            recordEthernetAttempt(false);
+            Ethernet.disconnect();
+            setState(State::CELLULAR_CLOUD_CONNECTED, TransitionReason::DEGRADED);
+            stateTime = millis();
+            return;
+        }
+    }
+
+    _log.info("Ethernet has Internet access, moving the cloud connection to Ethernet");
+    drainThenTryEthernet();
+}
+
+bool EthernetCellular::checkLinkQualityDegraded() {
+    if (probe.getSampleCount() < linkQualityMinSamples) {
+        // Not enough samples yet
+        return false;
+    }
+
+    unsigned long maxRtt = (unsigned long) linkQualityMaxRtt.count();
+    float maxLoss = linkQualityMaxLoss;
+    if (ethernetDegraded) {
+        // Hysteresis: must be better than the recovery thresholds to stay on Ethernet
+        maxRtt = (unsigned long)(linkQualityRecoveryRtt.count() ? linkQualityRecoveryRtt.count() : linkQualityMaxRtt.count() / 2);
+        if (linkQualityMaxLoss < 1.0) {
+            maxLoss = (linkQualityRecoveryLoss >= 0) ? linkQualityRecoveryLoss : (linkQualityMaxLoss / 2);
+        }
+    }
+
+    bool degraded = (maxRtt != 0 && probe.getRttEstimate() > maxRtt) || (maxLoss < 1.0 && probe.getLossEstimate() > maxLoss);
+    if (!degraded && ethernetDegraded) {
+        _log.info("Ethernet link quality recovered");
+        ethernetDegraded = false;
+    }
+    return degraded;
+}
+
+void EthernetCellular::checkEthernetLink() {
+    if (!ethernetLinkMonitor) {
+        return;
+    }
+    if (ethernetLinkStatus >= 0 && millis() - ethernetLinkCheckTime < (unsigned long) ethernetLinkCheckPeriod.count()) {
+        return;
+    }
+    ethernetLinkCheckTime = millis();
+
+    int linkStatus = ethernetLinkStatusFunction ? ethernetLinkStatusFunction() : readEthernetLinkStatus();
+    if (linkStatus != ethernetLinkStatus) {
+        _log.trace("Ethernet link status %d -> %d", ethernetLinkStatus, linkStatus);
+        if (ethernetLinkStatus == 0 && linkStatus == 1) {
+            ethernetLinkCameUp = true;
+            ethernetLinkCameUpTime = millis();
+        }
+        else if (linkStatus == 0) {
+            ethernetLinkCameUp = false;
+        }
+        ethernetLinkStatus = linkStatus;
+    }
+}
+
+int EthernetCellular::readEthernetLinkStatus() {
+    if_t iface = nullptr;
+    if (if_get_by_index((uint8_t)(network_interface_t) Ethernet, &iface) != 0 || !iface) {
+        return -1;
+    }
+
+    unsigned int flags = 0;
+    if (if_get_flags(iface, &flags) != 0) {
+        return -1;
+    }
+    return (flags & IFF_LOWER_UP) ? 1 : 0;
+}
+
+void EthernetCellular::startEthernetReachabilityCheck() {
+    // Passing the interface makes sure the connection goes out over Ethernet, not cellular
+    reachabilityCheck.start(reachabilityHost.c_str(), reachabilityPort, Ethernet, getDnsServer(ActiveInterface::ETHERNET), reachabilityTimeout);
+}
+
+IPAddress EthernetCellular::getDnsServer(ActiveInterface iface) {
+    if (iface == ActiveInterface::ETHERNET) {
+        IPAddress addr = Ethernet.dnsServerIP();
+        if (addr) {
+            return addr;
+        }
+    }
+    return dnsServer;
+}
 
@@ -3,488 +3,3492 @@
 
 #include "Particle.h"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <vector>
+
+#ifndef ETHERNETCELLULAR_TRANSITION_LOG_SIZE
 /**
- * This class and library is used with Gen 3 cellular devices (Boron, B Series SoM) that also have
- * Ethernet connectivity. It is used for the case that you want to default to Ethernet,
- * but fall back to cellular if the device loses its Ethernet connection.
- * 
- * This requires additional hardware such as the Ethernet FeatherWing (Boron) or the
- * B Series evaluation board or the equivalent WizNET W5500 circuitry on your own 
- * custom B Series Base Board.
- * 
- * Your data operations quota is the same for both cellular and Ethernet, but
- * extra non-cloud data (TCP or UDP) are measured for cellular but not for Ethernet.
- * Thus if you have a large amount of non-cloud data to external servers, Ethernet
- * can reduce your costs.
- * 
- * This class is necessary because Device OS will default to Ethernet, however it will
- * only fall back to cellular if Ethernet is unplugged (no link or no DHCP). The 
- * built-in behavior will not switch if the Ethernet LAN loses Internet connectivity and
- * is only providing local LAN access. By adding this class, you can make the device
- * fall back to cellular on losing Internet on the Ethernet LAN.
- * 
- * One caveat to this is that only one network interface can be active at a time. You should
- * expect that it will take a minute or two to fall back to cellular and connect (depending
- * on settings). The default is to check every 5 minutes if Ethernet has come back. The
- * caveat to this is that cloud connectivity is lost during the retry attempts, so you 
- * don't want to make the period too short, but making it very long will cause you to stay
- * on cellular longer than necessary.
- * 
- * In your main application file, include the library header:
- * 
- * ```
- * #include "EthernetCellularRK.h"
- * ```
+ * @brief Number of records in the transition log in retained memory (default: 32)
  * 
- * Optionally enable logging:
- * 
- * ```
- * SerialLogHandler LogHandler(LOG_LEVEL_TRACE);
- * ```
- * 
- * You must use system thread enabled and SEMI_AUTOMATIC mode for this library to function properly!
- * 
- * ```
- * SYSTEM_THREAD(ENABLED);
- * SYSTEM_MODE(SEMI_AUTOMATIC);
- * ```
- * 
- * This class is a singleton; you do not create one as a global, on the stack, or with new.
- * 
- * From global application setup you must call:
- * ```
- * EthernetCellular::instance().setup();
- * ```
- * 
- * From global application loop you must call:
- * ```
- * EthernetCellular::instance().loop();
- * ```
+ * Each record is 16 bytes. Define this before including the library to change it.
+ */
+#define ETHERNETCELLULAR_TRANSITION_LOG_SIZE 32
+#endif
+
+/**
+ * @brief Non-blocking DNS lookup over a specific network interface
+ *
+ * Network.resolve() blocks until the DNS server responds and always uses the default route, so
+ * it can't be used to check a specific interface or from the state machine. This sends a UDP
+ * DNS A query to a DNS server over the interface passed to start() and checks for the response
+ * each time loop() is called, until it arrives or the timeout elapses.
+ *
+ * This is used internally by EthernetCellular, EthernetCellularProbe, and EthernetCellularDnsCache.
+ */
+class EthernetCellularResolver {
+public:
+    /**
+     * @brief Result of a lookup
+     */
+    enum class Status : int {
+        IDLE = 0,       //!< start() has not been called, or stop() was called
+        BUSY,           //!< Waiting for the DNS server to respond
+        SUCCEEDED,      //!< The server responded with an address, see getAddress()
+        NO_ADDRESS,     //!< The server responded but without an address (NXDOMAIN, for example)
+        FAILED          //!< No response before the timeout, or the query could not be sent
+    };
+
+    /**
+     * @brief Starts a lookup
+     *
+     * @param host The hostname to look up. If it's a dotted-quad IP address, the lookup succeeds
+     * right away without a query. The string is copied.
+     *
+     * @param nif The interface to send the query on, for example `Ethernet`
+     *
+     * @param dnsServer The DNS server to query
+     *
+     * @param timeout How long to wait for the response
+     *
+     * @param port The UDP port of the DNS server (default: 53)
+     *
+     * Any lookup in progress is stopped first. The result is available from getStatus() right
+     * away if it's not BUSY.
+     */
+    void start(const char *host, network_interface_t nif, IPAddress dnsServer, std::chrono::milliseconds timeout, uint16_t port = 53);
+
+    /**
+     * @brief Stops the lookup in progress, if any, and releases the UDP socket
+     */
+    void stop();
+
+    /**
+     * @brief Call while BUSY to check for the response. Does not block.
+     *
+     * @return The current status
+     */
+    Status loop();
+
+    /**
+     * @brief Returns the current status
+     */
+    Status getStatus() const { return status; };
+
+    /**
+     * @brief Returns the number of milliseconds until loop() needs to be called again
+     *
+     * @param pollPeriod How often to check for the response while BUSY
+     *
+     * While BUSY, this is the poll period or the time left until the timeout, whichever is less,
+     * because the response can only be detected by polling. Otherwise it's ULONG_MAX.
+     */
+    unsigned long getNextDeadline(unsigned long pollPeriod) const;
+
+    /**
+     * @brief Returns the address if the status is SUCCEEDED
+     */
+    IPAddress getAddress() const { return address; };
+
+    /**
+     * @brief Parses a dotted-quad IP address
+     *
+     * @param str The string to parse, such as "8.8.8.8"
+     *
+     * @param addr Filled in with the address on success
+     *
+     * @return true if str is a dotted-quad IP address, false if it's something else, like a hostname
+     */
+    static bool parseAddress(const char *str, IPAddress &addr);
+
+protected:
+    /**
+     * @brief Builds a DNS A query for host into buf
+     *
+     * @return The number of bytes in the query, or 0 if it does not fit
+     */
+    size_t buildQuery();
+
+    /**
+     * @brief Parses a response of count bytes in buf
+     *
+     * @return SUCCEEDED, NO_ADDRESS, or BUSY if it's not a response to the outstanding query
+     */
+    Status parseResponse(size_t count);
+
+    /**
+     * @brief Returns the offset just past the name at offset in buf, or 0 if it runs past count
+     */
+    size_t skipName(size_t offset, size_t count) const;
+
+    Status status = Status::IDLE;       //!< Current status
+    String host;                        //!< Hostname being looked up
+    IPAddress address;                  //!< Result if SUCCEEDED
+    uint16_t queryId = 0;               //!< DNS transaction ID of the outstanding query
+    unsigned long startTime = 0;        //!< millis() value when the query was sent
+    unsigned long timeout = 0;          //!< How long to wait for the response (milliseconds)
+
+    /**
+     * @brief UDP socket bound to the interface passed to start()
+     */
+    UDP udp;
+
+    /**
+     * @brief Query and response buffer, 512 bytes being the maximum DNS over UDP message
+     *
+     * This is a member instead of on the stack so the thread that runs the state machine does
+     * not need a larger stack.
+     */
+    uint8_t buf[512];
+};
+
+/**
+ * @brief Non-blocking TCP connection check over a specific network interface
+ *
+ * TCPClient::connect() blocks until the connection is made or fails, which can be many seconds
+ * when the far end does not answer. This resolves the host with EthernetCellularResolver (if it's
+ * a hostname) and then makes a non-blocking connection on a socket bound to the interface,
+ * checking for completion each time loop() is called. The connection is closed as soon as it's
+ * made; only whether it could be made, and how long it took, is reported.
+ *
+ * This is used internally by EthernetCellular and EthernetCellularProbe.
+ */
+class EthernetCellularTcpCheck {
+public:
+    /**
+     * @brief Result of a check
+     */
+    enum class Status : int {
+        IDLE = 0,       //!< start() has not been called, or stop() was called
+        BUSY,           //!< Resolving the host or waiting for the connection to complete
+        SUCCEEDED,      //!< The connection was made
+        FAILED          //!< The host could not be resolved, the connection was refused, or the timeout elapsed
+    };
+
+    /**
+     * @brief Starts a check
+     *
+     * @param host Hostname or dotted-quad IP address to connect to. The string is copied.
+     *
+     * @param port TCP port to connect to
+     *
+     * @param nif The interface to connect over, for example `Ethernet`
+     *
+     * @param dnsServer The DNS server to resolve host with, if it's a hostname
+     *
+     * @param timeout Maximum time for the whole check, including the DNS lookup
+     *
+     * Any check in progress is stopped first.
+     */
+    void start(const char *host, uint16_t port, network_interface_t nif, IPAddress dnsServer, std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Stops the check in progress, if any, and closes the socket
+     */
+    void stop();
+
+    /**
+     * @brief Call while BUSY to advance the check. Does not block.
+     *
+     * @return The current status
+     */
+    Status loop();
+
+    /**
+     * @brief Returns the current status
+     */
+    Status getStatus() const { return status; };
+
+    /**
+     * @brief Returns the number of milliseconds until loop() needs to be called again
+     *
+     * @param pollPeriod How often to check for the response or connection while BUSY
+     *
+     * While BUSY, this is the poll period or the time left until the timeout, whichever is less,
+     * because the DNS response and the connection can only be detected by polling. Otherwise it's ULONG_MAX.
+     */
+    unsigned long getNextDeadline(unsigned long pollPeriod) const;
+
+    /**
+     * @brief Returns the time from start() until the connection was made, in milliseconds
+     *
+     * This includes the DNS lookup if the host is a hostname. Only valid if the status is SUCCEEDED.
+     */
+    unsigned long getConnectTime() const { return connectTime; };
+
+protected:
+    /**
+     * @brief Opens a non-blocking socket bound to nif and starts connecting to addr
+     *
+     * @return true if the connection is in progress (or already made), false on error
+     */
+    bool startConnect(IPAddress addr);
+
+    /**
+     * @brief Sets the final status and closes the socket
+     */
+    void complete(Status result);
+
+    Status status = Status::IDLE;       //!< Current status
+    uint16_t port = 0;                  //!< TCP port to connect to
+    network_interface_t nif = 0;        //!< Interface to connect over
+    int sock = -1;                      //!< Socket, or -1 if not open
+    unsigned long startTime = 0;        //!< millis() value when start() was called
+    unsigned long timeout = 0;          //!< Maximum time for the check (milliseconds)
+    unsigned long connectTime = 0;      //!< Time to connect if SUCCEEDED (milliseconds)
+
+    /**
+     * @brief Used to look up host if it's a hostname
+     */
+    EthernetCellularResolver resolver;
+};
+
+/**
+ * @brief Lightweight Internet reachability probe
  * 
- * If you want to override default settings, use methods like:
- * ```
- * EthernetCellular::instance().withRetryEthernetPeriod(10min);
- * ```
+ * This is used by EthernetCellular to detect the loss of Internet access on the Ethernet LAN
+ * faster than waiting for the cloud connection to time out. You normally configure it using
+ * the withProbe methods in EthernetCellular instead of using this class directly.
  * 
- * By default, the code replaces cyan blinking or breathing of the RGB status LED to yellow 
- * when on cellular backup. To not do this and keep the cyan color always, use:
- * ```
- * EthernetCellular::instance().withCellularBackupColor(RGB_COLOR_CYAN);
- * ```
+ * Each probe is either a UDP DNS query sent to a DNS server or a TCP connection to a host. 
+ * Probes are sent to each configured host in turn, one every probe interval. Any
+ * successful probe resets the consecutive failure count.
  * 
+ * Probes do not block. Hostnames are resolved with a DNS query over the probe interface,
+ * not Network.resolve(), so a working cellular connection can't make Ethernet look reachable.
  */
-class EthernetCellular {
+class EthernetCellularProbe {
 public:
-    enum class ActiveInterface : int {
-        NONE = 0,
-        ETHERNET,
-        CELLULAR
+    /**
+     * @brief The kind of probe to send to a host
+     */
+    enum class ProbeType : int {
+        DNS = 0,        //!< UDP DNS query, host is a DNS server, port is normally 53
+        TCP             //!< TCP connection, closed as soon as it is made
+    };
+
+    /**
+     * @brief One host to send probes to
+     */
+    struct ProbeHost {
+        String host;     //!< Hostname or dotted-quad IP address
+        uint16_t port;   //!< UDP or TCP port
+        ProbeType type;  //!< Kind of probe
+    };
+
+    /**
+     * @brief Adds a host to probe
+     * 
+     * @param host Hostname or dotted-quad IP address. The string is copied.
+     * 
+     * @param port UDP or TCP port number
+     * 
+     * @param type ProbeType::DNS or ProbeType::TCP
+     */
+    EthernetCellularProbe &withHost(const char *host, uint16_t port, ProbeType type);
+
+    /**
+     * @brief Sets the time between probes (default: 10 seconds)
+     */
+    EthernetCellularProbe &withInterval(std::chrono::milliseconds value) { interval = value; return *this; };
+
+    /**
+     * @brief Sets how long to wait for a DNS response or TCP connection (default: 3 seconds)
+     */
+    EthernetCellularProbe &withTimeout(std::chrono::milliseconds value) { timeout = value; return *this; };
+
+    /**
+     * @brief Sets the name to look up in DNS probes (default: particle.io)
+     * 
+     * @param value The hostname to query. The string is copied.
+     */
+    EthernetCellularProbe &withDnsQueryName(const char *value) { dnsQueryName = value; return *this; };
+
+    /**
+     * @brief Sets the weight of each new probe in the RTT and loss estimates (default: 0.25)
+     * 
+     * @param value 0 - 1. Larger values follow changes faster, smaller values are smoother.
+     */
+    EthernetCellularProbe &withEwmaWeight(float value) { ewmaWeight = value; return *this; };
+
+    /**
+     * @brief Returns true if there is at least one host configured
+     */
+    bool hasHosts() const { return !hosts.empty(); };
+
+    /**
+     * @brief Start probing over the specified network interface
+     * 
+     * @param nif The interface to send probes on, for example `Ethernet`
+     * 
+     * @param dnsServer DNS server on that interface, used to resolve probe hosts that are hostnames
+     * 
+     * Resets the consecutive failure count. The first probe is sent after one interval.
+     */
+    void start(network_interface_t nif, IPAddress dnsServer);
+
+    /**
+     * @brief Stops probing and releases the socket of a probe in progress
+     */
+    void stop();
+
+    /**
+     * @brief Call periodically while probing is started to send probes and check for responses
+     */
+    void loop();
+
+    /**
+     * @brief Returns the number of probes in a row that have failed
+     */
+    int getConsecutiveFailures() const { return consecutiveFailures; };
+
+    /**
+     * @brief Returns the round-trip time of the last successful probe in milliseconds
+     */
+    unsigned long getLastRtt() const { return lastRtt; };
+
+    /**
+     * @brief Returns the smoothed round-trip time of successful probes in milliseconds
+     * 
+     * This is an exponentially weighted moving average. For TCP probes, it's the time to connect,
+     * which includes the DNS lookup if the host is a name.
+     */
+    unsigned long getRttEstimate() const { return (unsigned long) rttEstimate; };
+
+    /**
+     * @brief Returns the smoothed fraction of probes that failed, 0.0 - 1.0
+     */
+    float getLossEstimate() const { return lossEstimate; };
+
+    /**
+     * @brief Returns the number of probes completed since start(), successful or not
+     */
+    int getSampleCount() const { return sampleCount; };
+
+    /**
+     * @brief Returns the number of milliseconds until loop() needs to be called again
+     * 
+     * @param pollPeriod How often to check for the response or connection while a probe is in progress
+     * 
+     * While a probe is in progress, this is the poll period or the time left until the probe 
+     * timeout, whichever is less, because the response or connection is detected by polling. 
+     * The measured round-trip time can be up to one poll period long. Returns ULONG_MAX if not started.
+     */
+    unsigned long getNextDeadline(unsigned long pollPeriod) const;
+
+protected:
+    /**
+     * @brief Starts a probe to hosts[hostIndex]
+     */
+    void sendProbe();
+
+    /**
+     * @brief Checks the probe in progress and calls probeComplete() when the result is known
+     */
+    void checkProbe();
+
+    /**
+     * @brief Called when a probe result is known
+     * 
+     * @param success true if the host responded
+     */
+    void probeComplete(bool success);
+
+    /**
+     * @brief Hosts to send probes to, in round-robin order
+     */
+    std::vector<ProbeHost> hosts;
+
+    /**
+     * @brief Time between probes
+     */
+    std::chrono::milliseconds interval = 10s;
+
+    /**
+     * @brief Time to wait for a DNS response or TCP connection before counting the probe as failed
+     */
+    std::chrono::milliseconds timeout = 3s;
+
+    /**
+     * @brief Hostname to look up for DNS probes
+     */
+    String dnsQueryName = "particle.io";
+
+    /**
+     * @brief Interface that probes are sent on
+     */
+    network_interface_t nif = 0;
+
+    /**
+     * @brief DNS server used to resolve probe hosts that are hostnames
+     */
+    IPAddress dnsServer;
+
+    /**
+     * @brief true between start() and stop()
+     */
+    bool started = false;
+
+    /**
+     * @brief true when a probe has been started and we're waiting for the result
+     */
+    bool waitingForResponse = false;
+
+    /**
+     * @brief true while resolving the hostname of a DNS probe server, before the probe query itself
+     */
+    bool resolvingServer = false;
+
+    /**
+     * @brief Index into hosts of the next (or current) host to probe
+     */
+    size_t hostIndex = 0;
+
+    /**
+     * @brief millis() value when the last probe was sent, or the last probe ended while waiting for the next
+     */
+    unsigned long probeTime = 0;
+
+    /**
+     * @brief Number of probes in a row that have failed
+     */
+    int consecutiveFailures = 0;
+
+    /**
+     * @brief Round-trip time of the last successful probe in milliseconds
+     */
+    unsigned long lastRtt = 0;
+
+    /**
+     * @brief Weight of each new probe in rttEstimate and lossEstimate
+     */
+    float ewmaWeight = 0.25;
+
+    /**
+     * @brief Smoothed round-trip time in milliseconds
+     */
+    float rttEstimate = 0;
+
+    /**
+     * @brief Smoothed fraction of failed probes
+     */
+    float lossEstimate = 0;
+
+    /**
+     * @brief Number of probes completed since start()
+     */
+    int sampleCount = 0;
+
+    /**
+     * @brief Used for DNS probes, and to resolve DNS probe servers that are hostnames
+     */
+    EthernetCellularResolver resolver;
+
+    /**
+     * @brief Used for TCP probes
+     */
+    EthernetCellularTcpCheck tcpCheck;
+};
+
+/**
+ * @brief Policy for how often to retry Ethernet while on cellular backup
+ * 
+ * The period between retries starts at retryEthernetPeriod and is multiplied by the backoff
+ * multiplier after each retry that does not result in a stable Ethernet connection, up to the
+ * maximum period. Once Ethernet has stayed cloud connected for the stable time, the retry count
+ * is reset and the period goes back to retryEthernetPeriod.
+ * 
+ * The defaults (multiplier 1, stable time 0) retry at a fixed retryEthernetPeriod.
+ */
+class EthernetCellularRetryPolicy {
+public:
+    /**
+     * @brief Sets the multiplier applied to the retry period after each failed retry (default: 1, no backoff)
+     * 
+     * @param value Multiplier, such as 2 to double the period after each failed retry. Must be 1 or larger.
+     */
+    EthernetCellularRetryPolicy &withBackoffMultiplier(float value) { backoffMultiplier = value; return *this; };
+
+    /**
+     * @brief Returns the backoff multiplier
+     */
+    float getBackoffMultiplier() const { return backoffMultiplier; };
+
+    /**
+     * @brief Sets the maximum retry period when backing off (default: 1 hour)
+     * 
+     * @param value The value as a chrono-literal, such as 1h for 1 hour.
+     */
+    EthernetCellularRetryPolicy &withMaxPeriod(std::chrono::milliseconds value) { maxPeriod = value; return *this; };
+
+    /**
+     * @brief Returns the maximum retry period (in milliseconds)
+     */
+    int getMaxPeriod() const { return (int)maxPeriod.count(); };
+
+    /**
+     * @brief Sets how long Ethernet must stay cloud connected before the retry count is reset (default: 0)
+     * 
+     * @param value The value as a chrono-literal, such as 2min for 2 minutes.
+     * 
+     * This prevents an Ethernet connection that keeps dropping shortly after connecting from resetting
+     * the backoff. 
+     */
+    EthernetCellularRetryPolicy &withStableTime(std::chrono::milliseconds value) { stableTime = value; return *this; };
+
+    /**
+     * @brief Returns how long Ethernet must stay cloud connected before the retry count is reset (in milliseconds)
+     */
+    int getStableTime() const { return (int)stableTime.count(); };
+
+    /**
+     * @brief Returns the period to wait before the next retry
+     * 
+     * @param basePeriod The retryEthernetPeriod, used for the first retry
+     */
+    std::chrono::milliseconds getPeriod(std::chrono::milliseconds basePeriod) const;
+
+    /**
+     * @brief Returns the number of retries since Ethernet was last stable
+     */
+    int getRetryCount() const { return retryCount; };
+
+    /**
+     * @brief Sets the number of retries since Ethernet was last stable
+     * 
+     * This is normally only used when restoring saved state.
+     */
+    void setRetryCount(int value) { retryCount = value; };
+
+    /**
+     * @brief Called when starting a retry of Ethernet
+     */
+    void retryStarted() { retryCount++; };
+
+    /**
+     * @brief Called when Ethernet has been stable for stableTime; resets the backoff
+     */
+    void reset() { retryCount = 0; };
+
+protected:
+    /**
+     * @brief Multiplier applied to the retry period after each failed retry
+     */
+    float backoffMultiplier = 1.0;
+
+    /**
+     * @brief Maximum retry period when backing off
+     */
+    std::chrono::milliseconds maxPeriod = 1h;
+
+    /**
+     * @brief How long Ethernet must stay cloud connected before retryCount is reset
+     */
+    std::chrono::milliseconds stableTime = 0ms;
+
+    /**
+     * @brief Number of retries since Ethernet was last stable
+     */
+    int retryCount = 0;
+};
+
+/**
+ * @brief Learns the longest keep-alive that the NAT on an interface tolerates
+ * 
+ * The keep-alive must be shorter than the time the NAT (carrier or LAN router) keeps an idle UDP
+ * port mapping open, otherwise the cloud connection is silently lost and must be reconnected,
+ * which costs data and time. A shorter keep-alive than necessary wastes data and power.
+ * 
+ * When learning is enabled (the maximum keep-alive is larger than the configured keep-alive), the
+ * keep-alive starts at the configured value. After the cloud has stayed connected for the confirm 
+ * count of keep-alive periods, that value is considered safe and the next longer value is tried. 
+ * If the cloud connection is lost while the interface is still up, that may be a NAT timeout, but
+ * a single loss can also be a tower handover or a router restart, so the same value is tried again.
+ * Once the ceiling loss count of losses happen without the cloud staying connected for the confirm
+ * count of periods in between, the value becomes the ceiling and the keep-alive goes back to the 
+ * last safe value. If a safe value later fails that way, it's reduced by one step.
+ * 
+ * The defaults (maximum keep-alive 0) disable learning, and the configured keep-alive is used.
+ */
+class EthernetCellularKeepAliveLearner {
+public:
+    /**
+     * @brief Sets the longest keep-alive to try (default: 0, learning disabled)
+     * 
+     * @param value The value as a chrono-literal, such as 30min for 30 minutes.
+     */
+    EthernetCellularKeepAliveLearner &withMaxKeepAlive(std::chrono::seconds value) { maxKeepAlive = value; return *this; };
+
+    /**
+     * @brief Sets how much longer each tried keep-alive is than the last safe one (default: 30 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 1min for 1 minute.
+     */
+    EthernetCellularKeepAliveLearner &withStep(std::chrono::seconds value) { step = value; return *this; };
+
+    /**
+     * @brief Sets how many keep-alive periods the cloud must stay connected to consider a value safe (default: 3)
+     */
+    EthernetCellularKeepAliveLearner &withConfirmCount(int value) { confirmCount = value; return *this; };
+
+    /**
+     * @brief Sets how many cloud connection losses at a value make it fail (default: 2)
+     * 
+     * The count is reset when the cloud stays connected for the confirm count of keep-alive periods.
+     * It's not saved in the persistent data.
+     */
+    EthernetCellularKeepAliveLearner &withCeilingLossCount(int value) { ceilingLossCount = value; return *this; };
+
+    /**
+     * @brief Returns true if learning is enabled
+     * 
+     * @param base The configured keep-alive for the interface
+     */
+    bool isEnabled(std::chrono::seconds base) const { return maxKeepAlive > base; };
+
+    /**
+     * @brief Returns the keep-alive to use now
+     * 
+     * @param base The configured keep-alive for the interface, used as the starting value
+     */
+    std::chrono::seconds getKeepAlive(std::chrono::seconds base) const;
+
+    /**
+     * @brief Returns the longest keep-alive known to be safe, in seconds, or 0 if none yet
+     */
+    int getSafeKeepAlive() const { return safe; };
+
+    /**
+     * @brief Returns the shortest keep-alive known to fail, in seconds, or 0 if none yet
+     */
+    int getCeiling() const { return ceiling; };
+
+    /**
+     * @brief Returns true if there are no longer values left to try
+     * 
+     * @param base The configured keep-alive for the interface
+     */
+    bool isConverged(std::chrono::seconds base) const;
+
+    /**
+     * @brief Sets the learned values, normally when restoring saved state
+     */
+    void restore(int safe, int ceiling) { this->safe = safe; this->ceiling = ceiling; lossCount = 0; };
+
+    /**
+     * @brief Called when the cloud connects over the interface
+     */
+    void cloudConnected() { connectedTime = millis(); };
+
+    /**
+     * @brief Called periodically while cloud connected over the interface
+     * 
+     * @param base The configured keep-alive for the interface
+     * 
+     * @return true if the keep-alive changed and should be applied with Particle.keepAlive()
+     */
+    bool loop(std::chrono::seconds base);
+
+    /**
+     * @brief Called when the cloud connection over the interface is lost
+     * 
+     * @param base The configured keep-alive for the interface
+     * 
+     * @param interfaceUp true if the interface itself is still up, which suggests a NAT timeout
+     */
+    void cloudDisconnected(std::chrono::seconds base, bool interfaceUp);
+
+protected:
+    /**
+     * @brief Longest keep-alive to try, or 0 to disable learning
+     */
+    std::chrono::seconds maxKeepAlive = 0s;
+
+    /**
+     * @brief Increase in keep-alive for each value tried
+     */
+    std::chrono::seconds step = 30s;
+
+    /**
+     * @brief Number of keep-alive periods to stay connected to consider a value safe
+     */
+    int confirmCount = 3;
+
+    /**
+     * @brief Number of cloud connection losses at a value that make it fail
+     */
+    int ceilingLossCount = 2;
+
+    /**
+     * @brief Number of cloud connection losses at the current value since it last stayed connected
+     */
+    int lossCount = 0;
+
+    /**
+     * @brief Longest keep-alive known to be safe in seconds, or 0 if none yet
+     */
+    int safe = 0;
+
+    /**
+     * @brief Shortest keep-alive known to fail in seconds, or 0 if none yet
+     */
+    int ceiling = 0;
+
+    /**
+     * @brief millis() value when the cloud connected or the keep-alive last changed
+     */
+    unsigned long connectedTime = 0;
+};
+
+/**
+ * @brief Cache of DNS lookups for each interface, filled in after switching interfaces
+ * 
+ * After a switch, the first connection to your own servers would otherwise wait for a DNS 
+ * lookup over the new interface, which is slow on cellular. EthernetCellular resolves the 
+ * registered hosts over the active interface right after it connects, and again when entries
+ * expire, so getCachedAddress() can return an address without blocking. You normally configure 
+ * it using the withDnsCache methods in EthernetCellular instead of using this class directly.
+ * 
+ * Device OS does not return the TTL from the DNS response, so entries expire after a fixed
+ * cache TTL instead.
+ */
+class EthernetCellularDnsCache {
+public:
+    /**
+     * @brief Number of interfaces the cache keeps separate entries for (Ethernet, cellular, Wi-Fi)
+     */
+    static const size_t NUM_INTERFACES = 3;
+
+    /**
+     * @brief Adds a hostname to resolve after each interface change
+     */
+    EthernetCellularDnsCache &withHost(const char *host);
+
+    /**
+     * @brief Sets how long a resolved address is used (default: 5 minutes)
+     */
+    EthernetCellularDnsCache &withTtl(std::chrono::seconds value) { ttl = value; return *this; };
+
+    /**
+     * @brief Sets how long to wait before trying again after a lookup fails (default: 30 seconds)
+     */
+    EthernetCellularDnsCache &withRetryDelay(std::chrono::seconds value) { retryDelay = value; return *this; };
+
+    /**
+     * @brief Sets how long to wait for the DNS server to respond to a lookup (default: 5 seconds)
+     */
+    EthernetCellularDnsCache &withLookupTimeout(std::chrono::milliseconds value) { lookupTimeout = value; return *this; };
+
+    /**
+     * @brief Returns true if at least one host has been added
+     */
+    bool hasHosts() const { return !entries.empty(); };
+
+    /**
+     * @brief Returns the cached address for a host, or an empty IPAddress if not cached or expired
+     * 
+     * @param host The hostname, which must have been added with withHost()
+     * 
+     * @param slot 0 = Ethernet, 1 = cellular, 2 = Wi-Fi
+     * 
+     * This does not block and can be called from any thread.
+     */
+    IPAddress lookup(const char *host, size_t slot) const;
+
+    /**
+     * @brief Resolves the hosts that are not cached or have expired for an interface
+     * 
+     * @param slot 0 = Ethernet, 1 = cellular, 2 = Wi-Fi
+     * 
+     * @param nif The interface to resolve over
+     * 
+     * @param dnsServer The DNS server to query over that interface
+     * 
+     * This does not block. One lookup is in progress at a time; each call checks for its response,
+     * and once it has completed or timed out, starts the next one. A lookup in progress for a 
+     * different slot is abandoned, as the active interface has changed.
+     */
+    void loop(size_t slot, network_interface_t nif, IPAddress dnsServer);
+
+    /**
+     * @brief Returns the number of milliseconds until loop() has a host to resolve for an interface
+     * 
+     * @param slot 0 = Ethernet, 1 = cellular, 2 = Wi-Fi
+     * 
+     * @param pollPeriod How often to check for the response while a lookup is in progress
+     * 
+     * While a lookup is in progress, this is the poll period or the time left until the lookup
+     * timeout, whichever is less, because the response is detected by polling.
+     */
+    unsigned long getNextDeadline(size_t slot, unsigned long pollPeriod) const;
+
+    /**
+     * @brief Discards all cached addresses
+     */
+    void clear();
+
+protected:
+    /**
+     * @brief A host and its cached address on each interface
+     */
+    struct Entry {
+        String host;                                    //!< Hostname to resolve
+        IPAddress address[NUM_INTERFACES];              //!< Resolved address, empty if not resolved or failed
+        unsigned long resolvedTime[NUM_INTERFACES];     //!< millis() value of the last lookup
+        bool tried[NUM_INTERFACES];                     //!< true if resolvedTime is valid
+    };
+
+    /**
+     * @brief Returns the number of milliseconds until entry needs to be resolved on slot, 0 if now
+     */
+    unsigned long getEntryDeadline(const Entry &entry, size_t slot, unsigned long now) const;
+
+    /**
+     * @brief Registered hosts
+     */
+    std::vector<Entry> entries;
+
+    std::chrono::seconds ttl = 5min;        //!< How long a resolved address is used
+    std::chrono::seconds retryDelay = 30s;  //!< Wait after a failed lookup
+    std::chrono::milliseconds lookupTimeout = 5s;   //!< Wait for the DNS server to respond
+
+    /**
+     * @brief Lookup in progress, for entries[resolvingIndex] on resolvingSlot
+     */
+    EthernetCellularResolver resolver;
+
+    size_t resolvingIndex = 0;              //!< Index into entries of the lookup in progress
+    size_t resolvingSlot = 0;               //!< Slot of the lookup in progress
+
+    /**
+     * @brief Mutex for the cached addresses, so lookup() doesn't wait for a lookup in progress
+     */
+    mutable RecursiveMutex mutex;
+};
+
+/**
+ * This class and library is used with Gen 3 cellular devices (Boron, B Series SoM) that also have
+ * Ethernet connectivity. It is used for the case that you want to default to Ethernet,
+ * but fall back to cellular if the device loses its Ethernet connection.
+ * 
+ * This requires additional hardware such as the Ethernet FeatherWing (Boron) or the
+ * B Series evaluation board or the equivalent WizNET W5500 circuitry on your own 
+ * custom B Series Base Board.
+ * 
+ * Your data operations quota is the same for both cellular and Ethernet, but
+ * extra non-cloud data (TCP or UDP) are measured for cellular but not for Ethernet.
+ * Thus if you have a large amount of non-cloud data to external servers, Ethernet
+ * can reduce your costs.
+ * 
+ * This class is necessary because Device OS will default to Ethernet, however it will
+ * only fall back to cellular if Ethernet is unplugged (no link or no DHCP). The 
+ * built-in behavior will not switch if the Ethernet LAN loses Internet connectivity and
+ * is only providing local LAN access. By adding this class, you can make the device
+ * fall back to cellular on losing Internet on the Ethernet LAN.
+ * 
+ * One caveat to this is that only one network interface can be active at a time. You should
+ * expect that it will take a minute or two to fall back to cellular and connect (depending
+ * on settings). The default is to check every 5 minutes if Ethernet has come back. The
+ * caveat to this is that cloud connectivity is lost during the retry attempts, so you 
+ * don't want to make the period too short, but making it very long will cause you to stay
+ * on cellular longer than necessary.
+ * 
+ * On versions of Device OS that allow more than one network interface to be up at the same
+ * time you can enable make-before-break mode using `withMakeBeforeBreak()`. In this mode, 
+ * the retry brings up Ethernet while the cloud connection stays on cellular, and only moves
+ * the cloud connection once Ethernet has a DHCP address and can reach the Internet.
+ * 
+ * In your main application file, include the library header:
+ * 
+ * ```
+ * #include "EthernetCellularRK.h"
+ * ```
+ * 
+ * Optionally enable logging:
+ * 
+ * ```
+ * SerialLogHandler LogHandler(LOG_LEVEL_TRACE);
+ * ```
+ * 
+ * You must use system thread enabled and SEMI_AUTOMATIC mode for this library to function properly!
+ * 
+ * ```
+ * SYSTEM_THREAD(ENABLED);
+ * SYSTEM_MODE(SEMI_AUTOMATIC);
+ * ```
+ * 
+ * This class is a singleton; you do not create one as a global, on the stack, or with new.
+ * 
+ * From global application setup you must call:
+ * ```
+ * EthernetCellular::instance().setup();
+ * ```
+ * 
+ * From global application loop you must call:
+ * ```
+ * EthernetCellular::instance().loop();
+ * ```
+ * 
+ * If you want to override default settings, use methods like:
+ * ```
+ * EthernetCellular::instance().withRetryEthernetPeriod(10min);
+ * ```
+ * 
+ * By default, the code replaces cyan blinking or breathing of the RGB status LED to yellow 
+ * when on cellular backup. To not do this and keep the cyan color always, use:
+ * ```
+ * EthernetCellular::instance().withCellularBackupColor(RGB_COLOR_CYAN);
+ * ```
+ * 
+ */
+class EthernetCellular {
+public:
+    /**
+     * @brief Network interface the cloud is connected over
+     * 
+     * CELLULAR and WIFI are the backup interfaces. The cellular states (TRY_CELLULAR, 
+     * CELLULAR_CLOUD_CONNECTED, etc.) are used for whichever backup interface is being tried.
+     */
+    enum class ActiveInterface : int {
+        NONE = 0,
+        ETHERNET,
+        CELLULAR,
+        WIFI
+    };
+
+    /**
+     * @brief What to do with the cellular modem while on Ethernet
+     */
+    enum class CellularStandby : int {
+        NONE = 0,       //!< Disconnect cellular while on Ethernet (default)
+        POWERED,        //!< Leave cellular as it is (not disconnected), or power on the modem if it was not in use
+        CONNECTED       //!< Keep cellular connected while on Ethernet (requires multiple interfaces up at once)
+    };
+
+    /**
+     * @brief State machine state identifiers
+     * 
+     * Each value corresponds to one of the protected state methods, for example State::TRY_ETHERNET 
+     * is stateTryEthernet.
+     */
+    enum class State : int {
+        START = 0,                                      //!< stateStart
+        TRY_ETHERNET,                                   //!< stateTryEthernet
+        WAIT_ETHERNET_READY,                            //!< stateWaitEthernetReady
+        WAIT_ETHERNET_CLOUD,                            //!< stateWaitEthernetCloud
+        ETHERNET_CLOUD_CONNECTED,                       //!< stateEthernetCloudConnected
+        TRY_CELLULAR,                                   //!< stateTryCellular
+        WAIT_CELLULAR_READY,                            //!< stateWaitCellularReady
+        WAIT_CELLULAR_CLOUD,                            //!< stateWaitCellularCloud
+        CELLULAR_CLOUD_CONNECTED,                       //!< stateCellularCloudConnected
+        CELLULAR_WAIT_DISCONNECTED_THEN_TRY_ETHERNET,   //!< stateCellularWaitDisconnectedThenTryEthernet
+        CELLULAR_TRY_ETHERNET_IN_BACKGROUND,            //!< stateCellularTryEthernetInBackground
+        CELLULAR_WAIT_ETHERNET_READY_IN_BACKGROUND,     //!< stateCellularWaitEthernetReadyInBackground
+        CELLULAR_CHECK_ETHERNET_REACHABILITY,           //!< stateCellularCheckEthernetReachability
+        CELLULAR_DRAIN_THEN_TRY_ETHERNET,               //!< stateCellularDrainThenTryEthernet
+        ETHERNET_DRAIN_THEN_TRY_CELLULAR,               //!< stateEthernetDrainThenTryCellular
+        COUNT                                           //!< Number of states, not a real state
+    };
+
+    /**
+     * @brief Where to keep information that is preserved across reboots
+     */
+    enum class PersistentStorage : int {
+        NONE = 0,       //!< Do not save anything across reboots (default)
+        RETAINED,       //!< Retained memory; preserved across reset, OTA, and watchdog, but not power loss
+        EEPROM          //!< Emulated EEPROM; preserved across power loss
+    };
+
+    /**
+     * @brief Statistics for a single state
+     */
+    struct StateStats {
+        uint32_t entryCount;        //!< Number of times the state was entered
+        uint64_t totalTime;         //!< Total time spent in the state (milliseconds)
+        uint32_t maxTime;           //!< Longest single time spent in the state (milliseconds)
+    };
+
+    /**
+     * @brief A set of timeouts that can be swapped at runtime with applyTimeoutProfile()
+     * 
+     * The defaults are the same as the library defaults. Start with getTimeoutProfile() to 
+     * change only some of the values from the current settings.
+     */
+    struct TimeoutProfile {
+        std::chrono::milliseconds ethernetConnectTimeout = 30s;         //!< See withEthernetConnectTimeout()
+        std::chrono::milliseconds ethernetCloudConnectTimeout = 30s;    //!< See withEthernetCloudConnectTimeout()
+        std::chrono::milliseconds cellularConnectTimeout = 5min;        //!< See withCellularConnectTimeout()
+        std::chrono::milliseconds cellularCloudConnectTimeout = 2min;   //!< See withCellularCloudConnectTimeout()
+        std::chrono::milliseconds wifiConnectTimeout = 1min;            //!< See withWiFiConnectTimeout()
+        std::chrono::milliseconds wifiCloudConnectTimeout = 1min;       //!< See withWiFiCloudConnectTimeout()
+        std::chrono::milliseconds retryEthernetPeriod = 5min;           //!< See withRetryEthernetPeriod()
+        std::chrono::milliseconds drainTimeout = 10s;                   //!< See withDrainTimeout()
+    };
+
+    /**
+     * @brief Why a state transition in the transition log happened
+     */
+    enum class TransitionReason : uint8_t {
+        NONE = 0,           //!< Normal progress through the connection states
+        CONNECTED,          //!< Cloud connected
+        TIMEOUT,            //!< A connect or cloud connect timeout was reached
+        CLOUD_LOST,         //!< The cloud connection was lost
+        LINK_DOWN,          //!< The Ethernet link went down
+        PROBE_FAILED,       //!< Reachability probes failed on Ethernet
+        DEGRADED,           //!< Ethernet round-trip time or loss was over the threshold
+        RETRY,              //!< Retrying Ethernet or a higher priority backup
+        UNREACHABLE,        //!< Ethernet was up but the reachability host could not be reached
+        RESUME              //!< Resuming after sleep
+    };
+
+    /**
+     * @brief Compact record of a state transition, kept in the transition log in retained memory
+     * 
+     * This is also the binary format uploaded by EthernetCellularTransitionUploader (little endian).
+     */
+    struct TransitionRecord {
+        uint32_t timestamp;         //!< Time.now() when the transition occurred, or 0 if the time was not valid
+        uint32_t timeInState;       //!< Time spent in fromState (milliseconds)
+        uint8_t fromState;          //!< State before the transition
+        uint8_t toState;            //!< State after the transition
+        uint8_t reason;             //!< TransitionReason
+        int8_t signal;              //!< Cellular signal strength 0 - 100 if cellular is ready, otherwise -1
+        uint16_t rtt;               //!< Smoothed Ethernet probe round-trip time (milliseconds), 0 if not available
+        uint16_t reserved;          //!< Padding
+    };
+
+    /**
+     * @brief Record of a single state transition
+     */
+    struct Transition {
+        uint32_t timestamp;         //!< millis() value when the transition occurred
+        State fromState;            //!< State before the transition
+        State toState;              //!< State after the transition
+    };
+
+    /**
+     * @brief Statistics for connecting to the cloud over one interface
+     * 
+     * Time to cloud is measured from stateTryEthernet or stateTryCellular until cloud connected.
+     */
+    struct InterfaceStats {
+        uint32_t connectCount;      //!< Number of times the cloud connected over this interface
+        uint32_t lastTimeToCloud;   //!< Most recent time to cloud connected (milliseconds)
+        uint32_t maxTimeToCloud;    //!< Longest time to cloud connected (milliseconds)
+        uint64_t totalTimeToCloud;  //!< Total of all times to cloud connected (milliseconds), divide by connectCount for the average
+    };
+
+    /**
+     * @brief Application traffic counters for one interface
+     * 
+     * These are only updated by EthernetCellularTCPClient and EthernetCellularUDP, or by calling
+     * countTraffic(). Cloud traffic is not included.
+     */
+    struct TrafficStats {
+        uint64_t txBytes;           //!< Bytes sent
+        uint64_t rxBytes;           //!< Bytes received
+        uint32_t txPackets;         //!< UDP packets sent, or TCP write calls
+        uint32_t rxPackets;         //!< UDP packets received, or TCP read calls that returned data
+    };
+
+    /**
+     * @brief Breakdown of the time to connect to the cloud over Ethernet
+     * 
+     * Link up time is from stateTryEthernet until the Ethernet link is up. Address time is from 
+     * link up until Ethernet is ready, which is mostly DHCP. Cloud time is from Ethernet ready 
+     * until cloud connected. If the link status can't be read, the link up time is 0 and the 
+     * address time includes the link up time.
+     */
+    struct EthernetTimingStats {
+        uint32_t count;             //!< Number of cloud connections over Ethernet included in the totals
+        uint32_t lastLinkUpTime;    //!< Most recent link up time (milliseconds)
+        uint32_t lastAddressTime;   //!< Most recent address acquisition time (milliseconds)
+        uint32_t lastCloudTime;     //!< Most recent time from Ethernet ready to cloud connected (milliseconds)
+        uint64_t totalLinkUpTime;   //!< Total link up time (milliseconds), divide by count for the average
+        uint64_t totalAddressTime;  //!< Total address acquisition time (milliseconds), divide by count for the average
+        uint64_t totalCloudTime;    //!< Total time from ready to cloud connected (milliseconds), divide by count for the average
+    };
+
+    /**
+     * @brief Breakdown of the time to connect to the cloud over cellular, and the network used
+     * 
+     * Ready time is from stateTryCellular until cellular is ready, which includes registering 
+     * with the tower and attaching to the packet data network. Cloud time is from cellular ready
+     * until cloud connected. Attempts where cellular was already connected in standby are not
+     * included.
+     */
+    struct CellularTimingStats {
+        uint32_t count;             //!< Number of cloud connections over cellular included in the totals
+        uint32_t lastReadyTime;     //!< Most recent time to cellular ready (milliseconds)
+        uint32_t lastCloudTime;     //!< Most recent time from cellular ready to cloud connected (milliseconds)
+        uint64_t totalReadyTime;    //!< Total time to cellular ready (milliseconds), divide by count for the average
+        uint64_t totalCloudTime;    //!< Total time from ready to cloud connected (milliseconds), divide by count for the average
+        uint32_t modemResetCount;   //!< Number of times the adaptive cellular connect timeout turned the modem off and on again
+        uint16_t mcc;               //!< Mobile country code of the most recent connection
+        uint16_t mnc;               //!< Mobile network code of the most recent connection
+        int accessTechnology;       //!< Radio access technology of the most recent connection, such as NET_ACCESS_TECHNOLOGY_LTE_CAT_M1
+    };
+
+    /**
+     * @brief Failover and state machine statistics, returned by getStats()
+     */
+    struct Stats {
+        /**
+         * @brief Number of transitions kept in transitions
+         */
+        static const size_t TRANSITION_HISTORY_SIZE = 16;
+
+        StateStats states[(size_t)State::COUNT];            //!< Per-state statistics, indexed by State
+        Transition transitions[TRANSITION_HISTORY_SIZE];    //!< Most recent transitions, circular buffer
+        uint32_t transitionCount;                           //!< Total number of transitions. The most recent is transitions[(transitionCount - 1) % TRANSITION_HISTORY_SIZE]
+        InterfaceStats ethernet;                            //!< Time to cloud over Ethernet
+        InterfaceStats cellular;                            //!< Time to cloud over cellular
+        uint32_t cloudDownCount;                            //!< Number of times the cloud connection was lost
+        uint64_t cloudDownTime;                             //!< Total time not connected to the cloud (milliseconds)
+        uint64_t elapsedTime;                               //!< Time since the statistics were reset (milliseconds)
+        uint32_t switchoverCount;                           //!< Number of times the cloud connection moved to the other interface
+        TrafficStats ethernetTraffic;                       //!< Application traffic over Ethernet
+        TrafficStats cellularTraffic;                       //!< Application traffic over cellular
+        InterfaceStats wifi;                                //!< Wi-Fi time to cloud connected
+        TrafficStats wifiTraffic;                           //!< Application traffic over Wi-Fi
+        EthernetTimingStats ethernetTiming;                 //!< Ethernet link up, address, and cloud connect times
+        CellularTimingStats cellularTiming;                 //!< Cellular ready and cloud connect times, and the network used
+    };
+
+    /**
+     * @brief Gets the singleton instance of this class, allocating it if necessary
+     * 
+     * Use EthernetCellular::instance() to instantiate the singleton.
+     */
+    static EthernetCellular &instance();
+
+    /**
+     * @brief Perform setup operations; call this from global application setup()
+     * 
+     * You typically use EthernetCellular::instance().setup();
+     */
+    void setup();
+
+    /**
+     * @brief Perform application loop operations; call this from global application loop()
+     * 
+     * You typically use EthernetCellular::instance().loop();
+     */
+    void loop();
+
+    /**
+     * @brief Set an Ethernet keep-alive value (default: 25 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     * 
+     * When the network is Ethernet, a keep-alive is required to keep the UDP port forwarding active so the
+     * cloud can communicate with the device. This could be as short as 30 seconds or be minutes or even
+     * hours. Since the data in Ethernet is rarely metered, this defaults to 25 seconds but can be made
+     * longer on a site-specific basis.
+     * 
+     * If the limit is too long, at the end of the period the cloud will not longer be able to communicate
+     * with the device if the connection is otherwise idle.
+     * 
+     * If you are publishing, reading variables, or calling functions, this will reset the keep-alive timer
+     * so if you are frequently sending data they keep-alive may never be reached.
+     * 
+     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
+     * like:
+     * 
+     * ```
+     * int keepAliveSec = 300;
+     * 
+     * EthernetCellular::instance().withEthernetKeepAlive(std::chrono::seconds(keepAliveSec));
+     * ```
+     */
+    EthernetCellular &withEthernetKeepAlive(std::chrono::seconds value) { ethernetKeepAlive = value; return *this; };
+
+    /**
+     * @brief Returns the Ethernet keep-alive value (in seconds)
+     */
+    int getEthernetKeepAlive() const { return (int)ethernetKeepAlive.count(); };
+
+    /**
+     * @brief Set an cellular keep-alive value (default: 23 minutes)
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     * 
+     * When the network is cellular, a keep-alive is required to keep the UDP port forwarding active so the
+     * cloud can communicate with the device. This rarely needs to be set when using the Particle SIM, 
+     * but is almost certainly required for a 3rd-party SIM. With a 3rd-party SIM the value could be as low 
+     * as 30 seconds, but could be a few minutes.
+     * 
+     * If the limit is too long, at the end of the period the cloud will not longer be able to communicate
+     * with the device if the connection is otherwise idle.
+     * 
+     * If you are publishing, reading variables, or calling functions, this will reset the keep-alive timer
+     * so if you are frequently sending data they keep-alive may never be reached.
+     * 
+     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
+     * like:
+     * 
+     * ```
+     * int keepAliveSec = 300;
+     * 
+     * EthernetCellular::instance().withEthernetKeepAlive(std::chrono::seconds(keepAliveSec));
+     * ```
+     */
+    EthernetCellular &withCellularKeepAlive(std::chrono::seconds value) { cellularKeepAlive = value; return *this; };
+
+    /**
+     * @brief Returns the cellular keep-alive value (in seconds)
+     */
+    int getCellularKeepAlive() const { return (int)cellularKeepAlive.count(); };
+
+    /**
+     * @brief Learn the longest Ethernet keep-alive the LAN router's NAT tolerates
+     * 
+     * @param value The learner settings. It's copied. See EthernetCellularKeepAliveLearner.
+     * 
+     * The Ethernet keep-alive is used as the starting value. To keep the learned value across 
+     * reboots, also use withPersistentStorage().
+     * 
+     * ```
+     * EthernetCellular::instance().withEthernetKeepAliveLearner(EthernetCellularKeepAliveLearner()
+     *     .withMaxKeepAlive(10min)
+     *     .withStep(30s));
+     * ```
+     */
+    EthernetCellular &withEthernetKeepAliveLearner(const EthernetCellularKeepAliveLearner &value) { ethernetKeepAliveLearner = value; return *this; };
+
+    /**
+     * @brief Returns the Ethernet keep-alive learner, including the learned values
+     */
+    const EthernetCellularKeepAliveLearner &getEthernetKeepAliveLearner() const { return ethernetKeepAliveLearner; };
+
+    /**
+     * @brief Learn the longest cellular keep-alive the carrier's NAT tolerates
+     * 
+     * @param value The learner settings. It's copied. See EthernetCellularKeepAliveLearner.
+     * 
+     * The cellular keep-alive is used as the starting value. To keep the learned value across 
+     * reboots, also use withPersistentStorage(). If the SIM can change, also use withKeepAliveNetworkId().
+     */
+    EthernetCellular &withCellularKeepAliveLearner(const EthernetCellularKeepAliveLearner &value) { cellularKeepAliveLearner = value; return *this; };
+
+    /**
+     * @brief Returns the cellular keep-alive learner, including the learned values
+     */
+    const EthernetCellularKeepAliveLearner &getCellularKeepAliveLearner() const { return cellularKeepAliveLearner; };
+
+    /**
+     * @brief Identifies the cellular network the learned cellular keep-alive applies to
+     * 
+     * @param id A string identifying the SIM or carrier, typically the ICCID. Only a hash is stored.
+     * 
+     * If this differs from the value saved with the learned keep-alive, the cellular keep-alive is 
+     * learned again from the start. The library doesn't read the ICCID itself because that requires
+     * modem-specific AT commands; you can get it from Cellular.command() with AT+CCID, for example.
+     */
+    EthernetCellular &withKeepAliveNetworkId(const char *id);
+
+    /**
+     * @brief Set the period to try switching back to Ethernet from cellular. Default: 5 minutes.
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     * 
+     * Because the Ethernet and cellular networks cannot be on at the same time, after switching to cellular
+     * backup we need to periodically switch back to Ethernet to see if it's back up. This will interrupt
+     * network connectivity for a short period of time, so you don't want to make it too short. However,
+     * you also won't switch back until this period is reached, so you'll stay on backup longer than 
+     * necessary if you set it too long. The default is 5 minutes.
+     * 
+     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
+     * like:
+     * 
+     * ```
+     * int retryEthernetSecs = 300;
+     * 
+     * EthernetCellular::instance().withRetryEthernetPeriod(std::chrono::milliseconds(retryEthernetSecs));
+     * ```
+     */ 
+    EthernetCellular &withRetryEthernetPeriod(std::chrono::milliseconds value) { retryEthernetPeriod = value; return *this; };
+
+    /**
+     * @brief Returns the  period to try switching back to Ethernet from cellular (in milliseconds)
+     */
+    int getRetryEthernetPeriod() const { return (int)retryEthernetPeriod.count(); };
+
+    /**
+     * @brief Sets the retry policy for backing off Ethernet retries while on cellular
+     * 
+     * @param value The policy to use. It's copied, and the retry count is taken from value.
+     * 
+     * By default, Ethernet is retried every retryEthernetPeriod. If the Ethernet uplink at a site is
+     * down for a long time, that means tearing down a working cellular connection every period. With
+     * a backoff multiplier, the period increases after each failed retry, up to a maximum. 
+     * 
+     * ```
+     * EthernetCellular::instance().withRetryPolicy(EthernetCellularRetryPolicy()
+     *     .withBackoffMultiplier(2)
+     *     .withMaxPeriod(2h)
+     *     .withStableTime(5min));
+     * ```
+     */
+    EthernetCellular &withRetryPolicy(const EthernetCellularRetryPolicy &value) { retryPolicy = value; return *this; };
+
+    /**
+     * @brief Returns the retry policy, including the current retry count
+     */
+    const EthernetCellularRetryPolicy &getRetryPolicy() const { return retryPolicy; };
+
+    /**
+     * @brief Returns the period until the next Ethernet retry, taking backoff into account (in milliseconds)
+     */
+    int getCurrentRetryEthernetPeriod() const { return (int)retryPolicy.getPeriod(retryEthernetPeriod).count(); };
+
+    /**
+     * @brief Marks the start of application activity that should not be interrupted by an Ethernet retry
+     * 
+     * While on cellular, every retry Ethernet period the cloud connection is torn down to check 
+     * whether Ethernet is back. If your application is in the middle of a large transfer or a burst
+     * of publishes, that wastes the work in progress. While a critical section is active, the retry
+     * is postponed until endCriticalSection() is called, up to the maximum critical section deferral.
+     * 
+     * Calls can be nested; the critical section ends when endCriticalSection() has been called as 
+     * many times as beginCriticalSection(). It can be called from any thread.
+     * 
+     * This does not delay switching from Ethernet to cellular when Ethernet fails, because the
+     * cloud connection is already gone then.
+     */
+    void beginCriticalSection() { criticalSectionCount++; };
+
+    /**
+     * @brief Marks the end of application activity started with beginCriticalSection()
+     * 
+     * If an Ethernet retry was postponed, it happens on the next loop.
+     */
+    void endCriticalSection();
+
+    /**
+     * @brief Returns true if beginCriticalSection() has been called more times than endCriticalSection()
+     */
+    bool isCriticalSection() const { return criticalSectionCount > 0; };
+
+    /**
+     * @brief Sets the maximum time an Ethernet retry can be postponed by a critical section (default: 5 minutes)
+     * 
+     * @param value The value as a chrono-literal, such as 5min for 5 minutes.
+     * 
+     * Once this has elapsed, the retry proceeds even if the critical section is still active, so
+     * an application that forgets to call endCriticalSection() can't keep the device on cellular forever.
+     */
+    EthernetCellular &withMaxCriticalSectionDeferral(std::chrono::milliseconds value) { maxCriticalSectionDeferral = value; return *this; };
+
+    /**
+     * @brief Sets a callback that is called before an Ethernet retry tears down the cellular cloud connection
+     * 
+     * @param callback The callback function. It's passed the time remaining until the retry. 
+     * 
+     * The callback is called once per retry, when the time remaining becomes less than the switch 
+     * pending notice time. This gives the application a chance to finish what it's doing, or to call 
+     * beginCriticalSection() to postpone the retry. It's not called if the retry period is shorter than
+     * the notice time. With make-before-break, the retry only disconnects the cloud if Ethernet turns
+     * out to be working.
+     * 
+     * The callback is called from loop(), or from the worker thread in thread mode.
+     */
+    EthernetCellular &withSwitchPendingCallback(std::function<void(std::chrono::milliseconds remaining)> callback) { switchPendingCallback = callback; return *this; };
+
+    /**
+     * @brief Sets how long before an Ethernet retry the switch pending callback is called (default: 10 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 10s for 10 seconds.
+     */
+    EthernetCellular &withSwitchPendingNotice(std::chrono::milliseconds value) { switchPendingNotice = value; return *this; };
+
+    /**
+     * @brief Marks the start of a cloud operation that should complete before a scheduled switch
+     * 
+     * Call this when starting a publish WITH_ACK, a function response, or any other cloud operation,
+     * and call endCloudOperation() when it completes (successfully or not). Calls can be nested and 
+     * it can be called from any thread.
+     * 
+     * When a retry of Ethernet would disconnect the cellular cloud connection, the library first
+     * enters a drain phase: isDraining() returns true so your code can stop starting new work, and 
+     * the disconnect waits until all cloud operations have ended, up to the drain timeout. This
+     * avoids dropping operations that are in flight and retransmitting them after the switch.
+     * 
+     * Unlike beginCriticalSection(), which can postpone a retry for minutes, this is intended for
+     * short operations.
+     */
+    void beginCloudOperation() { cloudOperationCount++; };
+
+    /**
+     * @brief Marks the end of a cloud operation started with beginCloudOperation()
+     */
+    void endCloudOperation();
+
+    /**
+     * @brief Returns true if waiting for cloud operations to end before disconnecting for a switch
+     * 
+     * Don't start new cloud operations while this is true.
+     */
+    bool isDraining() const { return state == State::CELLULAR_DRAIN_THEN_TRY_ETHERNET || state == State::ETHERNET_DRAIN_THEN_TRY_CELLULAR; };
+
+    /**
+     * @brief Sets the maximum time to wait for cloud operations to end before disconnecting (default: 10 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 10s for 10 seconds. 0s disconnects right away.
+     */
+    EthernetCellular &withDrainTimeout(std::chrono::milliseconds value) { drainTimeout = value; return *this; };
+
+    /**
+     * @brief Sets a callback that's called before the current interface is torn down
+     * 
+     * @param callback The function to call. It's passed the interface that's about to be disconnected,
+     * the interface the library plans to switch to, and the deadline, which is the time the library
+     * will wait for interfaceChangeReady() before disconnecting.
+     * 
+     * Unlike the interface change callback, which is called after the switch has been made, this
+     * is called while the current interface still works, so you can flush and close TCP connections
+     * cleanly instead of leaving them half-open on the server.
+     * 
+     * For a scheduled switch (retrying Ethernet from a backup interface, or leaving a degraded 
+     * Ethernet connection), the deadline is the before interface change timeout. The library
+     * waits in the drain phase until you call interfaceChangeReady() or the deadline is reached, along with
+     * waiting for cloud operations (see beginCloudOperation()). You can call interfaceChangeReady()
+     * from within the callback if you have nothing to flush.
+     * 
+     * When the current interface has already failed (Ethernet link down, or reachability probes
+     * failing), the callback is still called before disconnecting, but with a deadline of 0 and the
+     * library does not wait.
+     * 
+     * The callback is called from the thread running the state machine (loop(), or the worker
+     * thread in thread mode), so it should not block.
+     */
+    EthernetCellular &withBeforeInterfaceChangeCallback(std::function<void(ActiveInterface currentInterface, ActiveInterface plannedInterface, std::chrono::milliseconds deadline)> callback) { beforeInterfaceChangeCallback = callback; return *this; };
+
+    /**
+     * @brief Sets how long to wait for interfaceChangeReady() before a scheduled switch (default: 5 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 5s for 5 seconds.
+     */
+    EthernetCellular &withBeforeInterfaceChangeTimeout(std::chrono::milliseconds value) { beforeInterfaceChangeTimeout = value; return *this; };
+
+    /**
+     * @brief Call after the before interface change callback when you're ready for the interface to be disconnected
+     * 
+     * This can be called from any thread, and from within the callback itself. 
+     */
+    void interfaceChangeReady();
+
+    /**
+     * @brief Enable event-driven mode (default: false)
+     * 
+     * @param value true to enable or false to disable. If you call with no parameter, it's enabled.
+     * 
+     * Normally, every call to loop() checks the network and cloud status for the current state. In 
+     * event-driven mode, setup() registers for the network_status and cloud_status system events
+     * and loop() only runs the state machine when one of those events has occurred or when the
+     * next timeout in the current state has been reached. Otherwise loop() returns immediately.
+     * 
+     * As a safety net, the state machine is also run at least every event-driven maximum idle 
+     * period (see withEventDrivenMaxIdle()).
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withEventDriven(bool value = true) { eventDriven = value; return *this; };
+
+    /**
+     * @brief Returns true if event-driven mode is enabled
+     */
+    bool getEventDriven() const { return eventDriven; };
+
+    /**
+     * @brief Sets the maximum time between state machine checks in event-driven mode (default: 10 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 10s for 10 seconds.
+     */
+    EthernetCellular &withEventDrivenMaxIdle(std::chrono::milliseconds value) { eventDrivenMaxIdle = value; return *this; };
+
+    /**
+     * @brief Sets a callback that's called when the state machine needs to run again soon
+     * 
+     * @param callback The function to call. It takes no parameters and returns void.
+     * 
+     * This is intended for tickless or low-power application loops. Instead of calling loop() 
+     * constantly, the application can wait on a queue or semaphore (or enter a low-power mode)
+     * for up to getNextDeadline() milliseconds, and have this callback wake it up early when the
+     * Ethernet, backup interface, or cloud connection status changes, or when endCriticalSection(), 
+     * endCloudOperation(), or resumeFromSleep() need the state machine to run.
+     * 
+     * setup() registers for the network_status and cloud_status system events and calls the 
+     * callback from the handler. System event handlers run on the application thread, though, so
+     * they only run while the application thread isn't blocked, such as during delay() or between
+     * calls to loop(). To wake a blocked application loop, setup() also starts the worker thread 
+     * (even if thread mode is not enabled), which checks the status every wake poll period 
+     * (withWakePollPeriod()) and calls the callback when it changes.
+     * 
+     * The callback is called from the application thread, the worker thread, or whatever thread
+     * called the function that needs the state machine to run, so it must not block. Typically it
+     * just does os_queue_put() or os_semaphore_give().
+     * 
+     * Always bound the wait by getNextDeadline(), which is at most the event-driven maximum idle
+     * period, so timeouts and changes the status check doesn't cover are still handled.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withWakeCallback(std::function<void()> callback) { wakeCallback = callback; return *this; };
+
+    /**
+     * @brief Sets how often the worker thread checks the status for the wake callback (default: 1 second)
+     * 
+     * @param value The value as a chrono-literal, such as 1s for 1 second. 0 doesn't start the 
+     * worker thread, so status changes only wake the application loop through the system event
+     * handlers or at getNextDeadline().
+     * 
+     * Each check wakes the MCU to read the Ethernet, backup interface, and cloud connection status,
+     * so a shorter period notices changes sooner at the cost of more power. Not used in thread mode,
+     * where the worker thread runs the state machine every thread period instead.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withWakePollPeriod(std::chrono::milliseconds value) { wakePollPeriod = value; return *this; };
+
+    /**
+     * @brief Sets how often an in-progress DNS lookup or TCP check is polled (default: 100 milliseconds)
+     * 
+     * @param value The value as a chrono-literal, such as 100ms for 100 milliseconds.
+     * 
+     * DNS responses and TCP connections for probes, the reachability check, and the DNS cache can 
+     * only be detected by polling the socket, so while one is in progress getNextDeadline() (and 
+     * event-driven mode) is at most this long, instead of 0. A longer period uses less power but
+     * makes the probe round-trip times less accurate.
+     */
+    EthernetCellular &withSocketPollPeriod(std::chrono::milliseconds value) { socketPollPeriod = value; return *this; };
+
+    /**
+     * @brief Returns the number of milliseconds until loop() needs to be called again
+     * 
+     * Returns 0 if loop() should be called right away, such as when a system event has arrived, 
+     * a state is transitioning, or a timeout, retry, or probe is due. Otherwise it's the time 
+     * until the earliest of the state timeout, retry Ethernet period, probe interval, link check, 
+     * or critical section deferral, whichever applies to the current state, and at most the 
+     * event-driven maximum idle period.
+     * 
+     * This is most useful with withEventDriven() and withWakeCallback(). For example, on a solar
+     * site in CELLULAR_CLOUD_CONNECTED, this is typically the time until the next Ethernet retry,
+     * so the application loop can sleep instead of spinning:
+     * 
+     * ```
+     * EthernetCellular::instance().loop();
+     * os_semaphore_take(wakeSemaphore, EthernetCellular::instance().getNextDeadline(), false);
+     * ```
+     * 
+     * Callbacks for things like link status functions may need to be called more often; the 
+     * deadline already includes the link check period if the Ethernet link monitor is enabled.
+     */
+    unsigned long getNextDeadline() const;
+
+    /**
+     * @brief Run the state machine from its own thread instead of loop() (default: false)
+     * 
+     * @param value true to enable or false to disable. If you call with no parameter, it's enabled.
+     * 
+     * Normally the state machine is run by calling loop() from the global application loop, so if
+     * your loop blocks for a long time, failover is delayed. In thread mode, setup() starts a worker 
+     * thread that runs the state machine every thread period, and loop() does nothing, so you
+     * don't need to call it.
+     * 
+     * The interface change callback is called from the worker thread in this mode, so make sure 
+     * it's thread-safe and does not block for long. Use lock() and unlock() if you 
+     * need to access several settings or values at once from another thread.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withThread(bool value = true) { threadMode = value; return *this; };
+
+    /**
+     * @brief Returns true if thread mode is enabled
+     */
+    bool getThread() const { return threadMode; };
+
+    /**
+     * @brief Sets how often the worker thread runs the state machine (default: 50 milliseconds)
+     * 
+     * @param value The value as a chrono-literal, such as 50ms.
+     */
+    EthernetCellular &withThreadPeriod(std::chrono::milliseconds value) { threadPeriod = value; return *this; };
+
+    /**
+     * @brief Sets the worker thread stack size in bytes (default: 3072)
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withThreadStackSize(size_t value) { threadStackSize = value; return *this; };
+
+    /**
+     * @brief Deliver callbacks from loop() instead of from the state machine (default: false)
+     * 
+     * @param value true to enable or false to disable. If you call with no parameter, it's enabled.
+     * 
+     * Normally the interface change, switch pending, and before interface change callbacks are 
+     * called from inside the state handler, so a slow callback (logging to an SD card, reconnecting 
+     * MQTT) delays the next timeout check. With async callbacks, the state machine only posts an 
+     * event to a fixed-size queue, and the callbacks are called from the next call to loop(). 
+     * 
+     * In thread mode, this means the callbacks are called from the application thread instead of 
+     * the worker thread, so you must still call loop() from the global application loop.
+     * 
+     * If the queue is full, interface changes are coalesced into a single change from the 
+     * oldest interface to the newest one, and switch pending and before interface change events 
+     * are discarded. These are counted in getCallbackOverflowCount(). If you use the before 
+     * interface change callback, a discarded event means the switch waits for the before interface
+     * change timeout.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withAsyncCallbacks(bool value = true) { asyncCallbacks = value; return *this; };
+
+    /**
+     * @brief Sets the number of events in the async callback queue (default: 8)
+     * 
+     * The queue is allocated on the heap in setup(). This must be called before setup().
+     */
+    EthernetCellular &withCallbackQueueSize(size_t value) { callbackQueueSize = value; return *this; };
+
+    /**
+     * @brief Returns the number of async callback events that were coalesced or discarded because the queue was full
+     */
+    uint32_t getCallbackOverflowCount() const { return callbackOverflowCount; };
+
+    /**
+     * @brief Save the last known good interface and recent failures across reboots (default: PersistentStorage::NONE)
+     * 
+     * @param value PersistentStorage::NONE, PersistentStorage::RETAINED, or PersistentStorage::EEPROM
+     * 
+     * @param eepromOffset When using PersistentStorage::EEPROM, the offset in EEPROM to store the data. 
+     * Make sure this doesn't overlap any EEPROM data used by your application.
+     * 
+     * Normally, the device always tries Ethernet first after a reboot. At a site where the Ethernet uplink
+     * is down, this means waiting for the Ethernet timeouts before trying cellular on every reboot. 
+     * When persistent storage is enabled, the last interface that connected to the cloud, the time it took,
+     * and the results of recent Ethernet attempts are saved. If the device was on cellular backup and
+     * the most recent Ethernet attempt failed, it will start with cellular and try Ethernet again 
+     * after the retry period.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withPersistentStorage(PersistentStorage value, int eepromOffset = 0) { persistentStorage = value; this->eepromOffset = eepromOffset; return *this; };
+
+    /**
+     * @brief Returns the last interface that connected to the cloud, saved across reboots
+     * 
+     * Returns ActiveInterface::NONE if persistent storage is not enabled or nothing has been saved yet.
+     */
+    ActiveInterface getLastKnownGoodInterface() const { return (ActiveInterface) persistentData.lastInterface; };
+
+    /**
+     * @brief Declare whether Ethernet hardware is present, instead of detecting it at boot
+     * 
+     * @param value true if the hardware has an Ethernet adapter (WIZnet W5500), false if it does not
+     * 
+     * Normally, the Ethernet adapter is detected at boot by reading its MAC address over SPI. If you
+     * know which hardware SKU the firmware is running on, you can skip detection. If you declare that
+     * Ethernet is not present, FEATURE_ETHERNET_DETECTION is not enabled and only cellular is used.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withEthernetPresent(bool value) { ethernetPresentDeclared = value ? 1 : 0; return *this; };
+
+    /**
+     * @brief Cache the Ethernet adapter detection result and MAC address in persistent storage (default: false)
+     * 
+     * @param value true to enable or false to disable. If you call with no parameter, it's enabled.
+     * 
+     * This requires that persistent storage be enabled using withPersistentStorage(); PersistentStorage::EEPROM
+     * is recommended so the cache survives power loss. When the cache is valid, detection is skipped at boot. 
+     * The cache is updated if the MAC address read after Ethernet connects differs from the cached one, or if
+     * the adapter can no longer be found after an Ethernet connection timeout. Use redetectEthernet() to 
+     * force detection.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withEthernetDetectionCache(bool value = true) { ethernetDetectionCache = value; return *this; };
+
+    /**
+     * @brief Detect the Ethernet adapter now and update the detection cache
+     * 
+     * This can be used after setup() to force detection, for example after hardware service.
+     */
+    void redetectEthernet();
+
+    /**
+     * @brief Returns true if Ethernet hardware is present (detected, cached, or declared)
+     * 
+     * This is only valid after the state machine has left stateStart.
+     */
+    bool getEthernetPresent() const { return ethernetPresent; };
+
+    /**
+     * @brief Locks the state machine mutex
+     * 
+     * The state machine holds this lock while running, so you can use this to read several 
+     * values consistently from another thread. This is a recursive mutex.
+     */
+    void lock() const { mutex.lock(); };
+
+    /**
+     * @brief Attempts to lock the state machine mutex
+     * 
+     * @return true if the mutex was locked, false if not
+     */
+    bool trylock() const { return mutex.trylock(); };
+
+    /**
+     * @brief Unlocks the state machine mutex
+     */
+    void unlock() const { mutex.unlock(); };
+
+    /**
+     * @brief Enable make-before-break mode when retrying Ethernet from cellular (default: false)
+     * 
+     * @param value true to enable or false to disable. If you call with no parameter, it's enabled.
+     * 
+     * Normally, when retryEthernetPeriod is reached the cloud connection is dropped, cellular is 
+     * disconnected, and Ethernet is tried again. If Ethernet is still down, the cloud is unavailable
+     * until the Ethernet timeouts expire and cellular reconnects.
+     * 
+     * In make-before-break mode Ethernet is brought up while cellular is still carrying the cloud 
+     * connection. Only after Ethernet is ready (has a DHCP address) and a TCP connection to the 
+     * reachability host can be made over the Ethernet interface is the cloud connection moved to 
+     * Ethernet. If the check fails, Ethernet is turned off and the device stays on cellular without
+     * interruption.
+     * 
+     * This requires a version of Device OS that allows the Ethernet and cellular interfaces to be 
+     * up at the same time. On older versions, leave this disabled.
+     */
+    EthernetCellular &withMakeBeforeBreak(bool value = true) { makeBeforeBreak = value; return *this; };
+
+    /**
+     * @brief Returns true if make-before-break mode is enabled
+     */
+    bool getMakeBeforeBreak() const { return makeBeforeBreak; };
+
+    /**
+     * @brief Sets the host used to check Internet reachability over Ethernet (default: api.particle.io port 443)
+     * 
+     * @param host The hostname or dotted-quad IP address to connect to by TCP. The string is copied.
+     * 
+     * @param port The TCP port to connect to.
+     * 
+     * This is used in make-before-break mode to make sure the Ethernet LAN can reach the Internet before
+     * moving the cloud connection from cellular to Ethernet. Any host that accepts TCP connections can
+     * be used.
+     */
+    EthernetCellular &withReachabilityHost(const char *host, uint16_t port = 443) { reachabilityHost = host; reachabilityPort = port; return *this; };
+
+    /**
+     * @brief Returns the hostname used to check Internet reachability over Ethernet
+     */
+    const char *getReachabilityHost() const { return reachabilityHost.c_str(); };
+
+    /**
+     * @brief Returns the TCP port used to check Internet reachability over Ethernet
+     */
+    uint16_t getReachabilityPort() const { return reachabilityPort; };
+
+    /**
+     * @brief Sets how long to wait for the reachability check over Ethernet (default: 10 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 10s for 10 seconds.
+     * 
+     * This includes the DNS lookup if the reachability host is a hostname. The check does not block;
+     * the cloud connection stays on cellular while it's in progress. If it does not complete in 
+     * this time, Ethernet is treated as not having Internet access.
+     */
+    EthernetCellular &withReachabilityTimeout(std::chrono::milliseconds value) { reachabilityTimeout = value; return *this; };
+
+    /**
+     * @brief Returns how long to wait for the reachability check over Ethernet
+     */
+    std::chrono::milliseconds getReachabilityTimeout() const { return reachabilityTimeout; };
+
+    /**
+     * @brief Sets the DNS server used for the library's own lookups when the interface has none (default: 8.8.8.8)
+     * 
+     * @param value The DNS server IP address
+     * 
+     * The reachability check, probes, and DNS cache look up hostnames by sending their own queries
+     * over a specific interface, because Network.resolve() always uses the default route. On 
+     * Ethernet, the DNS server from DHCP (or the static configuration) is used, and this server 
+     * only if there is none. On cellular and Wi-Fi, this server is always used.
+     */
+    EthernetCellular &withDnsServer(IPAddress value) { dnsServer = value; return *this; };
+
+    /**
+     * @brief Returns the DNS server used for the library's own lookups when the interface has none
+     */
+    IPAddress getDnsServer() const { return dnsServer; };
+
+    /**
+     * @brief Adds a host to probe for Internet reachability while on Ethernet
+     * 
+     * @param host Hostname or dotted-quad IP address. The string is copied. For DNS probes this is
+     * a DNS server, such as 8.8.8.8.
+     * 
+     * @param port The UDP or TCP port (default: 53, for DNS)
+     * 
+     * @param type EthernetCellularProbe::ProbeType::DNS (default) or EthernetCellularProbe::ProbeType::TCP
+     * 
+     * Normally, loss of Internet on the Ethernet LAN is only detected when the cloud connection
+     * drops, which can take a long time. If you add one or more probe hosts, a lightweight probe 
+     * is sent every probe interval while cloud connected over Ethernet. If probeFailureThreshold 
+     * probes in a row fail, the device switches to cellular without waiting for the cloud
+     * connection to time out.
+     * 
+     * You can call this more than once to add multiple hosts; probes are sent to each host in turn.
+     * Using more than one host prevents a single unreachable server from causing a switch to cellular.
+     * 
+     * ```
+     * EthernetCellular::instance()
+     *     .withProbeHost("8.8.8.8")
+     *     .withProbeHost("1.1.1.1");
+     * ```
+     */
+    EthernetCellular &withProbeHost(const char *host, uint16_t port = 53, EthernetCellularProbe::ProbeType type = EthernetCellularProbe::ProbeType::DNS) { 
+        probe.withHost(host, port, type); 
+        return *this; 
+    };
+
+    /**
+     * @brief Sets the time between reachability probes while on Ethernet (default: 10 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 10s for 10 seconds.
+     * 
+     * This has no effect unless you have added at least one host using withProbeHost().
+     */
+    EthernetCellular &withProbeInterval(std::chrono::milliseconds value) { probe.withInterval(value); return *this; };
+
+    /**
+     * @brief Sets how long to wait for a response to a DNS probe or a TCP probe connection (default: 3 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 3s for 3 seconds.
+     * 
+     * If a probe host is a hostname, resolving it is included in this time.
+     */
+    EthernetCellular &withProbeTimeout(std::chrono::milliseconds value) { probe.withTimeout(value); return *this; };
+
+    /**
+     * @brief Sets the number of probes in a row that must fail to switch to cellular (default: 3)
+     * 
+     * @param value Number of consecutive failures. Must be 1 or larger.
+     * 
+     * The time to detect loss of Internet on the Ethernet LAN is approximately the probe
+     * interval multiplied by this value.
+     */
+    EthernetCellular &withProbeFailureThreshold(int value) { probeFailureThreshold = value; return *this; };
+
+    /**
+     * @brief Returns the number of probes in a row that must fail to switch to cellular
+     */
+    int getProbeFailureThreshold() const { return probeFailureThreshold; };
+
+    /**
+     * @brief Switch to cellular when Ethernet is degraded, not just down (default: disabled)
+     * 
+     * @param maxRtt Switch if the smoothed probe round-trip time is longer than this, or 0ms to not 
+     * check the round-trip time.
+     * 
+     * @param maxLoss Switch if the smoothed fraction of probes that fail is larger than this, 0.0 - 1.0,
+     * or 1.0 to not check loss.
+     * 
+     * This requires at least one probe host (withProbeHost()). The estimates are exponentially
+     * weighted moving averages of the probe results, see EthernetCellularProbe::withEwmaWeight().
+     * At least the minimum number of samples must have been collected since connecting over 
+     * Ethernet before a switch is made.
+     * 
+     * After switching for degraded quality, Ethernet must meet the stricter recovery thresholds 
+     * to stay on it when it's retried. With make-before-break, the time to make the reachability 
+     * TCP connection over Ethernet must also be under the recovery round-trip time before moving 
+     * the cloud connection back. Once Ethernet has met the recovery thresholds for the minimum number
+     * of samples, the normal thresholds apply again.
+     * 
+     * Cellular is not probed, to avoid using cellular data, so it's assumed to be better than a 
+     * degraded Ethernet connection.
+     */
+    EthernetCellular &withLinkQualityThresholds(std::chrono::milliseconds maxRtt, float maxLoss) { linkQualityMaxRtt = maxRtt; linkQualityMaxLoss = maxLoss; return *this; };
+
+    /**
+     * @brief Sets the thresholds Ethernet must meet after it was degraded (default: half the normal thresholds)
+     * 
+     * @param maxRtt Maximum smoothed probe round-trip time
+     * 
+     * @param maxLoss Maximum smoothed fraction of failed probes, 0.0 - 1.0
+     */
+    EthernetCellular &withLinkQualityRecovery(std::chrono::milliseconds maxRtt, float maxLoss) { linkQualityRecoveryRtt = maxRtt; linkQualityRecoveryLoss = maxLoss; return *this; };
+
+    /**
+     * @brief Sets the number of probes needed before the link quality is evaluated (default: 5)
+     */
+    EthernetCellular &withLinkQualityMinSamples(int value) { linkQualityMinSamples = value; return *this; };
+
+    /**
+     * @brief Returns true if the last switch to cellular was because Ethernet was degraded
+     * 
+     * This stays true until Ethernet has met the recovery thresholds.
+     */
+    bool getEthernetDegraded() const { return ethernetDegraded; };
+
+    /**
+     * @brief Sets the cellular standby mode used while on Ethernet (default: CellularStandby::NONE)
+     * 
+     * @param value CellularStandby::NONE, CellularStandby::POWERED, or CellularStandby::CONNECTED
+     * 
+     * By default, cellular is disconnected when switching to Ethernet, so switching to cellular 
+     * backup requires registering with the cellular network and bringing up the data connection.
+     * This can take a minute or more.
+     * 
+     * - CellularStandby::POWERED does not disconnect cellular when switching to Ethernet, so after
+     * being on cellular the modem stays powered and registered, and otherwise it's powered on. This
+     * avoids the modem power-up time, and the registration time after a failover, but unlike 
+     * CONNECTED it does not start a cellular connection that wasn't already there.
+     * - CellularStandby::CONNECTED leaves cellular connected while on Ethernet, so failover only 
+     * needs to reconnect to the cloud. A connection that is already up or in progress is left alone.
+     * This requires a version of Device OS that allows the Ethernet and cellular interfaces to be 
+     * up at the same time.
+     * 
+     * Both modes use more power than the default, and CONNECTED mode may use a small amount of
+     * cellular data for the network connection itself.
+     */
+    EthernetCellular &withCellularStandby(CellularStandby value) { cellularStandby = value; return *this; };
+
+    /**
+     * @brief Monitor the Ethernet PHY link for immediate failover on cable pull (default: false)
+     * 
+     * @param value true to enable or false to disable. If you call with no parameter, it's enabled.
+     * 
+     * Normally, a pulled Ethernet cable is only noticed when the cloud connection drops, and then
+     * the cloud connect timeout for Ethernet must elapse before switching to cellular. With link
+     * monitoring, the link status is checked every link check period while waiting for an Ethernet
+     * address and while connecting to or connected to the cloud over Ethernet, and the device 
+     * switches to cellular as soon as the link is down. While waiting for an address, this only 
+     * applies once the link has come up in the current attempt, so a cable pulled during DHCP fails 
+     * over right away but a link that is still negotiating is left to the Ethernet connect timeout.
+     * 
+     * While on cellular, if the link is seen going from down to up and stays up for the link stable
+     * time (withEthernetLinkStableTime()), Ethernet is retried then instead of waiting for the retry 
+     * Ethernet period. The stable time is backed off by the retry policy the same way as the retry
+     * period, so a link that keeps failing has to stay up longer each time. This 
+     * depends on the link status being reported while the Ethernet interface is disconnected, 
+     * which not all Device OS versions do; otherwise the normal retry period applies.
+     * 
+     * By default the link status is the lower-up flag of the Ethernet network interface, which
+     * the Device OS W5500 driver updates from the PHY status register. The library does not access 
+     * the W5500 directly because the SPI bus is owned by the Ethernet driver. You can supply your
+     * own link status function with withEthernetLinkStatusFunction().
+     */
+    EthernetCellular &withEthernetLinkMonitor(bool value = true) { ethernetLinkMonitor = value; return *this; };
+
+    /**
+     * @brief Sets how often the Ethernet link status is checked (default: 250 milliseconds)
+     * 
+     * @param value The value as a chrono-literal, such as 250ms for 250 milliseconds.
+     */
+    EthernetCellular &withEthernetLinkCheckPeriod(std::chrono::milliseconds value) { ethernetLinkCheckPeriod = value; return *this; };
+
+    /**
+     * @brief Sets how long the link must stay up while on cellular before Ethernet is retried early (default: 1 minute)
+     * 
+     * @param value The value as a chrono-literal, such as 1min for 1 minute.
+     * 
+     * Only used with withEthernetLinkMonitor(). A link that goes down again within this time, such
+     * as a loose cable or a switch that's rebooting, waits for the normal retry Ethernet period.
+     */
+    EthernetCellular &withEthernetLinkStableTime(std::chrono::milliseconds value) { ethernetLinkStableTime = value; return *this; };
+
+    /**
+     * @brief Sets the function used to read the Ethernet link status
+     * 
+     * @param fn Function that returns 1 if the link is up, 0 if it's down, or -1 if unknown. 
+     * Unknown never causes a switch.
+     */
+    EthernetCellular &withEthernetLinkStatusFunction(std::function<int()> fn) { ethernetLinkStatusFunction = fn; return *this; };
+
+    /**
+     * @brief Returns the last Ethernet link status: 1 = up, 0 = down, -1 = unknown or not monitored
+     */
+    int getEthernetLinkStatus() const { return ethernetLinkStatus; };
+
+    /**
+     * @brief Use a static IP address on Ethernet instead of DHCP
+     * 
+     * @param address The IP address for this device
+     * 
+     * @param subnetMask The subnet mask, such as IPAddress(255, 255, 255, 0)
+     * 
+     * @param gateway The default gateway
+     * 
+     * @param dns The DNS server
+     * 
+     * On LANs with a slow DHCP server, most of the Ethernet connect timeout is spent waiting for 
+     * an address. The configuration is set using Ethernet.setConfig() before the first Ethernet 
+     * attempt after boot, which requires Device OS 5.3.0 or later. On earlier versions, an error 
+     * is logged and DHCP is used.
+     * 
+     * Device OS saves the configuration set by Ethernet.setConfig() in flash, so the static address
+     * stays set across reboots even if a later version of the application doesn't use it. If 
+     * withPersistentStorage() is RETAINED or EEPROM, the library remembers that it set a static 
+     * address and sets Ethernet back to DHCP when neither this nor withEthernetLeaseReuse() is used.
+     * Otherwise, call Ethernet.setConfig() with NetworkInterfaceConfigSource::DHCP yourself.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withEthernetStaticAddress(IPAddress address, IPAddress subnetMask, IPAddress gateway, IPAddress dns);
+
+    /**
+     * @brief Reuse the last address obtained by DHCP on Ethernet (default: false)
+     * 
+     * @param value true to enable or false to disable. If you call with no parameter, it's enabled.
+     * 
+     * When enabled, the address, subnet mask, gateway, and DNS server obtained by DHCP are saved 
+     * in the persistent data when the cloud connects over Ethernet. On the next Ethernet attempt, 
+     * after a retry or a reboot, the saved address is set as a static address so there's no DHCP 
+     * wait, as long as it was obtained less than the maximum lease age ago (withEthernetLeaseMaxAge()).
+     * After that, or if an attempt using the saved address fails, the next attempt uses DHCP and 
+     * saves the new address.
+     * 
+     * Device OS can't request a specific address by DHCP, nor renew a DHCP lease while using a 
+     * static address, so a reused address is not known to the DHCP server. Set the maximum lease
+     * age no longer than the DHCP server's lease time, or use this only if the server has a 
+     * reservation for the device; otherwise the address could be given to another device. The 
+     * saved address is only kept across reboots if withPersistentStorage() is RETAINED or EEPROM. 
+     * This requires Device OS 5.3.0 or later and is ignored if withEthernetStaticAddress() is used.
+     * 
+     * Ethernet.setConfig() saves the configuration in flash, so it's only called when the 
+     * configuration to use changes, not on every Ethernet attempt. Device OS keeps the static 
+     * address across reboots; if this is disabled later, the library sets Ethernet back to DHCP
+     * as long as the persistent data was kept. The saved address is only rewritten when the DHCP 
+     * address changes, or when it's been half the maximum lease age since it was saved.
+     */
+    EthernetCellular &withEthernetLeaseReuse(bool value = true) { ethernetLeaseReuse = value; return *this; };
+
+    /**
+     * @brief Sets how long an address saved by withEthernetLeaseReuse() can be reused (default: 1 hour)
+     * 
+     * @param value The value as a chrono-literal, such as 1h for 1 hour, or 0s for no limit.
+     * 
+     * The age is measured from when the address was obtained by DHCP, using the real-time clock,
+     * so a saved address is only reused if Time.isValid() both when it was saved and when it's
+     * about to be reused. Set this no longer than the lease time on the DHCP server.
+     */
+    EthernetCellular &withEthernetLeaseMaxAge(std::chrono::seconds value) { ethernetLeaseMaxAge = value; return *this; };
+
+    /**
+     * @brief Adds a hostname to resolve in the background after each interface change
+     * 
+     * @param host The hostname of one of your servers, such as "api.example.com". 
+     * 
+     * Right after the cloud connects on any interface, the library resolves each registered host 
+     * over that interface, one at a time, and caches the address separately for each interface. 
+     * Entries are resolved again when they expire. Use getCachedAddress() to get the address 
+     * without waiting for a DNS lookup, which is slow on cellular right after a switch.
+     * 
+     * Lookups do not block the state machine. Each is a DNS query sent over the interface itself,
+     * to the Ethernet DNS server, or on cellular and Wi-Fi the server set with withDnsServer(). 
+     * 
+     * You can call this more than once to add multiple hosts. This must be called before setup().
+     */
+    EthernetCellular &withDnsCacheHost(const char *host) { dnsCache.withHost(host); return *this; };
+
+    /**
+     * @brief Sets how long a cached DNS address is used before resolving it again (default: 5 minutes)
+     * 
+     * @param value The value as a chrono-literal, such as 5min for 5 minutes.
+     * 
+     * Device OS does not return the TTL from the DNS response, so this is used for all hosts.
+     */
+    EthernetCellular &withDnsCacheTtl(std::chrono::seconds value) { dnsCache.withTtl(value); return *this; };
+
+    /**
+     * @brief Returns the cached address of a host on the active interface, without blocking
+     * 
+     * @param host The hostname, which must have been added with withDnsCacheHost()
+     * 
+     * Returns an empty IPAddress (false in a boolean context) if there is no active interface,
+     * the host has not been resolved on it yet, or the entry has expired. In that case, fall back 
+     * to connecting by hostname.
+     * 
+     * This can be called from any thread.
+     * 
+     * ```
+     * IPAddress addr = EthernetCellular::instance().getCachedAddress("api.example.com");
+     * if (addr) {
+     *     client.connect(addr, 443);
+     * }
+     * else {
+     *     client.connect("api.example.com", 443);
+     * }
+     * ```
+     */
+    IPAddress getCachedAddress(const char *host) const;
+
+    /**
+     * @brief Returns the cellular standby mode used while on Ethernet
+     */
+    CellularStandby getCellularStandby() const { return cellularStandby; };
+
+    /**
+     * @brief Set the maximum time to connect to cellular (blinking green). Default: 5 minutes.
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     * 
+     * The recommended value is from 5 to 10 minutes. Setting it to short values may prevent ever being able to connect
+     * to cellular.
+     * 
+     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
+     * like:
+     * 
+     * ```
+     * int timeoutMillisecs = 60000;
+     * 
+     * EthernetCellular::instance().withCellularConnectTimeout(std::chrono::milliseconds(timeoutMillisecs));
+     * ```
+     */ 
+    EthernetCellular &withCellularConnectTimeout(std::chrono::milliseconds value) { cellularConnectTimeout = value; return *this; };
+
+    /**
+     * @brief Returns the maximum time to connect to cellular (blinking green) (in milliseconds)
+     */
+    int getCellularConnectTimeout() const { return (int)cellularConnectTimeout.count(); };
+
+    /**
+     * @brief Set the maximum time to connect to the cloud while connected to cellular (blinking cyan). Default: 2 minutes.
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     * 
+     * The default is 2 minutes. It's normally fast, but in areas with low signal strength it make take longer.
+     * 
+     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
+     * like:
+     * 
+     * ```
+     * int timeoutMillisecs = 60000;
+     * 
+     * EthernetCellular::instance().withCellularCloudConnectTimeout(std::chrono::milliseconds(timeoutMillisecs));
+     * ```
+     */ 
+    EthernetCellular &withCellularCloudConnectTimeout(std::chrono::milliseconds value) { cellularCloudConnectTimeout = value; return *this; };
+
+    /**
+     * @brief Returns the maximum time to connect to the cloud while connected to cellular (blinking cyan) (in milliseconds)
+     */
+    int getCellularCloudConnectTimeout() const { return (int)cellularCloudConnectTimeout.count(); };
+
+    /**
+     * @brief Shorten the cellular connect timeout based on how long this site usually takes (default: disabled)
+     * 
+     * @param multiplier The adaptive timeout is the longest of the recent times to cellular ready 
+     * multiplied by this value, or 0 to disable. 3.0 is a good starting value.
+     * 
+     * @param minTimeout The adaptive timeout is never shorter than this (default: 1 minute).
+     * 
+     * The cellular connect timeout (default: 5 minutes) is a worst-case value. The time it takes
+     * to register and attach on the last 4 failovers is saved in the persistent data, along with
+     * the operator. If a site usually registers in 20 seconds and cellular isn't ready after the
+     * adaptive timeout, something is likely stuck, so the modem is powered off, and once it's off
+     * (or after 30 seconds), powered on again and given the full cellular connect timeout to 
+     * connect. This is done at most once per attempt.
+     * 
+     * The saved times are cleared when the operator (MCC and MNC) changes.
+     */
+    EthernetCellular &withAdaptiveCellularConnectTimeout(float multiplier, std::chrono::milliseconds minTimeout = 1min) { adaptiveCellularMultiplier = multiplier; adaptiveCellularMinTimeout = minTimeout; return *this; };
+
+    /**
+     * @brief Returns the adaptive cellular connect timeout in milliseconds, or the cellular connect timeout if there isn't one
+     */
+    int getAdaptiveCellularConnectTimeout() const { return (int)getAdaptiveCellularTimeout().count(); };
+
+    /**
+     * @brief Sets the backup interfaces, in order of priority (default: cellular, or Wi-Fi on Wi-Fi devices)
+     * 
+     * @param list The interfaces, such as `{ ActiveInterface::WIFI, ActiveInterface::CELLULAR }`.
+     * Interfaces the device does not have are ignored, as is ETHERNET since Ethernet is always the
+     * primary interface.
+     * 
+     * On devices that have both Wi-Fi and cellular, you can use Wi-Fi as the first backup and cellular
+     * as the last resort. When an interface fails (the connect or cloud connect timeout for that 
+     * interface is reached), the next one in the list is tried, and after the last one, Ethernet
+     * is tried again. 
+     * 
+     * While on a backup interface, every retry Ethernet period the device goes back to the top of
+     * the list: Ethernet if present, otherwise the first backup interface. If that fails, it walks 
+     * down the list again.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withBackupInterfaces(std::initializer_list<ActiveInterface> list);
+
+    /**
+     * @brief Returns the backup interface being used or tried, such as ActiveInterface::CELLULAR
+     */
+    ActiveInterface getBackupInterface() const;
+
+    /**
+     * @brief Set the maximum time to connect to Wi-Fi when used as a backup (blinking green). Default: 1 minute.
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     */
+    EthernetCellular &withWiFiConnectTimeout(std::chrono::milliseconds value) { wifiConnectTimeout = value; return *this; };
+
+    /**
+     * @brief Returns the maximum time to connect to Wi-Fi (in milliseconds)
+     */
+    int getWiFiConnectTimeout() const { return (int)wifiConnectTimeout.count(); };
+
+    /**
+     * @brief Set the maximum time to connect to the cloud while connected to Wi-Fi (blinking cyan). Default: 1 minute.
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     */
+    EthernetCellular &withWiFiCloudConnectTimeout(std::chrono::milliseconds value) { wifiCloudConnectTimeout = value; return *this; };
+
+    /**
+     * @brief Returns the maximum time to connect to the cloud while connected to Wi-Fi (in milliseconds)
+     */
+    int getWiFiCloudConnectTimeout() const { return (int)wifiCloudConnectTimeout.count(); };
+
+    /**
+     * @brief Set the Wi-Fi keep-alive value when used as a backup (default: 25 seconds)
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     * 
+     * Like Ethernet, Wi-Fi is typically behind a LAN router, so the default is the same as the 
+     * Ethernet keep-alive.
+     */
+    EthernetCellular &withWiFiKeepAlive(std::chrono::seconds value) { wifiKeepAlive = value; return *this; };
+
+    /**
+     * @brief Returns the Wi-Fi keep-alive value (in seconds)
+     */
+    int getWiFiKeepAlive() const { return (int)wifiKeepAlive.count(); };
+
+    /**
+     * @brief Set the maximum time to connect to Ethernet (blinking green). Default: 30 seconds.
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     * 
+     * This should normally be really fast, but if for some reason your Ethernet network takes a long
+     * time to establish a connection you could make the timeout longer.
+     * 
+     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
+     * like:
+     * 
+     * ```
+     * int timeoutMillisecs = 60000;
+     * 
+     * EthernetCellular::instance().withEthernetConnectTimeout(std::chrono::milliseconds(timeoutMillisecs));
+     * ```
+     */ 
+    EthernetCellular &withEthernetConnectTimeout(std::chrono::milliseconds value) { ethernetConnectTimeout = value; return *this; };
+
+    /**
+     * @brief Returns the maximum time to connect to Ethernet (blinking green) (in milliseconds)
+     */
+    int getEthernetConnectTimeout() const { return (int)ethernetConnectTimeout.count(); };
+
+    /**
+     * @brief Set the maximum time to connect to the cloud while connected to Ethernet (blinking cyan). Default: 30 seconds.
+     * 
+     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
+     * 
+     * The default is 30 seconds. It should normally only take a few seconds.
+     * 
+     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
+     * like:
+     * 
+     * ```
+     * int timeoutMillisecs = 60000;
+     * 
+     * EthernetCellular::instance().withEthernetCloudConnectTimeout(std::chrono::milliseconds(timeoutMillisecs));
+     * ```
+     */ 
+    EthernetCellular &withEthernetCloudConnectTimeout(std::chrono::milliseconds value) { ethernetCloudConnectTimeout = value; return *this; };
+
+    /**
+     * @brief Returns the maximum time to connect to the cloud while connected to Ethernet (blinking cyan) (in milliseconds)
+     */
+    int getEthernetCloudConnectTimeout() const { return (int)ethernetCloudConnectTimeout.count(); };
+
+    /**
+     * @brief Adds a named timeout profile that can be selected at runtime
+     * 
+     * @param name The name of the profile, such as "fast-failover" or "data-saver". The string must
+     * remain valid (typically a string constant).
+     * 
+     * @param profile The timeouts to use for this profile
+     * 
+     * setup() also adds a profile named "default" with the settings at the time setup() is called, 
+     * unless you have added one with that name.
+     * 
+     * ```
+     * EthernetCellular::TimeoutProfile fastFailover;
+     * fastFailover.ethernetCloudConnectTimeout = 15s;
+     * fastFailover.retryEthernetPeriod = 2min;
+     * 
+     * EthernetCellular::instance()
+     *     .withTimeoutProfile("fast-failover", fastFailover)
+     *     .withTimeoutProfileFunction();
+     * ```
+     */
+    EthernetCellular &withTimeoutProfile(const char *name, const TimeoutProfile &profile);
+
+    /**
+     * @brief Registers a Particle function to select a named timeout profile from the cloud
+     * 
+     * @param functionName The name of the function (default: "ethcellProfile"). The string must 
+     * remain valid (typically a string constant).
+     * 
+     * Call the function with the profile name as the argument. It returns 0 on success or -1 if 
+     * there is no profile with that name. You can also call applyTimeoutProfile() from your own 
+     * code, for example when a Ledger or configuration file changes.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withTimeoutProfileFunction(const char *functionName = "ethcellProfile") { timeoutProfileFunctionName = functionName; return *this; };
+
+    /**
+     * @brief Returns the current timeouts as a profile
+     */
+    TimeoutProfile getTimeoutProfile() const;
+
+    /**
+     * @brief Returns the name of the profile last applied, or "default"
+     */
+    const char *getTimeoutProfileName() const { return timeoutProfileName; };
+
+    /**
+     * @brief Changes all of the timeouts in a profile at once
+     * 
+     * @param profile The new timeouts
+     * 
+     * @param name The name returned by getTimeoutProfileName(). The string must remain valid
+     * (typically a string constant).
+     * 
+     * Changing the individual with*Timeout settings while a state is in progress can use a mix 
+     * of old and new values. This saves the new profile and applies all of it at the next state
+     * transition, so each state sees either the old or the new values, never a mix. For example, 
+     * a new retry Ethernet period takes effect the next time the cloud connects on a backup 
+     * interface. This can be called from any thread.
+     */
+    void applyTimeoutProfile(const TimeoutProfile &profile, const char *name = "custom");
+
+    /**
+     * @brief Changes the timeouts to a profile added with withTimeoutProfile()
+     * 
+     * @param name The name of the profile
+     * 
+     * @return true if the profile was found, false if not
+     * 
+     * The profile is applied at the next state transition, the same as for applyTimeoutProfile().
+     */
+    bool applyTimeoutProfile(const char *name);
+
+    /**
+     * @brief Sets the status LED color when using cellular backup, replacing blinking or breathing cyan (default: yellow)
+     * 
+     * @param value Color value, such as RGB_COLOR_CYAN, RGB_COLOR_YELLOW, or RGB_COLOR_ORANGE
+     * 
+     * When switching to cellular backup, the cloud connection color (typically blinking cyan, followed
+     * by breathing cyan) can be overridden. The default in this class is to use yellow (blinking yellow
+     * followed by breathing yellow) when on cellular backup so you can tell it's on backup, and that 
+     * color is not currently used by Device OS.
+     * 
+     * If you don't want the status LED color to be overridden, make this call with no parameter or
+     * use `RGB_COLOR_CYAN` to use the Device OS default.
+     * 
+     * Note that this does not override the blinking green (connecting to network) which will be blinking green
+     * for both cellular and Ethernet, however it's normally not in this state for very long and there are
+     * only so many available colors.
+     */
+    EthernetCellular &withCellularBackupColor(uint32_t value = RGB_COLOR_CYAN) { cellularBackupColor = value; return *this; };
+
+    /**
+     * @brief Returns the status LED color when using cellular backup
+     * 
+     * Value is an RGB color as a uint32_t of the form 0x00RRGGBB, matching the format of constants like
+     * RGB_COLOR_CYAN, RGB_COLOR_YELLOW, or RGB_COLOR_ORANGE.
+     */
+    uint32_t getCellularBackupColor() const { return cellularBackupColor; };
+
+    /**
+     * @brief Returns the enumeration for the currently active interface (NONE, CELLULAR, or ETHERNET)
+     */
+    ActiveInterface getActiveInterface() const { return activeInterface; };
+
+    /**
+     * @brief Sets a notification callback for when the active interface changes
+     * 
+     * You can only have one interface change callback.
+     */
+    EthernetCellular &withInterfaceChangeCallback(std::function<void(ActiveInterface oldInterface, ActiveInterface newInterface)> callback) {
+        interfaceChangeCallback = callback;
+        return *this;
+    }
+
+    /**
+     * @brief Returns the current state machine state
+     */
+    State getState() const { return state; };
+
+    /**
+     * @brief Returns a readable name for a state, such as "TryEthernet"
+     * 
+     * @param state The state to look up
+     * 
+     * Returns "unknown" if state is not valid. The returned string is a constant, not allocated.
+     */
+    static const char *getStateName(State state);
+
+    /**
+     * @brief Returns a copy of the failover statistics
+     * 
+     * The time in the current state and the current cloud down period (if any) are included in 
+     * the returned totals, so the values are up to date as of the call.
+     */
+    Stats getStats() const;
+
+    /**
+     * @brief Clears all statistics
+     */
+    void resetStats();
+
+    /**
+     * @brief Record state transitions in a log in retained memory (default: false)
+     * 
+     * @param value true to enable or false to disable. If you call with no parameter, it's enabled.
+     * 
+     * The log is a ring buffer of ETHERNETCELLULAR_TRANSITION_LOG_SIZE (default: 32) compact 
+     * TransitionRecord entries, with the timestamp, from and to state, reason, time in the old 
+     * state, and the cellular signal and Ethernet round-trip time if available. It's in retained 
+     * memory so it survives a reset, and it can be uploaded in batches using 
+     * EthernetCellularTransitionUploader.
+     * 
+     * This must be called before setup().
+     */
+    EthernetCellular &withTransitionLog(bool value = true) { transitionLogEnabled = value; return *this; };
+
+    /**
+     * @brief Returns the sequence number of the next transition log record
+     * 
+     * Record sequence numbers start at 0 and increase by one for each transition. Only the most
+     * recent ETHERNETCELLULAR_TRANSITION_LOG_SIZE records are kept.
+     */
+    uint32_t getTransitionLogCount() const { return transitionLog.writeCount; };
+
+    /**
+     * @brief Gets a record from the transition log
+     * 
+     * @param seq The sequence number of the record
+     * 
+     * @param record Filled in with the record
+     * 
+     * @return true if the record was copied, false if it has not been written yet or has been overwritten
+     */
+    bool getTransitionLogRecord(uint32_t seq, TransitionRecord &record) const;
+
+    /**
+     * @brief Returns the sequence number of the first record that has not been uploaded
+     * 
+     * This is kept in retained memory with the log.
+     */
+    uint32_t getTransitionLogUploaded() const { return transitionLog.uploadedCount; };
+
+    /**
+     * @brief Marks records before seq as uploaded
+     */
+    void setTransitionLogUploaded(uint32_t seq);
+
+    /**
+     * @brief Call before System.sleep() to save the interface decision
+     * 
+     * Saves the active interface (or the last one that was cloud connected) and the position in 
+     * the retry Ethernet schedule, so resumeFromSleep() can go straight back to the same interface
+     * without trying Ethernet first and waiting for it to time out.
+     * 
+     * The saved decision is also stored in the persistent data, so it's used by a device that
+     * resets on wake (HIBERNATE mode) if withPersistentStorage() is RETAINED or EEPROM. In that case
+     * you don't need to call resumeFromSleep(); it's used automatically at startup. At startup 
+     * after any other kind of reset (System.resetReason() is not RESET_REASON_POWER_MANAGEMENT), 
+     * the device did not wake from sleep, so a saved decision is discarded.
+     * 
+     * Call this right before System.sleep(). If resumeFromSleep() is not called within the sleep 
+     * resume timeout (withSleepResumeTimeout()) while the device is running, the device is assumed
+     * not to have slept and the saved decision is discarded.
+     */
+    void prepareForSleep();
+
+    /**
+     * @brief Call after System.sleep() returns to reconnect using the interface decision from prepareForSleep()
+     * 
+     * @param wakeReason The wake reason from the SystemSleepResult. If the device was woken by 
+     * network activity (network standby), the connection is still up and the current state is kept.
+     * 
+     * Otherwise, the state machine goes directly to connecting to the saved interface. For a backup
+     * interface, the time until the next Ethernet retry continues from where it was when sleeping,
+     * rather than starting over. If no interface was saved, the connection starts again with Ethernet
+     * (if present).
+     * 
+     * ```
+     * EthernetCellular::instance().prepareForSleep();
+     * SystemSleepResult result = System.sleep(config);
+     * EthernetCellular::instance().resumeFromSleep(result.wakeupReason());
+     * ```
+     */
+    void resumeFromSleep(SystemSleepWakeupReason wakeReason = SystemSleepWakeupReason::UNKNOWN);
+
+    /**
+     * @brief Sets how long after prepareForSleep() to keep the saved decision if resumeFromSleep() is not called (default: 1 minute)
+     * 
+     * @param value The value as a chrono-literal, such as 1min for 1 minute.
+     * 
+     * Time during which the state machine did not run (because the device was asleep) doesn't count,
+     * so this only discards the decision when the device kept running without sleeping, for 
+     * example if the application decided not to sleep after all.
+     */
+    EthernetCellular &withSleepResumeTimeout(std::chrono::milliseconds value) { sleepResumeTimeout = value; return *this; };
+
+    /**
+     * @brief Adds to the application traffic counters
+     * 
+     * @param iface The interface the traffic went over. ActiveInterface::NONE is ignored.
+     * 
+     * @param txBytes Number of bytes sent
+     * 
+     * @param txPackets Number of packets sent
+     * 
+     * @param rxBytes Number of bytes received
+     * 
+     * @param rxPackets Number of packets received
+     * 
+     * This is called by EthernetCellularTCPClient and EthernetCellularUDP. You can also call it 
+     * if you have your own network code. It can be called from any thread.
+     */
+    void countTraffic(ActiveInterface iface, uint32_t txBytes, uint32_t txPackets, uint32_t rxBytes, uint32_t rxPackets);
+
+    /**
+     * @brief Clears only the application traffic counters
+     */
+    void resetTrafficStats();
+
+    /**
+     * @brief Returns the interface for a network interface handle
+     * 
+     * @param nif A network interface, such as passed to TCPClient::connect(). 0 (any interface)
+     * returns the currently active interface.
+     */
+    ActiveInterface interfaceForNif(network_interface_t nif) const;
+
+protected:
+    /**
+     * @brief The constructor is protected because the class is a singleton
+     * 
+     * Use EthernetCellular::instance() to instantiate the singleton.
+     */
+    EthernetCellular();
+
+    /**
+     * @brief The destructor is protected because the class is a singleton and cannot be deleted
+     */
+    virtual ~EthernetCellular();
+
+    /**
+     * This class is a singleton and cannot be copied
+     */
+    EthernetCellular(const EthernetCellular&) = delete;
+
+    /**
+     * This class is a singleton and cannot be copied
+     */
+    EthernetCellular& operator=(const EthernetCellular&) = delete;
+
+    /**
+     * @brief Sets the active interface and calls the notification handler if necessary
+     * 
+     * Internal use only
+     */
+    void setActiveInterface(ActiveInterface newActiveInterface);
+
+    /**
+     * @brief Starts or ends a cloud down period in the stats when Particle.connected() changes
+     * 
+     * This includes a cloud connection lost while the interface stays up, such as 
+     * ETHERNET_CLOUD_CONNECTED to WAIT_ETHERNET_CLOUD, not just periods with no active interface.
+     */
+    void updateCloudDown();
+
+    /**
+     * @brief Changes the state and updates the statistics
+     * 
+     * @param newState The state to switch to. The handler is looked up in stateTable.
+     * 
+     * @param reason Why the transition happened, for the transition log
+     * 
+     * Internal use only
+     */
+    void setState(State newState, TransitionReason reason = TransitionReason::NONE);
+
+    /**
+     * @brief Adds a record to the transition log, if enabled
+     */
+    void logTransition(State newState, TransitionReason reason, uint32_t timeInState);
+
+    /**
+     * @brief Copies pendingTimeoutProfile into the timeout settings; called from setState()
+     */
+    void applyPendingTimeoutProfile();
+
+    /**
+     * @brief Sets backupConnectTimeout and backupCloudConnectTimeout for the current backup interface
+     */
+    void updateBackupTimeouts();
+
+    /**
+     * @brief Returns the cellular connect timeout based on the ready time history
+     * 
+     * This is cellularConnectTimeout if adaptive timeouts are disabled or there is no history.
+     */
+    std::chrono::milliseconds getAdaptiveCellularTimeout() const;
+
+    /**
+     * @brief Saves the time to cellular ready and the operator, and updates the stats
+     */
+    void recordCellularReady(uint32_t readyTime);
+
+    /**
+     * @brief Number of cellular ready times kept in PersistentData::cellularReadyHistory
+     */
+    static const size_t CELLULAR_READY_HISTORY_SIZE = 4;
+
+    /**
+     * @brief Particle function handler registered by withTimeoutProfileFunction()
+     */
+    int timeoutProfileFunction(String param);
+
+    /**
+     * @brief A named timeout profile added with withTimeoutProfile()
+     */
+    struct NamedTimeoutProfile {
+        const char *name;           //!< Name of the profile
+        TimeoutProfile profile;     //!< Timeouts for this profile
+    };
+
+    /**
+     * @brief Ring buffer of TransitionRecord, kept in retained memory
+     */
+    struct TransitionLog {
+        uint32_t magic;             //!< TRANSITION_LOG_MAGIC
+        uint16_t size;              //!< sizeof(TransitionLog)
+        uint16_t reserved;          //!< Padding
+        uint32_t writeCount;        //!< Sequence number of the next record
+        uint32_t uploadedCount;     //!< Sequence number of the first record not uploaded
+        TransitionRecord records[ETHERNETCELLULAR_TRANSITION_LOG_SIZE]; //!< Records, indexed by sequence number modulo the size
+    };
+
+    /**
+     * @brief Magic bytes to identify a valid TransitionLog
+     */
+    static const uint32_t TRANSITION_LOG_MAGIC = 0x4563a7c2;
+
+    /**
+     * @brief Returns true if the timeout for the current state in stateTable has been reached
+     * 
+     * The timeout is measured from stateTime. Always returns false for states with no timeout.
+     */
+    bool isStateTimedOut() const;
+
+    /**
+     * @brief Returns the number of milliseconds until the current state needs to run again
+     * 
+     * This takes into account the state timeout, retry period, and probe interval. States that
+     * always transition immediately return 0. The value is at most eventDrivenMaxIdle.
+     * 
+     * Used in event-driven mode to decide whether loop() needs to run the state handler.
+     */
+    unsigned long getStateDeadline() const;
+
+    /**
+     * @brief System event handler for network_status and cloud_status in event-driven mode or with a wake callback
+     */
+    static void systemEventHandler(system_event_t event, int param);
+
+    /**
+     * @brief Requests that the state machine run soon, and calls the wake callback if set
+     * 
+     * This can be called from any thread.
+     */
+    void wake();
+
+    /**
+     * @brief Runs the state handler for the current state, with the mutex locked
+     * 
+     * Called from loop(), or from the worker thread in thread mode.
+     */
+    void runStateMachine();
+
+    /**
+     * @brief Type of event in the async callback queue
+     */
+    enum class CallbackEventType : uint8_t {
+        INTERFACE_CHANGE = 0,       //!< interfaceChangeCallback(oldInterface, newInterface)
+        SWITCH_PENDING,             //!< switchPendingCallback(value)
+        BEFORE_INTERFACE_CHANGE     //!< beforeInterfaceChangeCallback(oldInterface, newInterface, value)
+    };
+
+    /**
+     * @brief Event in the async callback queue
+     */
+    struct CallbackEvent {
+        CallbackEventType type;     //!< Which callback to call
+        ActiveInterface oldInterface;   //!< Old or current interface
+        ActiveInterface newInterface;   //!< New or planned interface
+        uint32_t value;             //!< Milliseconds for SWITCH_PENDING and BEFORE_INTERFACE_CHANGE
+    };
+
+    /**
+     * @brief Calls the callback for an event now, or posts it to the async callback queue
+     * 
+     * Called from the state machine thread only.
+     */
+    void dispatchCallback(const CallbackEvent &event);
+
+    /**
+     * @brief Calls the callback for an event
+     */
+    void callCallback(const CallbackEvent &event);
+
+    /**
+     * @brief Calls the callbacks for the events in the async callback queue; called from loop()
+     */
+    void deliverCallbacks();
+
+    /**
+     * @brief Worker thread function used in thread mode; never returns
+     */
+    static os_thread_return_t threadFunction(void *param);
+
+    /**
+     * @brief Calls wake() if the Ethernet, backup interface, or cloud connection status changed
+     * 
+     * Called from the worker thread every wake poll period when there's a wake callback but thread 
+     * mode is not enabled.
+     */
+    void checkStatusChange();
+
+    /**
+     * @brief Clears statistics without locking the mutex
+     */
+    void resetStatsInternal();
+
+    /**
+     * @brief Loads persistentData from persistent storage, or initializes it if not valid
+     */
+    void loadPersistentData();
+
+    /**
+     * @brief Saves persistentData to persistent storage, if enabled
+     */
+    void savePersistentData();
+
+    /**
+     * @brief Records the result of an attempt to connect to the cloud by Ethernet in the persistent history
+     * 
+     * @param success true if cloud connected by Ethernet, false if the attempt failed
+     */
+    void recordEthernetAttempt(bool success);
+
+    /**
+     * @brief Sets the Ethernet address configuration before connecting
+     * 
+     * Uses the static address, the saved DHCP address, or DHCP. If neither 
+     * withEthernetStaticAddress() nor withEthernetLeaseReuse() is used, only restores DHCP if the
+     * library previously set a static address, otherwise leaves the Device OS configuration alone.
+     */
+    void applyEthernetConfig();
+
+    /**
+     * @brief Saves the Ethernet address obtained by DHCP in the persistent data
+     * 
+     * Does nothing if the same address is already saved and isn't close to ethernetLeaseMaxAge, to 
+     * avoid flash writes on every Ethernet cloud connection.
+     */
+    void saveEthernetLease();
+
+    /**
+     * @brief Returns true if the saved Ethernet address is younger than ethernetLeaseMaxAge
+     */
+    bool isEthernetLeaseFresh() const;
+
+    /**
+     * @brief Sets the Ethernet configuration using Ethernet.setConfig() if it's different from the last one set
+     * 
+     * @param address Static address, or an empty IPAddress for DHCP
+     */
+    void setEthernetConfig(IPAddress address, IPAddress subnetMask, IPAddress gateway, IPAddress dns);
+
+    /**
+     * @brief Updates the link up time while waiting for Ethernet to be ready
+     */
+    void checkEthernetLinkUpTime();
+
+    /**
+     * @brief Data preserved across reboots when persistentStorage is not NONE
+     */
+    struct PersistentData {
+        uint32_t magic;                 //!< PERSISTENT_DATA_MAGIC
+        uint16_t size;                  //!< sizeof(PersistentData)
+        uint8_t lastInterface;          //!< ActiveInterface last connected to the cloud
+        uint8_t ethernetHistory;        //!< Results of the last 8 Ethernet attempts, bit 0 is the most recent, 1 = failed
+        uint32_t reserved3;             //!< Unused, kept so the layout of saved data doesn't change (was the last Ethernet time to cloud)
+        uint32_t reserved4;             //!< Unused, kept so the layout of saved data doesn't change (was the last cellular time to cloud)
+        uint8_t ethernetDetected;       //!< Cached detection result: ETHERNET_DETECTED_UNKNOWN, _PRESENT, or _ABSENT
+        uint8_t ethernetMac[6];         //!< Cached Ethernet MAC address, if present
+        uint8_t ethernetStaticConfig;   //!< 1 if the library set a static address with Ethernet.setConfig(), which Device OS keeps in flash
+        uint16_t ethernetKeepAliveSafe;     //!< Learned safe Ethernet keep-alive (seconds)
+        uint16_t ethernetKeepAliveCeiling;  //!< Learned failing Ethernet keep-alive (seconds)
+        uint16_t cellularKeepAliveSafe;     //!< Learned safe cellular keep-alive (seconds)
+        uint16_t cellularKeepAliveCeiling;  //!< Learned failing cellular keep-alive (seconds)
+        uint32_t cellularNetworkId;         //!< Hash of the withKeepAliveNetworkId() value the cellular values were learned with
+        uint8_t sleepInterface;             //!< ActiveInterface saved by prepareForSleep(), NONE if not sleeping
+        uint8_t sleepBackupIndex;           //!< backupIndex saved by prepareForSleep()
+        uint16_t reserved2;                 //!< Padding
+        uint32_t sleepRetryElapsed;         //!< Time into the retry Ethernet period when prepareForSleep() was called (milliseconds)
+        uint8_t ethernetLeaseAddress[4];    //!< Address obtained by DHCP, all 0 if none is saved
+        uint8_t ethernetLeaseSubnetMask[4]; //!< Subnet mask obtained by DHCP
+        uint8_t ethernetLeaseGateway[4];    //!< Gateway obtained by DHCP
+        uint8_t ethernetLeaseDns[4];        //!< DNS server obtained by DHCP
+        uint16_t cellularReadyHistory[4];   //!< Recent times to cellular ready (seconds), most recent first, 0 = none
+        uint16_t cellularMcc;               //!< Mobile country code for cellularReadyHistory
+        uint16_t cellularMnc;               //!< Mobile network code for cellularReadyHistory
+        uint32_t ethernetLeaseTime;         //!< Time.now() value when the saved Ethernet address was obtained, 0 if unknown
+    };
+
+    /**
+     * @brief Magic bytes to identify valid PersistentData
+     */
+    static const uint32_t PERSISTENT_DATA_MAGIC = 0x4563a7c1;
+
+    static const uint8_t ETHERNET_DETECTED_UNKNOWN = 0;    //!< Value for PersistentData::ethernetDetected
+    static const uint8_t ETHERNET_DETECTED_PRESENT = 1;    //!< Value for PersistentData::ethernetDetected
+    static const uint8_t ETHERNET_DETECTED_ABSENT = 2;     //!< Value for PersistentData::ethernetDetected
+
+    /**
+     * @brief Enables FEATURE_ETHERNET_DETECTION and reads the MAC address to detect the Ethernet adapter
+     * 
+     * Sets ethernetPresent and, if the detection cache is enabled, updates persistentData.
+     */
+    void detectEthernet();
+
+    /**
+     * @brief Returns the Device OS network object for an interface
+     * 
+     * Returns Network for an interface the device does not have.
+     */
+    static NetworkClass &getNetwork(ActiveInterface iface);
+
+    /**
+     * @brief Returns the keep-alive learner for an interface
+     * 
+     * Returns nullptr for an interface without a learner (Wi-Fi uses withWiFiKeepAlive()).
+     */
+    EthernetCellularKeepAliveLearner *getKeepAliveLearner(ActiveInterface iface);
+
+    /**
+     * @brief Advances to the next backup interface after the current one fails
+     * 
+     * @return The next state: TRY_CELLULAR for the next backup interface, TRY_ETHERNET after the
+     * last backup interface if Ethernet is present, or the current state if there is nothing else to try.
+     */
+    State nextBackupState();
+
+    /**
+     * @brief Uses and clears the interface decision saved by prepareForSleep()
+     * 
+     * @return true if there was a saved interface and the state was set to connect to it
+     */
+    bool resumeSavedInterface();
+
+    /**
+     * @brief Clears the interface decision saved by prepareForSleep() without using it
+     * 
+     * @param reason Why, for the log message
+     */
+    void discardSavedInterface(const char *reason);
+
+    /**
+     * @brief Discards the saved interface decision if resumeFromSleep() has not been called in sleepResumeTimeout
+     * 
+     * Called from runStateMachine(). A long gap since the previous call means the device was asleep,
+     * and restarts the timeout so resumeFromSleep() has time to be called after waking.
+     */
+    void checkSleepResumeTimeout();
+
+    /**
+     * @brief Copies the learned keep-alive values to persistentData and saves it
+     */
+    void saveKeepAliveLearners();
+
+    /**
+     * @brief Enables FEATURE_ETHERNET_DETECTION if it's not already enabled
+     */
+    void enableEthernetDetectionFeature();
+
+    /**
+     * @brief Starting state at boot
+     * 
+     * Determines if Ethernet is present from withEthernetPresent(), the detection cache, or by
+     * detecting the adapter.
+     * 
+     * Next state:
+     * - stateTryEthernet if Ethernet is present
+     * - stateTryCellular if no Ethernet is present
+     * - stateTryCellular if Ethernet is present, but the persistent data shows the last known good
+     * interface was cellular and the last Ethernet attempt failed
+     */
+    void stateStart();
+
+    /**
+     * @brief Starting point for switching to Ethernet
+     * 
+     * - Disconnects from Cellular (depending on cellularStandby)
+     * - Connects to Ethernet
+     * - Sets the cloud connection RGB status LED theme to default (cyan)
+     * 
+     * Next State:
+     * - stateWaitEthernetReady (always)
+     */
+    void stateTryEthernet();
+
+    /**
+     * @brief Waits until Ethernet is ready or times out
+     * 
+     * If ready:
+     * - Does a Particle.connect to reconnect to the Particle cloud
+     * - Updates the detection cache if the MAC address changed
+     * 
+     * Next State:
+     * - stateWaitEthernetCloud if ready
+     * - stateTryCellular if ethernetConnectTimeout is reached without ready
+     */
+    void stateWaitEthernetReady();
+
+    /**
+     * @brief Waits until cloud connected while on Ethernet
+     * 
+     * If connected;
+     * - Sets the keep-alive to ethernetKeepAlive
+     * 
+     * Next State:
+     * - stateEthernetCloudConnected if connected to the Particle cloud
+     * - stateTryCellular if timeout of ethernetCloudConnectTimeout is reached
+     * 
+     * This is separate from connecting to Ethernet, because it's possible for 
+     * Ethernet to be ready if the local LAN is up, but not be able to reach 
+     * the Particle cloud if the Internet connection to the LAN is down. 
+     */
+    void stateWaitEthernetCloud();
+
+    /**
+     * @brief State for when cloud connected
+     * 
+     * If probe hosts are configured, sends reachability probes. Resets the retry policy once 
+     * connected for its stable time.
+     * 
+     * Next State;
+     * - stateWaitEthernetCloud if cloud connection is lost
+     * - stateTryCellular if probeFailureThreshold probes in a row fail
+     * - stateEthernetDrainThenTryCellular if link quality is degraded
+     */
+    void stateEthernetCloudConnected();
+
+    /**
+     * @brief Waits for the before interface change callback and cloud operations before leaving degraded Ethernet
+     * 
+     * Next State:
+     * - stateTryCellular when interfaceChangeReady() has been called and there are no cloud
+     * operations, or their timeouts have been reached
+     * - stateTryCellular if the cloud connection is lost
+     */
+    void stateEthernetDrainThenTryCellular();
+
+    /**
+     * @brief Returns true if the current drain state can disconnect
+     * 
+     * This is true when the cloud is disconnected, or when there are no cloud operations (or the 
+     * drain timeout has passed) and interfaceChangeReady() has been called (or the before interface
+     * change timeout has passed). Both timeouts are measured from stateTime.
+     */
+    bool isDrainComplete();
+
+    /**
+     * @brief Calls the before interface change callback, if set
+     * 
+     * @param plannedInterface The interface that will be tried next
+     * 
+     * @param wait true to wait for interfaceChangeReady() in the drain state, or false if the 
+     * current interface has already failed and it will be disconnected right away.
+     */
+    void notifyBeforeInterfaceChange(ActiveInterface plannedInterface, bool wait);
+
+
+    /**
+     * @brief Starting point for switching to cellular
+     * 
+     * - Disconnects from Ethernet
+     * - Connects to the current backup interface (cellular or Wi-Fi) and disconnects the others
+     * - Sets the cloud connection RGB status LED theme
+     * 
+     * Next State:
+     * - stateWaitCellularReady (always)
+     */
+    void stateTryCellular();
+
+
+    /**
+     * @brief Waits until cellular is ready or times out
+     * 
+     * If ready:
+     * - Does a Particle.connect to reconnect to the Particle cloud
+     * 
+     * Next State:
+     * - stateWaitCellularCloud if ready
+     * - stateTryCellular with the next backup interface if the connect timeout is reached without ready
+     * - stateTryEthernet if the connect timeout is reached for the last backup interface and ethernetPresent is true
+     * 
+     * If there is no Ethernet controller and only one backup interface, this state will be remained 
+     * in forever until connected.
+     */
+    void stateWaitCellularReady();
+
+    /**
+     * @brief Waits until cloud connected while on cellular
+     * 
+     * If connected;
+     * - Sets the keep-alive to cellularKeepAlive
+     * 
+     * Next State:
+     * - stateCellularCloudConnected if connected to the Particle cloud
+     * - stateTryCellular with the next backup interface if the cloud connect timeout is reached
+     * - stateTryEthernet if the cloud connect timeout is reached for the last backup interface and ethernetPresent is true
+     */
+    void stateWaitCellularCloud();
+
+    /**
+     * @brief State for when cloud is connected via cellular
+     * 
+     * The time between retries is retryEthernetPeriod adjusted by retryPolicy.
+     * 
+     * Next State;
+     * - stateWaitCellularCloud if cloud connection is lost
+     * - stateCellularDrainThenTryEthernet if retry period is reached and ethernetPresent is 
+     * true, or there is a higher priority backup interface
+     * - stateCellularTryEthernetInBackground if retry period is reached, ethernetPresent is true, and makeBeforeBreak is true
+     */
+    void stateCellularCloudConnected();
+
+    /**
+     * @brief Waits for Particle.connected to be false then tries Ethernet again
+     * 
+     * Next state: 
+     * - stateTryEthernet after Particle.connected() is false
+     * - stateTryCellular with the first backup interface after Particle.connected() is false, if ethernetPresent is false
+     */
+    void stateCellularWaitDisconnectedThenTryEthernet();
+
+    /**
+     * @brief Brings up Ethernet while the cloud stays connected by cellular (make-before-break mode)
+     * 
+     * - Connects to Ethernet without disconnecting cellular
+     * 
+     * Next state:
+     * - stateCellularWaitEthernetReadyInBackground (always)
+     */
+    void stateCellularTryEthernetInBackground();
+
+    /**
+     * @brief Waits until Ethernet is ready while the cloud stays connected by cellular
+     * 
+     * Next state:
+     * - stateCellularCheckEthernetReachability if Ethernet is ready
+     * - stateCellularCloudConnected if ethernetConnectTimeout is reached without ready (Ethernet is disconnected)
+     * - stateWaitCellularCloud if the cloud connection over cellular is lost (Ethernet is disconnected)
+     */
+    void stateCellularWaitEthernetReadyInBackground();
+
+    /**
+     * @brief Makes a TCP connection to the reachability host over Ethernet while still on cellular
+     * 
+     * Next state:
+     * - stateCellularDrainThenTryEthernet if the host is reachable over Ethernet
+     * - stateCellularCloudConnected if the host could not be reached (Ethernet is disconnected)
+     */
+    void stateCellularCheckEthernetReachability();
+
+    /**
+     * @brief Waits for cloud operations to end before disconnecting the cellular cloud connection
+     * 
+     * This is entered when a retry would disconnect the cloud while on a backup interface. 
+     * 
+     * Next State:
+     * - stateCellularWaitDisconnectedThenTryEthernet when interfaceChangeReady() has been called and there 
+     * are no cloud operations, or their timeouts have been reached
+     * - stateCellularWaitDisconnectedThenTryEthernet if the cloud connection is lost
+     */
+    void stateCellularDrainThenTryEthernet();
+
+    /**
+     * @brief Enters stateCellularDrainThenTryEthernet to disconnect from the cloud once cloud operations end
+     * 
+     * Also calls the before interface change callback.
+     */
+    void drainThenTryEthernet();
+
+    /**
+     * @brief Starts the non-blocking check that the reachability host can be reached by TCP over Ethernet
+     * 
+     * stateCellularCheckEthernetReachability() polls it until it completes.
+     */
+    void startEthernetReachabilityCheck();
+
+    /**
+     * @brief Returns the DNS server to use for the library's own lookups on an interface
+     * 
+     * @param iface The interface. For Ethernet, this is the Ethernet DNS server if there is one.
+     * Otherwise it's dnsServer.
+     */
+    IPAddress getDnsServer(ActiveInterface iface);
+
+    /**
+     * @brief Returns true if link quality checking is enabled
+     */
+    bool isLinkQualityEnabled() const { return linkQualityMaxRtt.count() > 0 || linkQualityMaxLoss < 1.0; };
+
+    /**
+     * @brief Returns true if the probe estimates exceed the normal thresholds, or the recovery thresholds if ethernetDegraded
+     * 
+     * Also clears ethernetDegraded once the recovery thresholds have been met.
+     */
+    bool checkLinkQualityDegraded();
+
+    /**
+     * @brief Reads the Ethernet link status if link monitoring is enabled and the link check period has elapsed
+     * 
+     * Updates ethernetLinkStatus, sets ethernetLinkCameUp and ethernetLinkCameUpTime if the link 
+     * went from down to up, and clears ethernetLinkCameUp if it went down again.
+     */
+    void checkEthernetLink();
+
+    /**
+     * @brief Default link status function using the lower-up flag of the Ethernet network interface
+     * 
+     * @return 1 if the link is up, 0 if it's down, or -1 if unknown
+     */
+    static int readEthernetLinkStatus();
+
+    /**
+     * @brief Entry in the state table
+     */
+    struct StateTableEntry {
+        void (EthernetCellular::*handler)();                        //!< State handler method, like stateStart
+        const char *name;                                           //!< State name, for logging and diagnostics
+        std::chrono::milliseconds EthernetCellular::*timeout;       //!< Member variable holding the state timeout, or nullptr for none
     };
 
     /**
-     * @brief Gets the singleton instance of this class, allocating it if necessary
+     * @brief State table, indexed by State
      * 
-     * Use EthernetCellular::instance() to instantiate the singleton.
+     * This is constant-initialized, so it's stored in flash and calling a state handler does not
+     * require any allocation.
      */
-    static EthernetCellular &instance();
+    static const StateTableEntry stateTable[];
 
     /**
-     * @brief Perform setup operations; call this from global application setup()
-     * 
-     * You typically use EthernetCellular::instance().setup();
+     * @brief Current state; the handler is stateTable[state].handler
      */
-    void setup();
+    State state = State::START;
 
     /**
-     * @brief Perform application loop operations; call this from global application loop()
-     * 
-     * You typically use EthernetCellular::instance().loop();
+     * @brief millis() value when the current state was entered, for statistics
      */
-    void loop();
+    unsigned long stateEnterTime = 0;
 
     /**
-     * @brief Set an Ethernet keep-alive value (default: 25 seconds)
-     * 
-     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
-     * 
-     * When the network is Ethernet, a keep-alive is required to keep the UDP port forwarding active so the
-     * cloud can communicate with the device. This could be as short as 30 seconds or be minutes or even
-     * hours. Since the data in Ethernet is rarely metered, this defaults to 25 seconds but can be made
-     * longer on a site-specific basis.
-     * 
-     * If the limit is too long, at the end of the period the cloud will not longer be able to communicate
-     * with the device if the connection is otherwise idle.
-     * 
-     * If you are publishing, reading variables, or calling functions, this will reset the keep-alive timer
-     * so if you are frequently sending data they keep-alive may never be reached.
-     * 
-     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
-     * like:
-     * 
-     * ```
-     * int keepAliveSec = 300;
-     * 
-     * EthernetCellular::instance().withEthernetKeepAlive(std::chrono::seconds(keepAliveSec));
-     * ```
+     * @brief millis() value when stateTryEthernet or stateTryCellular was last entered
      */
-    EthernetCellular &withEthernetKeepAlive(std::chrono::seconds value) { ethernetKeepAlive = value; return *this; };
+    unsigned long tryInterfaceTime = 0;
 
     /**
-     * @brief Returns the Ethernet keep-alive value (in seconds)
+     * @brief millis() value when Particle.connected() last became false
      */
-    int getEthernetKeepAlive() const { return (int)ethernetKeepAlive.count(); };
+    unsigned long cloudDownStartTime = 0;
 
     /**
-     * @brief Set an cellular keep-alive value (default: 23 minutes)
-     * 
-     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
-     * 
-     * When the network is cellular, a keep-alive is required to keep the UDP port forwarding active so the
-     * cloud can communicate with the device. This rarely needs to be set when using the Particle SIM, 
-     * but is almost certainly required for a 3rd-party SIM. With a 3rd-party SIM the value could be as low 
-     * as 30 seconds, but could be a few minutes.
-     * 
-     * If the limit is too long, at the end of the period the cloud will not longer be able to communicate
-     * with the device if the connection is otherwise idle.
-     * 
-     * If you are publishing, reading variables, or calling functions, this will reset the keep-alive timer
-     * so if you are frequently sending data they keep-alive may never be reached.
-     * 
-     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
-     * like:
-     * 
-     * ```
-     * int keepAliveSec = 300;
-     * 
-     * EthernetCellular::instance().withEthernetKeepAlive(std::chrono::seconds(keepAliveSec));
-     * ```
+     * @brief Particle.connected() as of the last updateCloudDown() call
      */
-    EthernetCellular &withCellularKeepAlive(std::chrono::seconds value) { cellularKeepAlive = value; return *this; };
+    bool cloudUp = false;
 
     /**
-     * @brief Returns the cellular keep-alive value (in seconds)
+     * @brief Failover statistics
      */
-    int getCellularKeepAlive() const { return (int)cellularKeepAlive.count(); };
+    Stats stats;
 
     /**
-     * @brief Set the period to try switching back to Ethernet from cellular. Default: 5 minutes.
-     * 
-     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
-     * 
-     * Because the Ethernet and cellular networks cannot be on at the same time, after switching to cellular
-     * backup we need to periodically switch back to Ethernet to see if it's back up. This will interrupt
-     * network connectivity for a short period of time, so you don't want to make it too short. However,
-     * you also won't switch back until this period is reached, so you'll stay on backup longer than 
-     * necessary if you set it too long. The default is 5 minutes.
-     * 
-     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
-     * like:
-     * 
-     * ```
-     * int retryEthernetSecs = 300;
-     * 
-     * EthernetCellular::instance().withRetryEthernetPeriod(std::chrono::milliseconds(retryEthernetSecs));
-     * ```
-     */ 
-    EthernetCellular &withRetryEthernetPeriod(std::chrono::milliseconds value) { retryEthernetPeriod = value; return *this; };
+     * @brief Only run the state machine on system events or deadlines (default: false)
+     */
+    bool eventDriven = false;
 
     /**
-     * @brief Returns the  period to try switching back to Ethernet from cellular (in milliseconds)
+     * @brief Maximum time between state machine checks in event-driven mode (default: 10 seconds)
      */
-    int getRetryEthernetPeriod() const { return (int)retryEthernetPeriod.count(); };
+    std::chrono::milliseconds eventDrivenMaxIdle = 10s;
 
     /**
-     * @brief Set the maximum time to connect to cellular (blinking green). Default: 5 minutes.
-     * 
-     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
-     * 
-     * The recommended value is from 5 to 10 minutes. Setting it to short values may prevent ever being able to connect
-     * to cellular.
-     * 
-     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
-     * like:
-     * 
-     * ```
-     * int timeoutMillisecs = 60000;
-     * 
-     * EthernetCellular::instance().withCellularConnectTimeout(std::chrono::milliseconds(timeoutMillisecs));
-     * ```
-     */ 
-    EthernetCellular &withCellularConnectTimeout(std::chrono::milliseconds value) { cellularConnectTimeout = value; return *this; };
+     * @brief Set from the system event handler when a network or cloud event has occurred
+     */
+    std::atomic<bool> eventPending{true};
 
     /**
-     * @brief Returns the maximum time to connect to cellular (blinking green) (in milliseconds)
+     * @brief Called when the state machine needs to run again soon (see withWakeCallback())
      */
-    int getCellularConnectTimeout() const { return (int)cellularConnectTimeout.count(); };
+    std::function<void()> wakeCallback = nullptr;
 
     /**
-     * @brief Set the maximum time to connect to the cloud while connected to cellular (blinking cyan). Default: 2 minutes.
-     * 
-     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
-     * 
-     * The default is 2 minutes. It's normally fast, but in areas with low signal strength it make take longer.
-     * 
-     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
-     * like:
-     * 
-     * ```
-     * int timeoutMillisecs = 60000;
-     * 
-     * EthernetCellular::instance().withCellularCloudConnectTimeout(std::chrono::milliseconds(timeoutMillisecs));
-     * ```
-     */ 
-    EthernetCellular &withCellularCloudConnectTimeout(std::chrono::milliseconds value) { cellularCloudConnectTimeout = value; return *this; };
+     * @brief How often the worker thread checks the status for the wake callback, or 0 to not poll (default: 1 second)
+     */
+    std::chrono::milliseconds wakePollPeriod = 1s;
 
     /**
-     * @brief Returns the maximum time to connect to the cloud while connected to cellular (blinking cyan) (in milliseconds)
+     * @brief How often to poll an in-progress DNS lookup or TCP check (default: 100 milliseconds)
      */
-    int getCellularCloudConnectTimeout() const { return (int)cellularCloudConnectTimeout.count(); };
+    std::chrono::milliseconds socketPollPeriod = 100ms;
 
     /**
-     * @brief Set the maximum time to connect to Ethernet (blinking green). Default: 30 seconds.
-     * 
-     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
-     * 
-     * This should normally be really fast, but if for some reason your Ethernet network takes a long
-     * time to establish a connection you could make the timeout longer.
-     * 
-     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
-     * like:
-     * 
-     * ```
-     * int timeoutMillisecs = 60000;
-     * 
-     * EthernetCellular::instance().withEthernetConnectTimeout(std::chrono::milliseconds(timeoutMillisecs));
-     * ```
-     */ 
-    EthernetCellular &withEthernetConnectTimeout(std::chrono::milliseconds value) { ethernetConnectTimeout = value; return *this; };
+     * @brief Status bits from the last checkStatusChange() call
+     */
+    uint8_t lastStatus = 0;
 
     /**
-     * @brief Returns the maximum time to connect to Ethernet (blinking green) (in milliseconds)
+     * @brief millis() value when the state handler was last run in event-driven mode
      */
-    int getEthernetConnectTimeout() const { return (int)ethernetConnectTimeout.count(); };
+    unsigned long lastRunTime = 0;
 
     /**
-     * @brief Set the maximum time to connect to the cloud while connected to Ethernet (blinking cyan). Default: 30 seconds.
-     * 
-     * @param value The value as a chrono-literal, such as 25s for 25 seconds or 5min for 5 minutes.
-     * 
-     * The default is 30 seconds. It should normally only take a few seconds.
-     * 
-     * If you want to pass in a regular integer (`int`) instead of a chrono literal, you can use a construct
-     * like:
-     * 
-     * ```
-     * int timeoutMillisecs = 60000;
-     * 
-     * EthernetCellular::instance().withEthernetCloudConnectTimeout(std::chrono::milliseconds(timeoutMillisecs));
-     * ```
-     */ 
-    EthernetCellular &withEthernetCloudConnectTimeout(std::chrono::milliseconds value) { ethernetCloudConnectTimeout = value; return *this; };
+     * @brief Milliseconds after lastRunTime when the state handler needs to run again in event-driven mode
+     */
+    unsigned long runDelay = 0;
 
     /**
-     * @brief Returns the maximum time to connect to the cloud while connected to Ethernet (blinking cyan) (in milliseconds)
+     * @brief Run the state machine from a worker thread (default: false)
      */
-    int getEthernetCloudConnectTimeout() const { return (int)ethernetCloudConnectTimeout.count(); };
+    bool threadMode = false;
 
     /**
-     * @brief Sets the status LED color when using cellular backup, replacing blinking or breathing cyan (default: yellow)
-     * 
-     * @param value Color value, such as RGB_COLOR_CYAN, RGB_COLOR_YELLOW, or RGB_COLOR_ORANGE
-     * 
-     * When switching to cellular backup, the cloud connection color (typically blinking cyan, followed
-     * by breathing cyan) can be overridden. The default in this class is to use yellow (blinking yellow
-     * followed by breathing yellow) when on cellular backup so you can tell it's on backup, and that 
-     * color is not currently used by Device OS.
-     * 
-     * If you don't want the status LED color to be overridden, make this call with no parameter or
-     * use `RGB_COLOR_CYAN` to use the Device OS default.
-     * 
-     * Note that this does not override the blinking green (connecting to network) which will be blinking green
-     * for both cellular and Ethernet, however it's normally not in this state for very long and there are
-     * only so many available colors.
+     * @brief How often the worker thread runs the state machine (default: 50 milliseconds)
      */
-    EthernetCellular &withCellularBackupColor(uint32_t value = RGB_COLOR_CYAN) { cellularBackupColor = value; return *this; };
+    std::chrono::milliseconds threadPeriod = 50ms;
 
     /**
-     * @brief Returns the status LED color when using cellular backup
-     * 
-     * Value is an RGB color as a uint32_t of the form 0x00RRGGBB, matching the format of constants like
-     * RGB_COLOR_CYAN, RGB_COLOR_YELLOW, or RGB_COLOR_ORANGE.
+     * @brief Worker thread stack size in bytes (default: 3072)
      */
-    uint32_t getCellularBackupColor() const { return cellularBackupColor; };
+    size_t threadStackSize = 3072;
 
     /**
-     * @brief Returns the enumeration for the currently active interface (NONE, CELLULAR, or ETHERNET)
+     * @brief Deliver callbacks from loop() instead of the state machine (default: false)
      */
-    ActiveInterface getActiveInterface() const { return activeInterface; };
+    bool asyncCallbacks = false;
 
     /**
-     * @brief Sets a notification callback for when the active interface changes
+     * @brief Number of events in callbackQueue (default: 8)
+     */
+    size_t callbackQueueSize = 8;
+
+    /**
+     * @brief Async callback queue, allocated in setup()
      * 
-     * You can only have one interface change callback.
+     * This is a single-producer (state machine), single-consumer (loop()) ring buffer, so the 
+     * state machine never waits on the application. callbackQueueWrite and callbackQueueRead only 
+     * ever increase; the slot is the value modulo callbackQueueSize.
      */
-    EthernetCellular &withInterfaceChangeCallback(std::function<void(ActiveInterface oldInterface, ActiveInterface newInterface)> callback) {
-        interfaceChangeCallback = callback;
-        return *this;
-    }
+    CallbackEvent *callbackQueue = nullptr;
+
+    std::atomic<uint32_t> callbackQueueWrite{0};    //!< Number of events posted to callbackQueue
+    std::atomic<uint32_t> callbackQueueRead{0};     //!< Number of events delivered from callbackQueue
 
-protected:
     /**
-     * @brief The constructor is protected because the class is a singleton
+     * @brief Interface change coalesced because callbackQueue was full
      * 
-     * Use EthernetCellular::instance() to instantiate the singleton.
+     * 0 if none, otherwise CALLBACK_OVERFLOW_PENDING | (oldInterface << 8) | newInterface. It's 
+     * updated with compare-and-exchange so the consumer can take it without a lock.
      */
-    EthernetCellular();
+    std::atomic<uint32_t> callbackOverflow{0};
 
     /**
-     * @brief The destructor is protected because the class is a singleton and cannot be deleted
+     * @brief Flag in callbackOverflow indicating a coalesced interface change is pending
      */
-    virtual ~EthernetCellular();
+    static const uint32_t CALLBACK_OVERFLOW_PENDING = 0x80000000;
 
     /**
-     * This class is a singleton and cannot be copied
+     * @brief Number of async callback events coalesced or discarded
      */
-    EthernetCellular(const EthernetCellular&) = delete;
+    std::atomic<uint32_t> callbackOverflowCount{0};
 
     /**
-     * This class is a singleton and cannot be copied
+     * @brief The worker thread, allocated in setup() in thread mode
      */
-    EthernetCellular& operator=(const EthernetCellular&) = delete;
+    Thread *thread = nullptr;
 
     /**
-     * @brief Sets the active interface and calls the notification handler if necessary
-     * 
-     * Internal use only
+     * @brief Mutex held while running the state machine and reading statistics
      */
-    void setActiveInterface(ActiveInterface newActiveInterface);
+    mutable RecursiveMutex mutex;
+
+    /**
+     * @brief Where to save persistentData (default: PersistentStorage::NONE)
+     */
+    PersistentStorage persistentStorage = PersistentStorage::NONE;
+
+    /**
+     * @brief Offset in EEPROM when persistentStorage is PersistentStorage::EEPROM
+     */
+    int eepromOffset = 0;
+
+    /**
+     * @brief Working copy of the data preserved across reboots
+     */
+    PersistentData persistentData = {};
+
+    /**
+     * @brief Copy of persistentData in retained memory, used when persistentStorage is PersistentStorage::RETAINED
+     */
+    static PersistentData retainedPersistentData;
+
+    /**
+     * @brief Record state transitions in transitionLog (default: false)
+     */
+    bool transitionLogEnabled = false;
+
+    /**
+     * @brief Transition log in retained memory
+     */
+    static TransitionLog transitionLog;
+
+    /**
+     * @brief millis() value when the statistics were reset
+     */
+    unsigned long statsStartTime = 0;
+
+    /**
+     * @brief The last interface that was cloud connected, used to count switchovers
+     */
+    ActiveInterface lastConnectedInterface = ActiveInterface::NONE;
+
+    /**
+     * @brief Set during stateStart if Ethernet hardware is detected
+     */
+    bool ethernetPresent = false;
+
+    /**
+     * @brief Value from withEthernetPresent(): -1 = detect (default), 0 = not present, 1 = present
+     */
+    int8_t ethernetPresentDeclared = -1;
+
+    /**
+     * @brief Cache the detection result in persistentData (default: false)
+     */
+    bool ethernetDetectionCache = false;
+
+    /**
+     * @brief Monitor the Ethernet link for immediate failover (default: false)
+     */
+    bool ethernetLinkMonitor = false;
+
+    /**
+     * @brief How often to check the Ethernet link status (default: 250 milliseconds)
+     */
+    std::chrono::milliseconds ethernetLinkCheckPeriod = 250ms;
+
+    /**
+     * @brief How long the link must stay up before an early Ethernet retry (default: 1 minute)
+     */
+    std::chrono::milliseconds ethernetLinkStableTime = 1min;
 
     /**
-     * @brief Starting state at boot
-     * 
-     * Next state:
-     * - stateTryEthernet if Ethernet is present
-     * - stateTryCellular if no Ethernet is present
+     * @brief Function to read the link status, or nullptr for readEthernetLinkStatus()
      */
-    void stateStart();
+    std::function<int()> ethernetLinkStatusFunction = nullptr;
 
     /**
-     * @brief Starting point for switching to Ethernet
-     * 
-     * - Disconnects from Cellular
-     * - Connects to Ethernet
-     * - Sets the cloud connection RGB status LED theme to default (cyan)
-     * 
-     * Next State:
-     * - stateWaitEthernetReady (always)
+     * @brief Last link status: 1 = up, 0 = down, -1 = unknown
      */
-    void stateTryEthernet();
+    int ethernetLinkStatus = -1;
 
     /**
-     * @brief Waits until Ethernet is ready or times out
-     * 
-     * If ready:
-     * - Does a Particle.connect to reconnect to the Particle cloud
-     * 
-     * Next State:
-     * - stateWaitEthernetCloud if ready
-     * - stateTryCellular if ethernetConnectTimeout is reached without ready
+     * @brief millis() value when the link status was last read
      */
-    void stateWaitEthernetReady();
+    unsigned long ethernetLinkCheckTime = 0;
 
     /**
-     * @brief Waits until cloud connected while on Ethernet
-     * 
-     * If connected;
-     * - Sets the keep-alive to ethernetKeepAlive
-     * 
-     * Next State:
-     * - stateEthernetCloudConnected if connected to the Particle cloud
-     * - stateTryCellular if timeout of ethernetCloudConnectTimeout is reached
-     * 
-     * This is separate from connecting to Ethernet, because it's possible for 
-     * Ethernet to be ready if the local LAN is up, but not be able to reach 
-     * the Particle cloud if the Internet connection to the LAN is down. 
+     * @brief Set when the link goes from down to up, cleared when it goes down or an Ethernet retry starts
      */
-    void stateWaitEthernetCloud();
+    bool ethernetLinkCameUp = false;
 
     /**
-     * @brief State for when cloud connected
-     * 
-     * Next State;
-     * - stateWaitEthernetCloud if cloud connection is lost
+     * @brief millis() value when ethernetLinkCameUp was set
      */
-    void stateEthernetCloudConnected();
-
+    unsigned long ethernetLinkCameUpTime = 0;
 
     /**
-     * @brief Starting point for switching to cellular
-     * 
-     * - Disconnects from Ethernet
-     * - Connects to cellular
-     * - Sets the cloud connection RGB status LED theme
-     * 
-     * Next State:
-     * - stateWaitCellularReady (always)
+     * @brief true if withEthernetStaticAddress() was used
      */
-    void stateTryCellular();
+    bool ethernetStatic = false;
 
+    IPAddress ethernetStaticAddress;        //!< Static address set by withEthernetStaticAddress()
+    IPAddress ethernetStaticSubnetMask;     //!< Static subnet mask set by withEthernetStaticAddress()
+    IPAddress ethernetStaticGateway;        //!< Static gateway set by withEthernetStaticAddress()
+    IPAddress ethernetStaticDns;            //!< Static DNS server set by withEthernetStaticAddress()
 
     /**
-     * @brief Waits until cellular is ready or times out
-     * 
-     * If ready:
-     * - Does a Particle.connect to reconnect to the Particle cloud
-     * 
-     * Next State:
-     * - stateWaitCellularCloud if ready
-     * - stateTryEthernet if cellularConnectTimeout is reached without ready and ethernetPresent is true
-     * 
-     * If there is no Ethernet controller, this state will be remained in forever until
-     * connected to cellular.
+     * @brief Reuse the last address from DHCP (default: false)
      */
-    void stateWaitCellularReady();
+    bool ethernetLeaseReuse = false;
 
     /**
-     * @brief Waits until cloud connected while on cellular
-     * 
-     * If connected;
-     * - Sets the keep-alive to cellularKeepAlive
-     * 
-     * Next State:
-     * - stateCellularCloudConnected if connected to the Particle cloud
-     * - stateTryEthernet if cellularConnectTimeout is reached without ready and ethernetPresent is true
+     * @brief Maximum age of a saved DHCP address to reuse, 0 for no limit
      */
-    void stateWaitCellularCloud();
+    std::chrono::seconds ethernetLeaseMaxAge = 1h;
 
     /**
-     * @brief State for when cloud is connected via cellular
-     * 
-     * Next State;
-     * - stateWaitCellularCloud if cloud connection is lost
-     * - stateCellularWaitDisconnectedThenTryEthernet if retryEthernetPeriod is reached and ethernetPresent is true
+     * @brief true if setEthernetConfig() has set a configuration since boot
      */
-    void stateCellularCloudConnected();
+    bool ethernetConfigSet = false;
+
+    IPAddress ethernetConfigAddress;        //!< Address last set by setEthernetConfig(), empty for DHCP
+    IPAddress ethernetConfigSubnetMask;     //!< Subnet mask last set by setEthernetConfig()
+    IPAddress ethernetConfigGateway;        //!< Gateway last set by setEthernetConfig()
+    IPAddress ethernetConfigDns;            //!< DNS server last set by setEthernetConfig()
 
     /**
-     * @brief Waits for Particle.connected to be false then tries Ethernet again
-     * 
-     * Next state: 
-     * - stateTryEthernet after Particle.connected() is false
+     * @brief true if the current Ethernet attempt is using the saved DHCP address
      */
-    void stateCellularWaitDisconnectedThenTryEthernet();
+    bool ethernetUsingSavedLease = false;
 
     /**
-     * @brief State handler method
-     * 
-     * This is one of the protected methods like stateStart.
+     * @brief millis() value when the Ethernet link came up in the current attempt, 0 if not yet
      */
-    std::function<void(EthernetCellular &)> stateHandler = &EthernetCellular::stateStart;
+    unsigned long ethernetLinkUpMillis = 0;
 
     /**
-     * @brief Set during stateStart if Ethernet hardware is detected
+     * @brief millis() value when Ethernet became ready in the current attempt, 0 if not yet or already
+     * recorded in stats.ethernetTiming
      */
-    bool ethernetPresent = false;
+    unsigned long ethernetReadyMillis = 0;
 
     /**
      * @brief Used for determining how long to wait in a state
@@ -525,6 +3529,21 @@ protected:
      */
     std::chrono::seconds cellularKeepAlive = 23min;
 
+    /**
+     * @brief Learns the Ethernet keep-alive, disabled by default
+     */
+    EthernetCellularKeepAliveLearner ethernetKeepAliveLearner;
+
+    /**
+     * @brief Learns the cellular keep-alive, disabled by default
+     */
+    EthernetCellularKeepAliveLearner cellularKeepAliveLearner;
+
+    /**
+     * @brief Hash of the withKeepAliveNetworkId() value, or 0 if not set
+     */
+    uint32_t keepAliveNetworkId = 0;
+
     /**
      * Period to try switching back to Ethernet from cellular. Default: 5 minutes.
      *      * 
@@ -536,6 +3555,183 @@ protected:
      */ 
     std::chrono::milliseconds retryEthernetPeriod = 5min;
 
+    /**
+     * @brief Bring up Ethernet in the background before dropping cellular (default: false)
+     * 
+     * Requires a version of Device OS that allows more than one network interface up at once.
+     */
+    bool makeBeforeBreak = false;
+
+    /**
+     * @brief Host to make a TCP connection to, to check Internet reachability over Ethernet
+     */
+    String reachabilityHost = "api.particle.io";
+
+    /**
+     * @brief TCP port on reachabilityHost to connect to
+     */
+    uint16_t reachabilityPort = 443;
+
+    /**
+     * @brief Maximum time for the reachability check, including the DNS lookup
+     */
+    std::chrono::milliseconds reachabilityTimeout = 10s;
+
+    /**
+     * @brief Reachability check over Ethernet, in progress in CELLULAR_CHECK_ETHERNET_REACHABILITY
+     */
+    EthernetCellularTcpCheck reachabilityCheck;
+
+    /**
+     * @brief DNS server for the library's own lookups when the interface does not have one
+     */
+    IPAddress dnsServer = IPAddress(8, 8, 8, 8);
+
+    /**
+     * @brief Internet reachability probe used while cloud connected over Ethernet
+     */
+    EthernetCellularProbe probe;
+
+    /**
+     * @brief DNS cache filled in after each interface change
+     */
+    EthernetCellularDnsCache dnsCache;
+
+    /**
+     * @brief Maximum smoothed probe round-trip time on Ethernet, or 0 to disable
+     */
+    std::chrono::milliseconds linkQualityMaxRtt = 0ms;
+
+    /**
+     * @brief Maximum smoothed probe loss on Ethernet, or 1.0 to disable
+     */
+    float linkQualityMaxLoss = 1.0;
+
+    /**
+     * @brief Maximum smoothed round-trip time after Ethernet was degraded, or 0 for half of linkQualityMaxRtt
+     */
+    std::chrono::milliseconds linkQualityRecoveryRtt = 0ms;
+
+    /**
+     * @brief Maximum smoothed loss after Ethernet was degraded, or negative for half of linkQualityMaxLoss
+     */
+    float linkQualityRecoveryLoss = -1.0;
+
+    /**
+     * @brief Number of probes before the link quality is evaluated
+     */
+    int linkQualityMinSamples = 5;
+
+    /**
+     * @brief true if the last switch to cellular was because Ethernet was degraded
+     */
+    bool ethernetDegraded = false;
+
+    /**
+     * @brief Time to make the reachability TCP connection in the last reachability check (milliseconds)
+     */
+    unsigned long reachabilityConnectTime = 0;
+
+    /**
+     * @brief Number of probes in a row that must fail to switch to cellular (default: 3)
+     */
+    int probeFailureThreshold = 3;
+
+    /**
+     * @brief What to do with the cellular modem while on Ethernet (default: CellularStandby::NONE)
+     */
+    CellularStandby cellularStandby = CellularStandby::NONE;
+
+    /**
+     * @brief Backoff and flap damping for Ethernet retries
+     */
+    EthernetCellularRetryPolicy retryPolicy;
+
+    /**
+     * @brief Number of beginCriticalSection() calls without a matching endCriticalSection()
+     */
+    std::atomic<int> criticalSectionCount{0};
+
+    /**
+     * @brief Maximum time to postpone an Ethernet retry for a critical section (default: 5 minutes)
+     */
+    std::chrono::milliseconds maxCriticalSectionDeferral = 5min;
+
+    /**
+     * @brief Time into the retry Ethernet period to resume at when cloud connected after sleep (milliseconds)
+     */
+    unsigned long resumeRetryElapsed = 0;
+
+    /**
+     * @brief How long after prepareForSleep() the saved decision is kept without resumeFromSleep()
+     */
+    std::chrono::milliseconds sleepResumeTimeout = 1min;
+
+    /**
+     * @brief true if prepareForSleep() was called since boot and the decision has not been used or discarded
+     */
+    bool sleepPrepared = false;
+
+    /**
+     * @brief millis() value when the sleep resume timeout started
+     */
+    unsigned long sleepPrepareMillis = 0;
+
+    /**
+     * @brief millis() value of the last checkSleepResumeTimeout() call
+     */
+    unsigned long sleepCheckMillis = 0;
+
+    /**
+     * @brief Number of beginCloudOperation() calls without a matching endCloudOperation()
+     */
+    std::atomic<int> cloudOperationCount{0};
+
+    /**
+     * @brief Maximum time to wait for cloud operations to end before disconnecting (default: 10 seconds)
+     */
+    std::chrono::milliseconds drainTimeout = 10s;
+
+    /**
+     * @brief Called before the current interface is torn down (see withBeforeInterfaceChangeCallback())
+     */
+    std::function<void(ActiveInterface currentInterface, ActiveInterface plannedInterface, std::chrono::milliseconds deadline)> beforeInterfaceChangeCallback = nullptr;
+
+    /**
+     * @brief Maximum time to wait for interfaceChangeReady() (default: 5 seconds)
+     */
+    std::chrono::milliseconds beforeInterfaceChangeTimeout = 5s;
+
+    /**
+     * @brief true if the before interface change callback was called and interfaceChangeReady() has not been called yet
+     */
+    std::atomic<bool> interfaceChangeReadyPending{false};
+
+    /**
+     * @brief true if an Ethernet retry is being postponed by a critical section
+     */
+    bool criticalSectionDeferring = false;
+
+    /**
+     * @brief millis() value when the Ethernet retry started being postponed
+     */
+    unsigned long criticalSectionDeferStart = 0;
+
+    /**
+     * @brief Called before an Ethernet retry tears down the cellular cloud connection
+     */
+    std::function<void(std::chrono::milliseconds remaining)> switchPendingCallback = nullptr;
+
+    /**
+     * @brief How long before an Ethernet retry to call switchPendingCallback (default: 10 seconds)
+     */
+    std::chrono::milliseconds switchPendingNotice = 10s;
+
+    /**
+     * @brief true if switchPendingCallback has been called for the current retry period
+     */
+    bool switchPendingNotified = false;
+
     /**
      * @brief The maximum time to connect to cellular (blinking green). Default: 5 minutes.
      * 
@@ -584,6 +3780,107 @@ protected:
      */    
     uint32_t cellularBackupColor = RGB_COLOR_YELLOW;
 
+    /**
+     * @brief Backup interfaces in order of priority, set with withBackupInterfaces()
+     */
+    std::vector<ActiveInterface> backupInterfaces;
+
+    /**
+     * @brief Index into backupInterfaces of the backup interface being used or tried
+     */
+    size_t backupIndex = 0;
+
+    /**
+     * @brief Connect timeout for the backup interface being tried, used by the state table
+     */
+    std::chrono::milliseconds backupConnectTimeout = 5min;
+
+    /**
+     * @brief Profiles added with withTimeoutProfile()
+     */
+    std::vector<NamedTimeoutProfile> timeoutProfiles;
+
+    /**
+     * @brief Name of the Particle function to select a profile, or nullptr for none
+     */
+    const char *timeoutProfileFunctionName = nullptr;
+
+    /**
+     * @brief Adaptive cellular connect timeout multiplier, 0 = disabled
+     */
+    float adaptiveCellularMultiplier = 0.0;
+
+    /**
+     * @brief Minimum adaptive cellular connect timeout (default: 1 minute)
+     */
+    std::chrono::milliseconds adaptiveCellularMinTimeout = 1min;
+
+    /**
+     * @brief true if the modem has been reset in the current cellular attempt
+     */
+    bool cellularModemReset = false;
+
+    /**
+     * @brief millis() value when the adaptive timeout modem reset powered off the modem, 0 if not waiting for it to turn off
+     */
+    unsigned long cellularModemOffTime = 0;
+
+    /**
+     * @brief Maximum time to wait for the modem to turn off when resetting it (30 seconds)
+     */
+    const std::chrono::milliseconds cellularModemOffTimeout = 30s;
+
+    /**
+     * @brief true if the backup interface was already ready when stateTryCellular connected it
+     */
+    bool backupWasReady = false;
+
+    /**
+     * @brief millis() value when cellular became ready in the current attempt, 0 if it was already ready
+     * (standby), not yet ready, or already recorded in stats.cellularTiming
+     */
+    unsigned long backupReadyMillis = 0;
+
+    /**
+     * @brief Name of the profile last applied
+     */
+    const char *timeoutProfileName = "default";
+
+    /**
+     * @brief Profile saved by applyTimeoutProfile() to apply at the next state transition
+     */
+    TimeoutProfile pendingTimeoutProfile;
+
+    /**
+     * @brief Name of pendingTimeoutProfile
+     */
+    const char *pendingTimeoutProfileName = nullptr;
+
+    /**
+     * @brief true if pendingTimeoutProfile needs to be applied
+     */
+    bool timeoutProfilePending = false;
+
+    /**
+     * @brief Cloud connect timeout for the backup interface being tried, used by the state table
+     */
+    std::chrono::milliseconds backupCloudConnectTimeout = 2min;
+
+    /**
+     * @brief The maximum time to connect to Wi-Fi as a backup (default: 1 minute)
+     */
+    std::chrono::milliseconds wifiConnectTimeout = 1min;
+
+    /**
+     * @brief The maximum time to connect to the cloud over Wi-Fi as a backup (default: 1 minute)
+     */
+    std::chrono::milliseconds wifiCloudConnectTimeout = 1min;
+
+    /**
+     * @brief Wi-Fi keep-alive value (default: 25 seconds)
+     */
+    std::chrono::seconds wifiKeepAlive = 25s;
+
     /**
      * @brief The currently active interface
      */
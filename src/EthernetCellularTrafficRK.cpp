@@ -0,0 +1,117 @@
+#include "EthernetCellularTrafficRK.h"
+
+static void countTx(EthernetCellular::ActiveInterface iface, int bytes) {
+    if (bytes > 0) {
+        EthernetCellular::instance().countTraffic(iface, (uint32_t)bytes, 1, 0, 0);
+    }
+}
+
+static void countRx(EthernetCellular::ActiveInterface iface, int bytes) {
+    if (bytes > 0) {
+        EthernetCellular::instance().countTraffic(iface, 0, 0, (uint32_t)bytes, 1);
+    }
+}
+
+EthernetCellular::ActiveInterface EthernetCellularTCPClient::connectionInterface() {
+    if (iface == EthernetCellular::ActiveInterface::NONE) {
+        // Nothing was active at connect() time, use the interface it went out on
+        iface = EthernetCellular::instance().interfaceForNif(0);
+    }
+    return iface;
+}
+
+int EthernetCellularTCPClient::connect(IPAddress ip, uint16_t port, network_interface_t nif) {
+    iface = EthernetCellular::instance().interfaceForNif(nif);
+    return TCPClient::connect(ip, port, nif);
+}
+
+int EthernetCellularTCPClient::connect(const char *host, uint16_t port, network_interface_t nif) {
+    iface = EthernetCellular::instance().interfaceForNif(nif);
+    return TCPClient::connect(host, port, nif);
+}
+
+size_t EthernetCellularTCPClient::write(uint8_t b) {
+    writeDepth++;
+    size_t result = TCPClient::write(b);
+    if (--writeDepth == 0) {
+        countTx(connectionInterface(), (int)result);
+    }
+    return result;
+}
+
+size_t EthernetCellularTCPClient::write(const uint8_t *buffer, size_t size) {
+    writeDepth++;
+    size_t result = TCPClient::write(buffer, size);
+    if (--writeDepth == 0) {
+        countTx(connectionInterface(), (int)result);
+    }
+    return result;
+}
+
+size_t EthernetCellularTCPClient::write(const uint8_t *buffer, size_t size, system_tick_t timeout) {
+    writeDepth++;
+    size_t result = TCPClient::write(buffer, size, timeout);
+    if (--writeDepth == 0) {
+        countTx(connectionInterface(), (int)result);
+    }
+    return result;
+}
+
+int EthernetCellularTCPClient::read() {
+    readDepth++;
+    int result = TCPClient::read();
+    if (--readDepth == 0 && result >= 0) {
+        countRx(connectionInterface(), 1);
+    }
+    return result;
+}
+
+int EthernetCellularTCPClient::read(uint8_t *buffer, size_t size) {
+    readDepth++;
+    int result = TCPClient::read(buffer, size);
+    if (--readDepth == 0) {
+        countRx(connectionInterface(), result);
+    }
+    return result;
+}
+
+uint8_t EthernetCellularUDP::begin(uint16_t port, network_interface_t nif) {
+    this->nif = nif;
+    return UDP::begin(port, nif);
+}
+
+int EthernetCellularUDP::sendPacket(const uint8_t *buffer, size_t size, IPAddress destination, uint16_t port) {
+    sendDepth++;
+    int result = UDP::sendPacket(buffer, size, destination, port);
+    if (--sendDepth == 0) {
+        countTx(packetInterface(), result);
+    }
+    return result;
+}
+
+int EthernetCellularUDP::receivePacket(uint8_t *buffer, size_t size, system_tick_t timeout) {
+    receiveDepth++;
+    int result = UDP::receivePacket(buffer, size, timeout);
+    if (--receiveDepth == 0) {
+        countRx(packetInterface(), result);
+    }
+    return result;
+}
+
+int EthernetCellularUDP::endPacket() {
+    sendDepth++;
+    int result = UDP::endPacket();
+    if (--sendDepth == 0) {
+        countTx(packetInterface(), result);
+    }
+    return result;
+}
+
+int EthernetCellularUDP::parsePacket(system_tick_t timeout) {
+    receiveDepth++;
+    int result = UDP::parsePacket(timeout);
+    if (--receiveDepth == 0) {
+        countRx(packetInterface(), result);
+    }
+    return result;
+}
@@ -0,0 +1,146 @@
+#ifndef __ETHERNETCELLULARTRAFFICRK_H
+#define __ETHERNETCELLULARTRAFFICRK_H
+
+#include "EthernetCellularRK.h"
+
+/**
+ * @brief TCPClient that counts bytes sent and received per interface
+ *
+ * Use this instead of TCPClient for your own (non-cloud) TCP connections. It works the same as
+ * TCPClient, and adds the traffic to the ethernetTraffic, cellularTraffic, or wifiTraffic counters in
+ * EthernetCellular::getStats().
+ *
+ * If you pass an interface to connect(), such as Ethernet, traffic is counted for that interface.
+ * Otherwise it's counted for the interface that was active when connect() was called, since the
+ * connection stays on that interface even if the library switches the active interface later.
+ *
+ * TCP does not expose packets to the application, so the packet counts are the number of write
+ * calls and the number of read calls that returned data.
+ */
+class EthernetCellularTCPClient : public TCPClient {
+public:
+    /**
+     * @brief Connect to a server by IP address, optionally using a specific interface
+     */
+    virtual int connect(IPAddress ip, uint16_t port, network_interface_t nif = 0);
+
+    /**
+     * @brief Connect to a server by host name, optionally using a specific interface
+     */
+    virtual int connect(const char *host, uint16_t port, network_interface_t nif = 0);
+
+    /**
+     * @brief Write a single byte
+     */
+    virtual size_t write(uint8_t b);
+
+    /**
+     * @brief Write a buffer of bytes
+     */
+    virtual size_t write(const uint8_t *buffer, size_t size);
+
+    /**
+     * @brief Write a buffer of bytes with a timeout
+     */
+    virtual size_t write(const uint8_t *buffer, size_t size, system_tick_t timeout);
+
+    /**
+     * @brief Read a single byte, or -1 if none are available
+     */
+    virtual int read();
+
+    /**
+     * @brief Read into a buffer, returning the number of bytes read
+     */
+    virtual int read(uint8_t *buffer, size_t size);
+
+    using TCPClient::write;
+    using TCPClient::read;
+
+protected:
+    /**
+     * @brief Interface to count traffic for, resolved in connect()
+     */
+    EthernetCellular::ActiveInterface iface = EthernetCellular::ActiveInterface::NONE;
+
+    /**
+     * @brief Returns the interface to count traffic for, resolving it now if nothing was active at connect() time
+     */
+    EthernetCellular::ActiveInterface connectionInterface();
+
+    /**
+     * @brief Nesting depth of write calls, so writes that call other writes are only counted once
+     */
+    int writeDepth = 0;
+
+    /**
+     * @brief Nesting depth of read calls, so reads that call other reads are only counted once
+     */
+    int readDepth = 0;
+};
+
+/**
+ * @brief UDP that counts bytes and packets sent and received per interface
+ *
+ * Use this instead of UDP for your own UDP traffic. It works the same as UDP, and adds the
+ * traffic to the ethernetTraffic, cellularTraffic, or wifiTraffic counters in EthernetCellular::getStats().
+ *
+ * If you pass an interface to begin(), such as Ethernet, traffic is counted for that interface.
+ * Otherwise the socket is not bound and each packet goes over the current default route, so it's
+ * counted for the active interface at the time each packet is sent or received.
+ * Both the packet API (sendPacket, receivePacket) and the stream API (beginPacket, write,
+ * endPacket, parsePacket, read) are counted.
+ */
+class EthernetCellularUDP : public UDP {
+public:
+    /**
+     * @brief Start listening on a port, optionally using a specific interface
+     */
+    virtual uint8_t begin(uint16_t port, network_interface_t nif = 0);
+
+    /**
+     * @brief Send a packet
+     */
+    virtual int sendPacket(const uint8_t *buffer, size_t size, IPAddress destination, uint16_t port);
+
+    /**
+     * @brief Receive a packet
+     */
+    virtual int receivePacket(uint8_t *buffer, size_t size, system_tick_t timeout = 0);
+
+    /**
+     * @brief Send the packet built with beginPacket() and write()
+     */
+    virtual int endPacket();
+
+    /**
+     * @brief Receive a packet into the internal buffer, to be read with read()
+     */
+    virtual int parsePacket(system_tick_t timeout = 0);
+
+    using UDP::sendPacket;
+    using UDP::receivePacket;
+
+protected:
+    /**
+     * @brief Interface passed to begin(), or 0 for the active interface
+     */
+    network_interface_t nif = 0;
+
+    /**
+     * @brief Returns the interface to count a packet for
+     */
+    EthernetCellular::ActiveInterface packetInterface() const { return EthernetCellular::instance().interfaceForNif(nif); };
+
+    /**
+     * @brief Nesting depth of send calls, as endPacket may be implemented using sendPacket
+     */
+    int sendDepth = 0;
+
+    /**
+     * @brief Nesting depth of receive calls, as parsePacket may be implemented using receivePacket
+     */
+    int receiveDepth = 0;
+};
+
+#endif /* __ETHERNETCELLULARTRAFFICRK_H */
@@ -0,0 +1,136 @@
+#include "EthernetCellularTransitionUploaderRK.h"
+
+static Logger _log("app.ethcell");
+
+EthernetCellularTransitionUploader::EthernetCellularTransitionUploader(const char *eventName) : eventName(eventName) {
+}
+
+EthernetCellularTransitionUploader::~EthernetCellularTransitionUploader() {
+    delete[] dataBuf;
+}
+
+void EthernetCellularTransitionUploader::setup() {
+    if (!dataBuf) {
+        dataBuf = new char[maxEventDataSize + 1];
+    }
+}
+
+void EthernetCellularTransitionUploader::loop() {
+    if (!dataBuf) {
+        return;
+    }
+    EthernetCellular &ethCell = EthernetCellular::instance();
+
+    if (publishInProgress) {
+        if (!publishFuture.isDone()) {
+            return;
+        }
+        publishInProgress = false;
+        ethCell.endCloudOperation();
+
+        if (publishFuture.isSucceeded()) {
+            ethCell.setTransitionLogUploaded(inFlightEnd);
+        }
+        else {
+            _log.info("transition log publish failed, will retry");
+        }
+    }
+
+    if (getNumPending() == 0 || !canUpload()) {
+        return;
+    }
+
+    uint32_t seq = ethCell.getTransitionLogUploaded();
+    size_t count = buildPublish(seq);
+    if (count == 0) {
+        return;
+    }
+    inFlightEnd = seq + (uint32_t) count;
+    lastPublish = millis();
+    published = true;
+
+    _log.trace("transition log publishing %u records from %lu", (unsigned)count, (unsigned long)seq);
+    ethCell.beginCloudOperation();
+    publishFuture = Particle.publish(eventName, dataBuf, PRIVATE | WITH_ACK);
+    publishInProgress = true;
+}
+
+uint32_t EthernetCellularTransitionUploader::getNumPending() const {
+    EthernetCellular &ethCell = EthernetCellular::instance();
+    return ethCell.getTransitionLogCount() - ethCell.getTransitionLogUploaded();
+}
+
+bool EthernetCellularTransitionUploader::canUpload() const {
+    EthernetCellular &ethCell = EthernetCellular::instance();
+
+    std::chrono::milliseconds period;
+    switch(ethCell.getActiveInterface()) {
+        case EthernetCellular::ActiveInterface::ETHERNET:
+        case EthernetCellular::ActiveInterface::WIFI:
+            period = ethernetPeriod;
+            break;
+
+        case EthernetCellular::ActiveInterface::CELLULAR:
+            period = cellularPeriod;
+            break;
+
+        default:
+            return false;
+    }
+    if (ethCell.isDraining() || !Particle.connected()) {
+        return false;
+    }
+    return !published || millis() - lastPublish >= (unsigned long) period.count();
+}
+
+size_t EthernetCellularTransitionUploader::buildPublish(uint32_t seq) {
+    char prefix[48];
+    const char *suffix = "\"}";
+
+    // Each 3 bytes of records take 4 characters of Base64
+    size_t overhead = sizeof(prefix) + strlen(suffix);
+    if (maxEventDataSize <= overhead) {
+        return 0;
+    }
+    size_t maxRecords = ((maxEventDataSize - overhead) / 4 * 3) / sizeof(EthernetCellular::TransitionRecord);
+
+    EthernetCellular::TransitionRecord records[ETHERNETCELLULAR_TRANSITION_LOG_SIZE];
+    size_t count = 0;
+    while(count < maxRecords && count < ETHERNETCELLULAR_TRANSITION_LOG_SIZE) {
+        if (!EthernetCellular::instance().getTransitionLogRecord(seq + (uint32_t)count, records[count])) {
+            break;
+        }
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    snprintf(prefix, sizeof(prefix), "{\"seq\":%lu,\"n\":%u,\"d\":\"", (unsigned long)seq, (unsigned)count);
+    size_t prefixLen = strlen(prefix);
+    memcpy(dataBuf, prefix, prefixLen);
+    base64Encode((const uint8_t *)records, count * sizeof(EthernetCellular::TransitionRecord), &dataBuf[prefixLen]);
+    strcat(dataBuf, suffix);
+
+    return count;
+}
+
+// [static]
+void EthernetCellularTransitionUploader::base64Encode(const uint8_t *src, size_t len, char *dst) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for(size_t ii = 0; ii < len; ii += 3) {
+        uint32_t value = (uint32_t)src[ii] << 16;
+        if (ii + 1 < len) {
+            value |= (uint32_t)src[ii + 1] << 8;
+        }
+        if (ii + 2 < len) {
+            value |= src[ii + 2];
+        }
+        *dst++ = table[(value >> 18) & 0x3f];
+        *dst++ = table[(value >> 12) & 0x3f];
+        *dst++ = (ii + 1 < len) ? table[(value >> 6) & 0x3f] : '=';
+        *dst++ = (ii + 2 < len) ? table[value & 0x3f] : '=';
+    }
+    *dst = 0;
+}
@@ -0,0 +1,134 @@
+#ifndef __ETHERNETCELLULARTRANSITIONUPLOADERRK_H
+#define __ETHERNETCELLULARTRANSITIONUPLOADERRK_H
+
+#include "EthernetCellularRK.h"
+
+/**
+ * @brief Uploads the EthernetCellular transition log in batched publishes
+ *
+ * The transition log (see EthernetCellular::withTransitionLog()) keeps compact records of each
+ * state transition in retained memory. This class publishes the records that have not been 
+ * uploaded yet, packed into as few events as possible, so you can analyze failovers across
+ * a fleet without using one publish per transition.
+ *
+ * The event data is JSON: `{"seq":12,"n":5,"d":"..."}` where seq is the sequence number of the
+ * first record, n is the number of records, and d is the Base64 encoded array of 
+ * EthernetCellular::TransitionRecord structures (16 bytes each, little endian). A gap between 
+ * one event's seq + n and the next event's seq means records were overwritten before they 
+ * could be uploaded.
+ *
+ * Records are uploaded at most once per Ethernet period while on Ethernet or Wi-Fi, and at 
+ * most once per cellular period (default: 1 hour) while on cellular, to save data operations.
+ *
+ * Create one of these as a global variable, and call setup() and loop() from the global
+ * application setup() and loop(), after EthernetCellular::instance().setup() and .loop().
+ *
+ * ```
+ * EthernetCellularTransitionUploader transitionUploader;
+ *
+ * void setup() {
+ *     EthernetCellular::instance()
+ *         .withTransitionLog()
+ *         .setup();
+ *     transitionUploader.setup();
+ * }
+ *
+ * void loop() {
+ *     EthernetCellular::instance().loop();
+ *     transitionUploader.loop();
+ * }
+ * ```
+ */
+class EthernetCellularTransitionUploader {
+public:
+    /**
+     * @brief Construct an uploader
+     *
+     * @param eventName Event name to publish. The string must remain valid (typically a string constant).
+     */
+    EthernetCellularTransitionUploader(const char *eventName = "ethcellLog");
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~EthernetCellularTransitionUploader();
+
+    /**
+     * @brief Sets the minimum time between uploads while on Ethernet or Wi-Fi (default: 1 minute)
+     */
+    EthernetCellularTransitionUploader &withEthernetPeriod(std::chrono::milliseconds value) { ethernetPeriod = value; return *this; };
+
+    /**
+     * @brief Sets the minimum time between uploads while on cellular (default: 1 hour)
+     *
+     * Use a very large value to only upload over Ethernet.
+     */
+    EthernetCellularTransitionUploader &withCellularPeriod(std::chrono::milliseconds value) { cellularPeriod = value; return *this; };
+
+    /**
+     * @brief Sets the maximum size of event data (default: 622 bytes)
+     *
+     * This determines the number of records per publish. It should match the limit for your
+     * device and Device OS version (622 or 1024 bytes).
+     */
+    EthernetCellularTransitionUploader &withMaxEventDataSize(size_t value) { maxEventDataSize = value; return *this; };
+
+    /**
+     * @brief Perform setup operations; call this from global application setup()
+     */
+    void setup();
+
+    /**
+     * @brief Perform application loop operations; call this from global application loop()
+     */
+    void loop();
+
+    /**
+     * @brief Returns the number of records that have not been uploaded yet
+     */
+    uint32_t getNumPending() const;
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    EthernetCellularTransitionUploader(const EthernetCellularTransitionUploader&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    EthernetCellularTransitionUploader& operator=(const EthernetCellularTransitionUploader&) = delete;
+
+    /**
+     * @brief Returns true if there's an active interface, it's not draining for a switch, the
+     * cloud is connected, and the period for the active interface has elapsed
+     */
+    bool canUpload() const;
+
+    /**
+     * @brief Builds the event data in dataBuf for the records starting at seq
+     *
+     * @return The number of records included
+     */
+    size_t buildPublish(uint32_t seq);
+
+    /**
+     * @brief Base64 encodes len bytes of src into dst, which must have room for 4 * ((len + 2) / 3) + 1 bytes
+     */
+    static void base64Encode(const uint8_t *src, size_t len, char *dst);
+
+    const char *eventName;                              //!< Event name to publish
+    std::chrono::milliseconds ethernetPeriod = 1min;    //!< Minimum time between uploads on Ethernet or Wi-Fi
+    std::chrono::milliseconds cellularPeriod = 1h;      //!< Minimum time between uploads on cellular
+    size_t maxEventDataSize = 622;                      //!< Maximum event data size
+
+    char *dataBuf = nullptr;                            //!< Event data being published, allocated in setup()
+
+    bool publishInProgress = false;                     //!< true if waiting for publishFuture
+    particle::Future<bool> publishFuture;               //!< Result of the publish in progress
+    uint32_t inFlightEnd = 0;                           //!< Sequence number after the last record in the publish in progress
+    unsigned long lastPublish = 0;                      //!< millis() value at the last publish attempt
+    bool published = false;                             //!< true after the first publish attempt, so the first upload isn't delayed
+};
+
+#endif /* __ETHERNETCELLULARTRANSITIONUPLOADERRK_H */
@@ -0,0 +1,259 @@
+// Host simulation of EthernetCellular failover scenarios
+//
+// Runs the real state machine against the models in mock/ on a virtual clock and prints, for
+// the given timeout configuration:
+// - time to cloud over each interface (average, from the library stats)
+// - cloud down seconds per hour
+// - number of switchovers between interfaces
+//
+// Usage: failover_sim <scenario> [options]
+//
+// Scenarios: lan-up-wan-down, flapping-link, dead-tower, slow-dhcp
+//
+// Options (times in seconds):
+//   --ethernet-connect-timeout N
+//   --ethernet-cloud-timeout N
+//   --cellular-connect-timeout N
+//   --cellular-cloud-timeout N
+//   --retry-ethernet N
+//   --link-monitor          Enable the Ethernet link monitor
+//   --make-before-break     Enable make-before-break Ethernet retry
+//   --probe                 Probe the 8.8.8.8 and 1.1.1.1 DNS servers while on Ethernet
+//   --duration N            Simulated time (default: 7200)
+//   --verbose               Print the library log messages
+//
+// Limits, which override the scenario's defaults for runs with options that change the result:
+//   --max-cloud-down N      Cloud down seconds per hour
+//   --max-switchovers N     Number of switchovers
+//
+// The run fails if the library didn't fail over the way the scenario expects, or if the cloud
+// down time, switchovers, or maximum time to cloud on either interface are over the limits.
+
+#include "Particle.h"
+
+#include "EthernetCellularRK.h"
+
+#include <stdlib.h>
+
+// Milliseconds per simulation step
+static const unsigned long TICK_MS = 100;
+
+// Every scenario runs normally for this long before the fault starts
+static const unsigned long FAULT_START = 10 * 60 * 1000;
+
+struct Limits {
+    double maxCloudDown;            //!< Cloud down seconds per hour
+    unsigned maxSwitchovers;        //!< Number of switchovers
+    double maxEthernetTimeToCloud;  //!< Seconds, for the slowest Ethernet connection
+    double maxCellularTimeToCloud;  //!< Seconds, for the slowest cellular connection
+};
+
+struct Scenario {
+    const char *name;
+    const char *description;
+    void (*setup)();
+    void (*tick)(unsigned long now);
+    bool (*check)(const EthernetCellular::Stats &stats);
+    Limits limits;                  //!< With the default settings, about 20% over the current results
+};
+
+static bool inRange(unsigned long now, unsigned long start, unsigned long end) {
+    return now >= start && now < end;
+}
+
+static void setEthernetLink(bool up) {
+    mock::ethernetLinkUp = up;
+    Ethernet.available = up;
+}
+
+static void defaultSetup() {
+    Ethernet.readyDelay = 3000;
+    Ethernet.cloudDelay = 2000;
+    Cellular.readyDelay = 20000;
+    Cellular.cloudDelay = 8000;
+}
+
+// Ethernet link and DHCP stay up, but the LAN loses its Internet connection for 30 minutes
+static void lanUpWanDownTick(unsigned long now) {
+    Ethernet.wanUp = !inRange(now, FAULT_START, FAULT_START + 30 * 60 * 1000);
+}
+
+static bool lanUpWanDownCheck(const EthernetCellular::Stats &stats) {
+    return stats.cellular.connectCount > 0 && stats.switchoverCount >= 2;
+}
+
+// Ethernet link goes down for 60 seconds and comes back for 30 seconds, for 45 minutes
+static void flappingLinkTick(unsigned long now) {
+    bool flapping = inRange(now, FAULT_START, FAULT_START + 45 * 60 * 1000);
+    setEthernetLink(!flapping || ((now - FAULT_START) % 90000) >= 60000);
+}
+
+static bool flappingLinkCheck(const EthernetCellular::Stats &stats) {
+    return stats.switchoverCount >= 2;
+}
+
+// Ethernet cable is unplugged for an hour, and there is no cellular service for the first 30 minutes of it
+static void deadTowerTick(unsigned long now) {
+    setEthernetLink(!inRange(now, FAULT_START, FAULT_START + 60 * 60 * 1000));
+    Cellular.available = !inRange(now, FAULT_START, FAULT_START + 30 * 60 * 1000);
+}
+
+static bool deadTowerCheck(const EthernetCellular::Stats &stats) {
+    return stats.cellular.connectCount > 0 && stats.cloudDownCount >= 2;
+}
+
+// Ethernet cable is unplugged for a minute, and after that the DHCP server takes 45 seconds to answer
+static void slowDhcpTick(unsigned long now) {
+    setEthernetLink(!inRange(now, FAULT_START, FAULT_START + 60 * 1000));
+    if (now >= FAULT_START) {
+        Ethernet.readyDelay = 45000;
+    }
+}
+
+static bool slowDhcpCheck(const EthernetCellular::Stats &stats) {
+    return stats.cellular.connectCount > 0;
+}
+
+// The time to cloud limits are the connect delays in defaultSetup() plus some margin
+static const Scenario scenarios[] = {
+    { "lan-up-wan-down", "LAN up, WAN down for 30 minutes", defaultSetup, lanUpWanDownTick, lanUpWanDownCheck, { 180, 3, 10, 40 } },
+    { "flapping-link", "Ethernet link down 60 seconds, up 30 seconds, for 45 minutes", defaultSetup, flappingLinkTick, flappingLinkCheck, { 290, 6, 10, 40 } },
+    { "dead-tower", "Ethernet unplugged for 60 minutes, no cellular service for the first 30", defaultSetup, deadTowerTick, deadTowerCheck, { 1280, 3, 10, 40 } },
+    { "slow-dhcp", "Ethernet unplugged for 1 minute, then DHCP takes 45 seconds", defaultSetup, slowDhcpTick, slowDhcpCheck, { 670, 2, 10, 40 } },
+};
+
+static void usage() {
+    printf("usage: failover_sim <scenario> [options]\n");
+    printf("scenarios:\n");
+    for(const Scenario &scenario : scenarios) {
+        printf("  %-16s %s\n", scenario.name, scenario.description);
+    }
+}
+
+static void printInterface(const char *name, const EthernetCellular::InterfaceStats &stats) {
+    if (stats.connectCount == 0) {
+        printf("  time to cloud %-9s -\n", name);
+        return;
+    }
+    printf("  time to cloud %-9s avg %6.1f s  max %6.1f s  (%u connections)\n", name,
+        (double)stats.totalTimeToCloud / stats.connectCount / 1000.0, stats.maxTimeToCloud / 1000.0, (unsigned)stats.connectCount);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage();
+        return 2;
+    }
+
+    const Scenario *scenario = nullptr;
+    for(const Scenario &s : scenarios) {
+        if (strcmp(s.name, argv[1]) == 0) {
+            scenario = &s;
+        }
+    }
+    if (!scenario) {
+        usage();
+        return 2;
+    }
+
+    EthernetCellular &ethCell = EthernetCellular::instance();
+    unsigned long duration = 2 * 60 * 60 * 1000;
+    Limits limits = scenario->limits;
+
+    for(int ii = 2; ii < argc; ii++) {
+        const char *arg = argv[ii];
+        bool hasValue = (ii + 1 < argc);
+        std::chrono::milliseconds value(hasValue ? atol(argv[ii + 1]) * 1000 : 0);
+
+        if (strcmp(arg, "--verbose") == 0) {
+            mock::verbose = true;
+        }
+        else if (strcmp(arg, "--link-monitor") == 0) {
+            ethCell.withEthernetLinkMonitor();
+        }
+        else if (strcmp(arg, "--make-before-break") == 0) {
+            ethCell.withMakeBeforeBreak();
+        }
+        else if (strcmp(arg, "--probe") == 0) {
+            ethCell.withProbeHost("8.8.8.8").withProbeHost("1.1.1.1");
+        }
+        else if (hasValue && strcmp(arg, "--ethernet-connect-timeout") == 0) {
+            ethCell.withEthernetConnectTimeout(value);
+            ii++;
+        }
+        else if (hasValue && strcmp(arg, "--ethernet-cloud-timeout") == 0) {
+            ethCell.withEthernetCloudConnectTimeout(value);
+            ii++;
+        }
+        else if (hasValue && strcmp(arg, "--cellular-connect-timeout") == 0) {
+            ethCell.withCellularConnectTimeout(value);
+            ii++;
+        }
+        else if (hasValue && strcmp(arg, "--cellular-cloud-timeout") == 0) {
+            ethCell.withCellularCloudConnectTimeout(value);
+            ii++;
+        }
+        else if (hasValue && strcmp(arg, "--retry-ethernet") == 0) {
+            ethCell.withRetryEthernetPeriod(value);
+            ii++;
+        }
+        else if (hasValue && strcmp(arg, "--duration") == 0) {
+            duration = (unsigned long) value.count();
+            ii++;
+        }
+        else if (hasValue && strcmp(arg, "--max-cloud-down") == 0) {
+            limits.maxCloudDown = atof(argv[ii + 1]);
+            ii++;
+        }
+        else if (hasValue && strcmp(arg, "--max-switchovers") == 0) {
+            limits.maxSwitchovers = (unsigned) atoi(argv[ii + 1]);
+            ii++;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    scenario->setup();
+    ethCell.setup();
+
+    while(mock::now < duration) {
+        scenario->tick(mock::now);
+        ethCell.loop();
+        mock::advance(TICK_MS);
+    }
+
+    EthernetCellular::Stats stats = ethCell.getStats();
+    double hours = stats.elapsedTime / 3600000.0;
+
+    printf("%s: %s\n", scenario->name, scenario->description);
+    printInterface("Ethernet", stats.ethernet);
+    printInterface("cellular", stats.cellular);
+    double cloudDown = (hours > 0) ? (stats.cloudDownTime / 1000.0 / hours) : 0.0;
+    printf("  cloud down    %6.1f s/hour  (%u periods)\n", cloudDown, (unsigned)stats.cloudDownCount);
+    printf("  switchovers   %u\n", (unsigned)stats.switchoverCount);
+
+    int result = 0;
+    if (!scenario->check(stats)) {
+        printf("FAILED: the library did not fail over as expected\n");
+        result = 1;
+    }
+    if (cloudDown > limits.maxCloudDown) {
+        printf("FAILED: cloud down %.1f s/hour is over the limit of %.1f\n", cloudDown, limits.maxCloudDown);
+        result = 1;
+    }
+    if (stats.switchoverCount > limits.maxSwitchovers) {
+        printf("FAILED: %u switchovers is over the limit of %u\n", (unsigned)stats.switchoverCount, limits.maxSwitchovers);
+        result = 1;
+    }
+    if (stats.ethernet.maxTimeToCloud / 1000.0 > limits.maxEthernetTimeToCloud) {
+        printf("FAILED: Ethernet time to cloud %.1f s is over the limit of %.1f\n", stats.ethernet.maxTimeToCloud / 1000.0, limits.maxEthernetTimeToCloud);
+        result = 1;
+    }
+    if (stats.cellular.maxTimeToCloud / 1000.0 > limits.maxCellularTimeToCloud) {
+        printf("FAILED: cellular time to cloud %.1f s is over the limit of %.1f\n", stats.cellular.maxTimeToCloud / 1000.0, limits.maxCellularTimeToCloud);
+        result = 1;
+    }
+    return result;
+}
@@ -0,0 +1,363 @@
+// Host mock of the Device OS APIs used by EthernetCellularRK, for the failover simulation in test/
+//
+// Only what the library uses is declared. Time comes from a virtual clock that the simulation
+// advances, and Ethernet, Cellular, and the cloud connection are simple models whose behavior
+// (link, DHCP, tower, WAN) the scenario controls through the mock namespace.
+#ifndef __MOCK_PARTICLE_H
+#define __MOCK_PARTICLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+
+using namespace std::chrono_literals;
+
+#define SYSTEM_VERSION_DEFAULT(a, b, c) (((a) << 24) | ((b) << 16) | ((c) << 8))
+#define SYSTEM_VERSION SYSTEM_VERSION_DEFAULT(5, 8, 0)
+
+#define Wiring_Cellular 1
+#define Wiring_WiFi 0
+
+#define retained
+#define SYSTEM_THREAD(x)
+#define SYSTEM_MODE(x)
+
+#define RGB_COLOR_CYAN 0x0000ffff
+#define RGB_COLOR_YELLOW 0x00ffff00
+#define LED_SIGNAL_CLOUD_CONNECTING 1
+#define LED_SIGNAL_CLOUD_HANDSHAKE 2
+#define LED_SIGNAL_CLOUD_CONNECTED 3
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_INFO 1
+
+typedef uint32_t system_tick_t;
+
+unsigned long millis();
+void delay(unsigned long ms);
+int32_t random(int32_t low, int32_t high);
+
+class String {
+public:
+    String() {};
+    String(const char *s) : s(s ? s : "") {};
+    const char *c_str() const { return s.c_str(); };
+    size_t length() const { return s.size(); };
+
+    std::string s;
+};
+
+class IPAddress {
+public:
+    IPAddress() {};
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : v(((uint32_t)a << 24) | ((uint32_t)b << 16) | ((uint32_t)c << 8) | d) {};
+    operator bool() const { return v != 0; };
+    uint8_t operator[](int index) const { return (uint8_t)(v >> (24 - 8 * index)); };
+    bool operator==(const IPAddress &other) const { return v == other.v; };
+    bool operator!=(const IPAddress &other) const { return v != other.v; };
+
+    uint32_t v = 0;
+};
+
+class Logger {
+public:
+    Logger(const char *name) : name(name) {};
+    void trace(const char *fmt, ...) const;
+    void info(const char *fmt, ...) const;
+    void warn(const char *fmt, ...) const;
+    void error(const char *fmt, ...) const;
+
+    const char *name;
+};
+
+typedef int network_interface_t;
+
+enum class NetworkInterfaceConfigSource { NONE = 0, DHCP = 1, STATIC = 2 };
+
+class NetworkInterfaceConfig {
+public:
+    NetworkInterfaceConfig &source(NetworkInterfaceConfigSource value) { configSource = value; return *this; };
+    NetworkInterfaceConfig &address(IPAddress addr, IPAddress) { configAddress = addr; return *this; };
+    NetworkInterfaceConfig &gateway(IPAddress) { return *this; };
+    NetworkInterfaceConfig &dns(IPAddress) { return *this; };
+
+    NetworkInterfaceConfigSource configSource = NetworkInterfaceConfigSource::DHCP;
+    IPAddress configAddress;
+};
+
+/**
+ * @brief Model of one network interface
+ *
+ * After connect(), the interface becomes ready readyDelay milliseconds after it is available
+ * (link up and DHCP answering for Ethernet, tower in range for cellular). It stops being ready
+ * while it is not available and becomes ready again readyDelay after it is available again.
+ */
+class NetworkClass {
+public:
+    NetworkClass(network_interface_t nif, const char *name) : nif(nif), name(name) {};
+
+    void connect();
+    void disconnect();
+    bool ready();
+    bool connecting();
+    bool listening() { return false; };
+    void on() { powered = true; };
+    void off();
+    bool isOn() { return powered; };
+    bool isOff() { return !powered; };
+
+    uint8_t *macAddress(uint8_t *mac);
+    IPAddress localIP() { return ready() ? IPAddress(192, 168, 1, 50) : IPAddress(); };
+    IPAddress subnetMask() { return ready() ? IPAddress(255, 255, 255, 0) : IPAddress(); };
+    IPAddress gatewayIP() { return ready() ? IPAddress(192, 168, 1, 1) : IPAddress(); };
+    IPAddress dnsServerIP() { return ready() ? IPAddress(192, 168, 1, 1) : IPAddress(); };
+    IPAddress resolve(const char *) { return (ready() && wanUp) ? IPAddress(10, 0, 0, 1) : IPAddress(); };
+    int setConfig(const NetworkInterfaceConfig &config) { lastConfig = config; setConfigCount++; return 0; };
+
+    operator network_interface_t() const { return nif; };
+
+    /**
+     * @brief Called by the simulation every tick to update ready()
+     */
+    void tick();
+
+    network_interface_t nif;
+    const char *name;
+
+    // Controlled by the scenario
+    bool present = true;                //!< Adapter or modem is present
+    bool available = true;              //!< Ethernet link up and DHCP answering, or cellular tower in range
+    bool wanUp = true;                  //!< The cloud can be reached over this interface
+    unsigned long readyDelay = 0;       //!< Time from available to ready (DHCP or registration)
+    unsigned long cloudDelay = 0;       //!< Time to connect to the cloud over this interface
+
+    // State of the model
+    bool powered = true;
+    bool wantConnected = false;
+    bool isReady = false;
+    unsigned long availableTime = 0;
+    NetworkInterfaceConfig lastConfig;
+    int setConfigCount = 0;
+    int connectCount = 0;
+};
+
+class CellularSignal {
+public:
+    float getStrength() { return 75.0; };
+    float getQuality() { return 50.0; };
+    int getAccessTechnology() { return 8; };
+};
+
+class CellularClass : public NetworkClass {
+public:
+    CellularClass() : NetworkClass(2, "cellular") {};
+    CellularSignal RSSI() { return CellularSignal(); };
+    template<typename... Args> int command(const char *fmt, Args... args) { return 0; };
+};
+
+struct CellularGlobalIdentity {
+    uint16_t size;
+    uint16_t version;
+    uint16_t mobile_country_code;
+    uint16_t mobile_network_code;
+    uint16_t location_area_code;
+    uint32_t cell_id;
+};
+#define CGI_VERSION_LATEST 1
+int cellular_global_identity(CellularGlobalIdentity *cgi, void *reserved);
+
+extern NetworkClass Ethernet;
+extern CellularClass Cellular;
+extern NetworkClass Network;
+
+namespace particle {
+template<typename T> class Future {
+public:
+    bool isDone() const { return true; };
+    bool isSucceeded() const { return true; };
+};
+}
+
+namespace particle {
+namespace protocol {
+const size_t MAX_EVENT_NAME_LENGTH = 64;
+const size_t MAX_EVENT_DATA_LENGTH = 1024;
+}
+}
+
+class PublishFlags {
+public:
+    PublishFlags() {};
+    PublishFlags(int value) : v(value) {};
+    PublishFlags operator|(const PublishFlags &other) const { return PublishFlags(v | other.v); };
+    uint8_t value() const { return (uint8_t)v; };
+    static PublishFlags fromValue(uint8_t value) { return PublishFlags(value); };
+    int v = 0;
+};
+static const PublishFlags PUBLIC(0);
+static const PublishFlags PRIVATE(1);
+static const PublishFlags NO_ACK(2);
+static const PublishFlags WITH_ACK(8);
+
+/**
+ * @brief Model of the cloud connection
+ *
+ * The cloud connects over Ethernet if it is ready, otherwise over cellular, cloudDelay after
+ * the interface is ready, as long as the WAN is up on that interface. The connection is lost
+ * right away if the interface stops being ready, and lossDetectTime after the WAN goes down.
+ */
+class CloudClass {
+public:
+    void connect() { wantConnected = true; };
+    void disconnect() { wantConnected = false; };
+    bool connected() { return isConnected; };
+    bool disconnected() { return !isConnected; };
+    void keepAlive(int value) { keepAliveValue = value; };
+    particle::Future<bool> publish(const char *, const char *, PublishFlags = PublishFlags()) { return particle::Future<bool>(); };
+    template<typename T> bool function(const char *, int (T::*)(String), T *) { return true; };
+
+    void tick();
+
+    // Controlled by the scenario
+    unsigned long lossDetectTime = 40000;   //!< Time to notice the WAN went down while connected
+
+    // State of the model
+    bool wantConnected = false;
+    bool isConnected = false;
+    NetworkClass *network = nullptr;        //!< Interface connected or connecting over
+    unsigned long connectStart = 0;
+    unsigned long wanDownTime = 0;
+    int keepAliveValue = 0;
+};
+extern CloudClass Particle;
+
+enum system_event_t : uint64_t { network_status = 1 << 1, cloud_status = 1 << 2 };
+typedef void (*system_event_handler_t)(system_event_t event, int param);
+
+enum class SystemSleepWakeupReason { UNKNOWN = 0, BY_GPIO = 1, BY_RTC = 3, BY_NETWORK = 6 };
+
+#define FEATURE_ETHERNET_DETECTION 1
+
+#define RESET_REASON_NONE 0
+#define RESET_REASON_POWER_MANAGEMENT 70
+
+class SystemClass {
+public:
+    bool featureEnabled(int) { return true; };
+    int enableFeature(int) { return 0; };
+    bool on(uint64_t, system_event_handler_t handler) { eventHandler = handler; return true; };
+    int resetReason() { return RESET_REASON_NONE; };
+
+    system_event_handler_t eventHandler = nullptr;
+};
+extern SystemClass System;
+
+class LEDSystemTheme {
+public:
+    void setColor(int, uint32_t) {};
+    void apply(bool = false) {};
+    static void restoreDefault() {};
+};
+
+class TimeClass {
+public:
+    bool isValid() { return true; };
+    time_t now() { return (time_t)(1700000000 + millis() / 1000); };
+};
+extern TimeClass Time;
+
+class EEPROMClass {
+public:
+    template<typename T> T &get(int offset, T &t) { memcpy(&t, &data[offset], sizeof(T)); return t; };
+    template<typename T> const T &put(int offset, const T &t) { memcpy(&data[offset], &t, sizeof(T)); return t; };
+    size_t length() { return sizeof(data); };
+    uint8_t data[4096] = {};
+};
+extern EEPROMClass EEPROM;
+
+/**
+ * @brief Stub of TCPClient for EthernetCellularTCPClient; application TCP connections are not modeled and always fail
+ */
+class TCPClient {
+public:
+    virtual ~TCPClient() {};
+    virtual int connect(IPAddress, uint16_t, network_interface_t = 0) { return 0; };
+    virtual int connect(const char *, uint16_t, network_interface_t = 0) { return 0; };
+    virtual size_t write(uint8_t) { return 0; };
+    virtual size_t write(const uint8_t *, size_t) { return 0; };
+    virtual size_t write(const uint8_t *, size_t, system_tick_t) { return 0; };
+    virtual int read() { return -1; };
+    virtual int read(uint8_t *, size_t) { return -1; };
+    virtual void stop() {};
+};
+
+/**
+ * @brief Model of a UDP socket used for DNS queries
+ *
+ * A query sent on a socket bound to an interface is answered with 10.0.0.1 after 50 milliseconds
+ * if the interface is ready and its WAN is up, and not answered otherwise.
+ */
+class UDP {
+public:
+    virtual ~UDP() {};
+    virtual uint8_t begin(uint16_t, network_interface_t nif = 0) { this->nif = nif; return 1; };
+    virtual void stop() { queryLen = 0; };
+    virtual int sendPacket(const uint8_t *buf, size_t len, IPAddress addr, uint16_t port);
+    virtual int receivePacket(uint8_t *buf, size_t len, system_tick_t timeout = 0);
+
+    // The stream API isn't used with DNS, so it's only stubbed for EthernetCellularUDP
+    virtual int beginPacket(IPAddress, uint16_t) { return 0; };
+    virtual int endPacket() { return 0; };
+    virtual int parsePacket(system_tick_t = 0) { return 0; };
+
+    network_interface_t nif = 0;
+    uint8_t query[512];
+    size_t queryLen = 0;
+    unsigned long sendTime = 0;
+};
+
+typedef void os_thread_return_t;
+#define OS_THREAD_PRIORITY_DEFAULT 2
+class Thread {
+public:
+    Thread(const char *, os_thread_return_t (*)(void *), void *, int, size_t) {};
+};
+
+class RecursiveMutex {
+public:
+    void lock() { mutex.lock(); };
+    void unlock() { mutex.unlock(); };
+    bool trylock() { return mutex.try_lock(); };
+    std::recursive_mutex mutex;
+};
+
+namespace mock {
+/**
+ * @brief Current virtual time in milliseconds
+ */
+extern unsigned long now;
+
+/**
+ * @brief true to print library log messages
+ */
+extern bool verbose;
+
+/**
+ * @brief Ethernet link status returned by if_get_flags()
+ */
+extern bool ethernetLinkUp;
+
+/**
+ * @brief Advances the virtual clock and updates the network and cloud models
+ */
+void advance(unsigned long ms);
+}
+
+#endif /* __MOCK_PARTICLE_H */
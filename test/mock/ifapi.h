@@ -0,0 +1,17 @@
+// Host mock of the Device OS network interface API, for the failover simulation in test/
+#ifndef __MOCK_IFAPI_H
+#define __MOCK_IFAPI_H
+
+#include <stdint.h>
+
+struct if_mock;
+typedef struct if_mock *if_t;
+
+#define IFF_UP 0x1
+#define IFF_LOWER_UP 0x10000
+
+int if_get_by_index(uint8_t index, if_t *iface);
+int if_get_flags(if_t iface, unsigned int *flags);
+int if_index_to_name(uint8_t index, char *name);
+
+#endif /* __MOCK_IFAPI_H */
@@ -0,0 +1,307 @@
+#include "Particle.h"
+#include "ifapi.h"
+#include "socket_hal.h"
+
+#include <stdarg.h>
+
+#include <map>
+
+NetworkClass Ethernet(1, "Ethernet");
+CellularClass Cellular;
+NetworkClass Network(0, "Network");
+CloudClass Particle;
+SystemClass System;
+TimeClass Time;
+EEPROMClass EEPROM;
+
+namespace mock {
+unsigned long now = 0;
+bool verbose = false;
+bool ethernetLinkUp = true;
+}
+
+static void log(const char *level, const char *name, const char *fmt, va_list ap) {
+    if (!mock::verbose) {
+        return;
+    }
+    printf("%8.1f [%s] %s: ", mock::now / 1000.0, name, level);
+    vprintf(fmt, ap);
+    printf("\n");
+}
+
+void Logger::trace(const char *fmt, ...) const {
+    va_list ap;
+    va_start(ap, fmt);
+    log("TRACE", name, fmt, ap);
+    va_end(ap);
+}
+
+void Logger::info(const char *fmt, ...) const {
+    va_list ap;
+    va_start(ap, fmt);
+    log("INFO", name, fmt, ap);
+    va_end(ap);
+}
+
+void Logger::warn(const char *fmt, ...) const {
+    va_list ap;
+    va_start(ap, fmt);
+    log("WARN", name, fmt, ap);
+    va_end(ap);
+}
+
+void Logger::error(const char *fmt, ...) const {
+    va_list ap;
+    va_start(ap, fmt);
+    log("ERROR", name, fmt, ap);
+    va_end(ap);
+}
+
+static Logger _log("mock");
+
+unsigned long millis() {
+    return mock::now;
+}
+
+void delay(unsigned long ms) {
+    mock::advance(ms);
+}
+
+int32_t random(int32_t low, int32_t high) {
+    return low + (int32_t)(rand() % (high - low));
+}
+
+static void systemEvent(system_event_t event, int param) {
+    if (System.eventHandler) {
+        System.eventHandler(event, param);
+    }
+}
+
+void NetworkClass::connect() {
+    if (nif == 0) {
+        Ethernet.connect();
+        Cellular.connect();
+        return;
+    }
+    if (!wantConnected) {
+        connectCount++;
+    }
+    powered = true;
+    wantConnected = true;
+}
+
+void NetworkClass::disconnect() {
+    if (nif == 0) {
+        return;
+    }
+    wantConnected = false;
+    tick();
+}
+
+bool NetworkClass::ready() {
+    if (nif == 0) {
+        return Ethernet.ready() || Cellular.ready();
+    }
+    return isReady;
+}
+
+bool NetworkClass::connecting() {
+    return wantConnected && !isReady;
+}
+
+void NetworkClass::off() {
+    disconnect();
+    powered = false;
+}
+
+uint8_t *NetworkClass::macAddress(uint8_t *mac) {
+    if (!present) {
+        return nullptr;
+    }
+    const uint8_t value[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, (uint8_t)nif };
+    memcpy(mac, value, sizeof(value));
+    return mac;
+}
+
+void NetworkClass::tick() {
+    bool wasReady = isReady;
+
+    if (!present || !powered || !wantConnected || !available) {
+        isReady = false;
+        availableTime = 0;
+    }
+    else if (!isReady) {
+        if (availableTime == 0) {
+            availableTime = mock::now;
+        }
+        if (mock::now - availableTime >= readyDelay) {
+            isReady = true;
+        }
+    }
+
+    if (isReady != wasReady) {
+        _log.info("%s %s", name, isReady ? "ready" : "not ready");
+        systemEvent(network_status, 0);
+    }
+}
+
+void CloudClass::tick() {
+    bool wasConnected = isConnected;
+
+    if (!wantConnected) {
+        isConnected = false;
+        network = nullptr;
+    }
+    else if (isConnected) {
+        if (!network->ready()) {
+            // Interface went down, Device OS notices right away
+            isConnected = false;
+            network = nullptr;
+        }
+        else if (!network->wanUp) {
+            // Takes a keep-alive and retransmissions to notice
+            if (wanDownTime == 0) {
+                wanDownTime = mock::now;
+            }
+            if (mock::now - wanDownTime >= lossDetectTime) {
+                isConnected = false;
+                network = nullptr;
+            }
+        }
+        else {
+            wanDownTime = 0;
+        }
+    }
+    else {
+        NetworkClass *next = Ethernet.ready() ? (NetworkClass *)&Ethernet : (Cellular.ready() ? (NetworkClass *)&Cellular : nullptr);
+        if (next != network) {
+            network = next;
+            connectStart = mock::now;
+        }
+        if (network && network->wanUp && mock::now - connectStart >= network->cloudDelay) {
+            isConnected = true;
+            wanDownTime = 0;
+        }
+    }
+
+    if (isConnected != wasConnected) {
+        _log.info("cloud %s", isConnected ? "connected" : "disconnected");
+        systemEvent(cloud_status, 0);
+    }
+}
+
+int cellular_global_identity(CellularGlobalIdentity *cgi, void *) {
+    cgi->mobile_country_code = 310;
+    cgi->mobile_network_code = 410;
+    return 0;
+}
+
+static NetworkClass &networkForNif(network_interface_t nif) {
+    return (nif == (network_interface_t)Cellular) ? (NetworkClass &)Cellular : Ethernet;
+}
+
+int UDP::sendPacket(const uint8_t *buf, size_t len, IPAddress, uint16_t) {
+    if (len > sizeof(query)) {
+        return -1;
+    }
+    memcpy(query, buf, len);
+    queryLen = len;
+    sendTime = mock::now;
+    return (int)len;
+}
+
+int UDP::receivePacket(uint8_t *buf, size_t len, system_tick_t) {
+    NetworkClass &network = networkForNif(nif);
+    if (queryLen < 12 || !network.ready() || !network.wanUp || mock::now - sendTime < 50) {
+        return 0;
+    }
+
+    // Echo the query with the response bit set and one A record that points back at the question
+    const uint8_t answer[] = { 0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 10, 0, 0, 1 };
+    size_t count = queryLen + sizeof(answer);
+    if (count > len) {
+        return -1;
+    }
+    memcpy(buf, query, queryLen);
+    memcpy(&buf[queryLen], answer, sizeof(answer));
+    buf[2] |= 0x80;
+    buf[7] = 1;
+    queryLen = 0;
+    return (int)count;
+}
+
+struct MockSocket {
+    network_interface_t nif = 0;
+    unsigned long connectTime = 0;
+    bool connecting = false;
+};
+static std::map<int, MockSocket> sockets;
+static int nextSocket = 1;
+
+int sock_socket(int, int, int) {
+    sockets[nextSocket] = MockSocket();
+    return nextSocket++;
+}
+
+int sock_setsockopt(int s, int, int optname, const void *optval, socklen_t) {
+    if (optname == SO_BINDTODEVICE) {
+        sockets[s].nif = (network_interface_t)(((const struct ifreq *)optval)->ifr_name[0] - '0');
+    }
+    return 0;
+}
+
+int sock_getsockopt(int, int, int, void *optval, socklen_t *) {
+    *(int *)optval = 0;
+    return 0;
+}
+
+int sock_fcntl(int, int, ...) {
+    return 0;
+}
+
+int sock_connect(int s, const struct sockaddr *, socklen_t) {
+    sockets[s].connecting = true;
+    sockets[s].connectTime = mock::now;
+    errno = EINPROGRESS;
+    return -1;
+}
+
+int sock_poll(struct pollfd *fds, nfds_t, int) {
+    MockSocket &sock = sockets[fds[0].fd];
+    NetworkClass &network = networkForNif(sock.nif);
+    fds[0].revents = 0;
+    if (sock.connecting && network.ready() && network.wanUp && mock::now - sock.connectTime >= 100) {
+        fds[0].revents = POLLOUT;
+        return 1;
+    }
+    return 0;
+}
+
+int sock_close(int s) {
+    sockets.erase(s);
+    return 0;
+}
+
+int if_index_to_name(uint8_t index, char *name) {
+    name[0] = (char)('0' + index);
+    name[1] = 0;
+    return 0;
+}
+
+int if_get_by_index(uint8_t, if_t *iface) {
+    static int dummy;
+    *iface = (if_t)&dummy;
+    return 0;
+}
+
+int if_get_flags(if_t, unsigned int *flags) {
+    *flags = IFF_UP | ((Ethernet.present && mock::ethernetLinkUp) ? IFF_LOWER_UP : 0);
+    return 0;
+}
+
+void mock::advance(unsigned long ms) {
+    now += ms;
+    Ethernet.tick();
+    Cellular.tick();
+    Particle.tick();
+}
@@ -0,0 +1,61 @@
+// Host mock of the Device OS POSIX socket API, for the failover simulation in test/
+//
+// Only the non-blocking TCP connect used by EthernetCellularTcpCheck is modeled. The connection
+// completes if the interface the socket is bound to is ready and its WAN is up, and otherwise
+// never completes, like a SYN that is not answered.
+#ifndef __MOCK_SOCKET_HAL_H
+#define __MOCK_SOCKET_HAL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+typedef uint32_t socklen_t;
+typedef uint8_t sa_family_t;
+typedef unsigned int nfds_t;
+
+struct in_addr {
+    uint32_t s_addr;
+};
+
+struct sockaddr {
+    uint8_t sa_len;
+    sa_family_t sa_family;
+    char sa_data[14];
+};
+
+struct sockaddr_in {
+    uint8_t sin_len;
+    sa_family_t sin_family;
+    uint16_t sin_port;
+    struct in_addr sin_addr;
+    char sin_zero[8];
+};
+
+struct ifreq {
+    char ifr_name[6];
+};
+
+struct pollfd {
+    int fd;
+    short events;
+    short revents;
+};
+
+#define AF_INET 2
+#define SOCK_STREAM 1
+#define IPPROTO_TCP 6
+#define SOL_SOCKET 0xfff
+#define SO_ERROR 0x1007
+#define SO_BINDTODEVICE 0x100b
+#define POLLOUT 0x4
+
+int sock_socket(int domain, int type, int protocol);
+int sock_setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen);
+int sock_getsockopt(int s, int level, int optname, void *optval, socklen_t *optlen);
+int sock_fcntl(int s, int cmd, ...);
+int sock_connect(int s, const struct sockaddr *name, socklen_t namelen);
+int sock_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int sock_close(int s);
+
+#endif /* __MOCK_SOCKET_HAL_H */